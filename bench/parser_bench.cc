@@ -0,0 +1,111 @@
+// Microbenchmark of the request parser with each set of scanning kernels
+// the CPU supports, on requests captured from browsers and curl
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "http_message.h"
+#include "scan.h"
+
+using namespace simple_http_server;
+
+static const char *kChromeRequest =
+    "GET /overview.png HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Referer: http://localhost:8080/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,vi;q=0.8\r\n"
+    "Cookie: _ga=GA1.1.1740493514.1697444012; _ga_X5ZK3Q3M1D=GS1.1.1697610000.4.1.1697610212.0.0.0; "
+    "session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIiwibmFtZSI6IkpvaG4gRG9lIiwiaWF0IjoxNTE2MjM5MDIyfQ\r\n"
+    "\r\n";
+
+static const char *kFirefoxRequest =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "If-Modified-Since: Tue, 17 Oct 2023 08:12:31 GMT\r\n"
+    "\r\n";
+
+static const char *kCurlRequest =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+// Parses every request iterations times and returns the time per request in ns
+static double run(const std::vector<std::string> &requests, int iterations)
+{
+    RequestView view;
+    size_t checksum = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        for (const std::string &request : requests)
+        {
+            size_t scan_offset = 0;
+            if (ParseRequest(request, &scan_offset, &view) == ParseStatus::Complete)
+                checksum += view.header_count;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (checksum == 0)
+        std::printf("unexpected parse failure\n");
+    double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+    return ns / (static_cast<double>(iterations) * requests.size());
+}
+
+int main(void)
+{
+    const int kIterations = 200000;
+    const char *kernels[] = {"scalar", "sse4.2", "avx2"};
+    struct
+    {
+        const char *name;
+        std::vector<std::string> requests;
+    } captures[] = {
+        {"chrome", {kChromeRequest}},
+        {"firefox", {kFirefoxRequest}},
+        {"curl", {kCurlRequest}},
+        {"mixed", {kChromeRequest, kFirefoxRequest, kCurlRequest}},
+    };
+
+    std::printf("%-8s %-8s %12s %10s\n", "capture", "kernels", "ns/request", "MB/s");
+    for (auto &capture : captures)
+    {
+        size_t bytes = 0;
+        for (const std::string &request : capture.requests)
+            bytes += request.length();
+        for (const char *kernel : kernels)
+        {
+            if (!set_scan_kernel(kernel))
+                continue;
+            run(capture.requests, kIterations / 10); // warm up
+            double ns = run(capture.requests, kIterations);
+            double mb_per_s = bytes / capture.requests.size() / ns * 1e9 / (1 << 20);
+            std::printf("%-8s %-8s %12.1f %10.1f\n", capture.name, kernel, ns, mb_per_s);
+        }
+    }
+    return 0;
+}
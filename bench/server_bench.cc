@@ -0,0 +1,145 @@
+// End-to-end benchmark of the server with each I/O backend: keep-alive
+// clients on loopback request a handler response and a cached file
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http_server.h"
+
+using namespace simple_http_server;
+
+constexpr int kClientThreads = 4;
+constexpr int kConnectionsPerThread = 16;
+
+static int connectTo(std::uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Reads one response and returns false if the connection failed
+static bool readResponse(int fd, std::string &buffer)
+{
+    size_t length = std::string::npos;
+    while (true)
+    {
+        size_t end = buffer.find("\r\n\r\n");
+        if (end != std::string::npos && length == std::string::npos)
+        {
+            size_t field = buffer.find("Content-Length: ");
+            if (field == std::string::npos || field > end)
+                return false;
+            length = end + 4 + std::strtoul(buffer.c_str() + field + 16, nullptr, 10);
+        }
+        if (length != std::string::npos && buffer.length() >= length)
+        {
+            buffer.erase(0, length);
+            return true;
+        }
+        char chunk[65536];
+        ssize_t count = recv(fd, chunk, sizeof(chunk), 0);
+        if (count <= 0)
+            return false;
+        buffer.append(chunk, count);
+    }
+}
+
+// Runs the clients for a while and returns the requests per second
+static double run(std::uint16_t port, const std::string &path)
+{
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    std::atomic<bool> stop(false);
+    std::atomic<std::uint64_t> total(0);
+    std::vector<std::thread> clients;
+    for (int t = 0; t < kClientThreads; t++)
+    {
+        clients.emplace_back([&]() {
+            // every connection has one request in flight at a time
+            std::vector<int> fds;
+            std::vector<std::string> buffers(kConnectionsPerThread);
+            for (int i = 0; i < kConnectionsPerThread; i++)
+                fds.push_back(connectTo(port));
+            std::uint64_t count = 0;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                for (int fd : fds)
+                    send(fd, request.data(), request.length(), MSG_NOSIGNAL);
+                for (int i = 0; i < kConnectionsPerThread; i++)
+                {
+                    if (!readResponse(fds[i], buffers[i]))
+                    {
+                        std::fprintf(stderr, "connection failed\n");
+                        std::exit(1);
+                    }
+                    count++;
+                }
+            }
+            for (int fd : fds)
+                close(fd);
+            total += count;
+        });
+    }
+    auto begin = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    stop = true;
+    for (std::thread &client : clients)
+        client.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return total / seconds;
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/server_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr)
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    std::string file = std::string(dir) + "/file.bin";
+    std::ofstream(file) << std::string(64 * 1024, 'a');
+
+    std::printf("%-9s %-14s %14s\n", "backend", "request", "requests/s");
+    std::uint16_t port = 18080;
+    for (IoBackend backend : {IoBackend::Epoll, IoBackend::IoUring})
+    {
+        HttpServer server("127.0.0.1", port);
+        server.SetListenMode(ListenMode::ReusePort);
+        server.SetIoBackend(backend);
+        server.ServeDirectory("/static", dir);
+        server.Start();
+        const char *name = server.io_backend() == IoBackend::IoUring ? "io_uring" : "epoll";
+        std::printf("%-9s %-14s %12.0f\n", name, "handler", run(port, "/"));
+        std::printf("%-9s %-14s %12.0f\n", name, "64 KiB file", run(port, "/static/file.bin"));
+        server.Stop();
+        port++;
+    }
+
+    unlink(file.c_str());
+    rmdir(dir);
+    return 0;
+}
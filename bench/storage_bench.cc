@@ -0,0 +1,151 @@
+// Microbenchmark of Storage lookups from 1 to N threads, against the
+// shared_mutex protected map that Storage used before snapshots, with and
+// without a writer reloading a file in the background
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <storage.h>
+
+static const std::vector<std::string> kFiles = {"/index.html", "/style.css", "/app.js",
+                                                "/logo.png"};
+
+static void writeFile(const std::string &path, size_t size, char fill)
+{
+    std::string content(size, fill);
+    int fd = open(("." + path).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, content.data(), content.size()) != static_cast<ssize_t>(size))
+        std::perror(path.c_str());
+    close(fd);
+}
+
+// The read path of Storage before snapshots
+class LockedStorage
+{
+public:
+    explicit LockedStorage(Storage *storage)
+    {
+        for (const std::string &path : kFiles)
+            storage->getResource(path, resources[path]);
+    }
+    bool getResource(const std::string &filePath, ResourcePtr &outRes)
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto it = resources.find(filePath);
+        if (it == resources.end())
+            return false;
+        outRes = it->second;
+        return true;
+    }
+    void replace(const std::string &filePath, const ResourcePtr &resource)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        resources[filePath] = resource;
+    }
+
+private:
+    std::shared_mutex mutex_;
+    std::unordered_map<std::string, ResourcePtr> resources;
+};
+
+// Runs threads readers for a while and returns the lookups per second
+template <typename Lookup>
+static double run(int threads, Lookup lookup)
+{
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> total(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < threads; t++)
+    {
+        readers.emplace_back([&, t]() {
+            uint64_t count = 0;
+            size_t i = t;
+            ResourcePtr resource;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                for (int k = 0; k < 64; k++, i++)
+                    count += lookup(kFiles[i % kFiles.size()], resource);
+            }
+            total += count;
+        });
+    }
+    auto begin = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    stop = true;
+    for (std::thread &reader : readers)
+        reader.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return total / seconds;
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/storage_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0)
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    for (size_t i = 0; i < kFiles.size(); i++)
+        writeFile(kFiles[i], 4096 << i, 'a');
+
+    Storage storage(".");
+    LockedStorage locked(&storage);
+    auto snapshotLookup = [&](const std::string &path, ResourcePtr &out) {
+        return storage.getResource(path, out);
+    };
+    auto lockedLookup = [&](const std::string &path, ResourcePtr &out) {
+        return locked.getResource(path, out);
+    };
+
+    int maxThreads = std::max(2u, std::thread::hardware_concurrency());
+    std::printf("%-8s %-9s %14s %14s\n", "threads", "reloads", "shared_mutex", "snapshot");
+    for (bool reloads : {false, true})
+    {
+        // rewrites a file and reloads it about every millisecond
+        std::atomic<bool> stop(false);
+        std::thread writer;
+        if (reloads)
+        {
+            writer = std::thread([&]() {
+                char fill = 'b';
+                while (!stop)
+                {
+                    writeFile(kFiles[0], 4096, fill++);
+                    storage.updateResource();
+                    ResourcePtr resource;
+                    storage.getResource(kFiles[0], resource);
+                    locked.replace(kFiles[0], resource);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            });
+        }
+        for (int threads = 1; threads <= maxThreads; threads *= 2)
+        {
+            double lockedRate = run(threads, lockedLookup);
+            double snapshotRate = run(threads, snapshotLookup);
+            std::printf("%-8d %-9s %12.1f M %12.1f M\n", threads, reloads ? "yes" : "no",
+                        lockedRate / 1e6, snapshotRate / 1e6);
+        }
+        stop = true;
+        if (writer.joinable())
+            writer.join();
+    }
+
+    for (const std::string &path : kFiles)
+        unlink(("." + path).c_str());
+    chdir("/");
+    rmdir(dir);
+    return 0;
+}
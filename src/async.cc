@@ -0,0 +1,37 @@
+#include "async.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace simple_http_server
+{
+
+    Task<std::string> ReadFileAsync(std::string path)
+    {
+        auto read_file = [path]()
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                throw std::runtime_error("Failed to open " + path + ": " + std::strerror(errno));
+            std::string content;
+            char buffer[65536];
+            ssize_t count;
+            while ((count = read(fd, buffer, sizeof(buffer))) > 0 || (count < 0 && errno == EINTR))
+            {
+                if (count > 0)
+                    content.append(buffer, count);
+            }
+            int error = errno;
+            close(fd);
+            if (count < 0)
+                throw std::runtime_error("Failed to read " + path + ": " + std::strerror(error));
+            return content;
+        };
+        std::string content = co_await RunBlocking(std::move(read_file));
+        co_return content;
+    }
+
+} // namespace simple_http_server
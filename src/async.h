@@ -0,0 +1,180 @@
+// Defines what coroutine handlers can co_await: socket readiness, timers,
+// file reads and work run on the executor. The coroutine is resumed on
+// the worker that runs it, by that worker's event loop.
+
+#ifndef ASYNC_H_
+#define ASYNC_H_
+
+#include <poll.h>
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "task.h"
+#include "timer_wheel.h"
+
+namespace simple_http_server
+{
+
+    // A suspended coroutine and what it waits for. It lives in the frame of
+    // the coroutine, which stays put while it is suspended.
+    struct Waiter
+    {
+        std::coroutine_handle<> handle;
+        int fd = -1;
+        std::uint32_t events = 0; // POLLIN, POLLOUT...
+        int result = 0;           // the events that occurred, or -errno
+        std::function<void()> work;
+        Waiter *next = nullptr; // while it goes back to its worker
+        TimerLink<Waiter> timer;
+    };
+
+    // The event loop of a worker, as seen by the awaitables
+    class AsyncWorker
+    {
+    public:
+        virtual ~AsyncWorker() = default;
+
+        // The worker of the calling thread, or nullptr outside of workers
+        static AsyncWorker *Current() { return current_; }
+        static void SetCurrent(AsyncWorker *worker) { current_ = worker; }
+
+        // Each resumes waiter->handle on this worker: once deadline_ms (of
+        // the steady clock) has passed, once waiter->fd has one of
+        // waiter->events, or once waiter->work has run on the executor.
+        // ResumeWhenReady returns false, with result set, if the fd cannot
+        // be waited for.
+        virtual void ResumeAt(std::uint64_t deadline_ms, Waiter *waiter) = 0;
+        virtual bool ResumeWhenReady(Waiter *waiter) = 0;
+        virtual void ResumeAfterWork(Waiter *waiter) = 0;
+
+    private:
+        static inline thread_local AsyncWorker *current_ = nullptr;
+    };
+
+    namespace detail
+    {
+
+        inline AsyncWorker *CurrentWorker()
+        {
+            AsyncWorker *worker = AsyncWorker::Current();
+            if (worker == nullptr)
+                throw std::logic_error("Awaiting outside of a worker");
+            return worker;
+        }
+
+        struct SleepAwaiter
+        {
+            std::chrono::milliseconds delay;
+            Waiter waiter;
+
+            bool await_ready() const { return delay.count() <= 0; }
+            void await_suspend(std::coroutine_handle<> handle)
+            {
+                waiter.handle = handle;
+                std::uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        std::chrono::steady_clock::now().time_since_epoch())
+                                        .count();
+                CurrentWorker()->ResumeAt(now + delay.count(), &waiter);
+            }
+            void await_resume() const {}
+        };
+
+        struct ReadyAwaiter
+        {
+            Waiter waiter;
+
+            bool await_ready() const { return false; }
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                waiter.handle = handle;
+                return CurrentWorker()->ResumeWhenReady(&waiter);
+            }
+            int await_resume() const { return waiter.result; }
+        };
+
+        template <typename T>
+        struct WorkAwaiter
+        {
+            std::function<T()> function;
+            Waiter waiter;
+            std::optional<T> value;
+            std::exception_ptr error;
+
+            bool await_ready() const { return false; }
+            void await_suspend(std::coroutine_handle<> handle)
+            {
+                waiter.handle = handle;
+                waiter.work = [this]()
+                {
+                    try
+                    {
+                        value.emplace(function());
+                    }
+                    catch (...)
+                    {
+                        error = std::current_exception();
+                    }
+                };
+                CurrentWorker()->ResumeAfterWork(&waiter);
+            }
+            T await_resume()
+            {
+                if (error)
+                    std::rethrow_exception(error);
+                return std::move(*value);
+            }
+        };
+
+    } // namespace detail
+
+    // Resumes the coroutine once delay has passed, within the 100ms tick of
+    // the timer wheel of its worker
+    inline detail::SleepAwaiter SleepFor(std::chrono::milliseconds delay)
+    {
+        return detail::SleepAwaiter{delay, {}};
+    }
+
+    // Resumes the coroutine once fd can be read or written without blocking,
+    // and gives the poll events that occurred, or -errno
+    inline detail::ReadyAwaiter WaitReadable(int fd)
+    {
+        detail::ReadyAwaiter awaiter;
+        awaiter.waiter.fd = fd;
+        awaiter.waiter.events = POLLIN;
+        return awaiter;
+    }
+    inline detail::ReadyAwaiter WaitWritable(int fd)
+    {
+        detail::ReadyAwaiter awaiter;
+        awaiter.waiter.fd = fd;
+        awaiter.waiter.events = POLLOUT;
+        return awaiter;
+    }
+
+    // Runs function on the executor and gives what it returns, or throws
+    // what it throws, once the coroutine is back on its worker. GCC 12
+    // mishandles lambdas that capture strings or containers as temporaries
+    // of a co_await: name such a lambda before awaiting it.
+    template <typename Function, typename T = std::invoke_result_t<Function &>>
+    detail::WorkAwaiter<T> RunBlocking(Function &&function)
+    {
+        static_assert(!std::is_void_v<T>, "RunBlocking needs a function that returns a value");
+        return detail::WorkAwaiter<T>{std::forward<Function>(function), {}, std::nullopt, nullptr};
+    }
+
+    // Reads a whole file on the executor. Throws std::runtime_error if it
+    // cannot be read.
+    Task<std::string> ReadFileAsync(std::string path);
+
+} // namespace simple_http_server
+
+#endif // ASYNC_H_
@@ -0,0 +1,99 @@
+#include "executor.h"
+
+#include <algorithm>
+
+namespace simple_http_server
+{
+
+    void Executor::Start(size_t threads)
+    {
+        threads = std::max<size_t>(threads, 1);
+        running_ = true;
+        for (size_t i = 0; i < threads; i++)
+            queues_.emplace_back(new Queue());
+        for (size_t i = 0; i < threads; i++)
+            threads_.emplace_back(&Executor::Run, this, i);
+    }
+
+    void Executor::Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            running_ = false;
+        }
+        wake_.notify_all();
+        for (std::thread &thread : threads_)
+            thread.join();
+        threads_.clear();
+        queues_.clear();
+    }
+
+    void Executor::Submit(Job job)
+    {
+        // counted first, so that a thread that takes the job cannot count
+        // it down before it is counted
+        pending_.fetch_add(1);
+        Queue &queue = *queues_[next_.fetch_add(1, std::memory_order_relaxed) % queues_.size()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.jobs.push_back(std::move(job));
+        }
+        // A thread about to sleep counts itself before it checks pending_,
+        // and we count the job before we check sleepers_, so one of us sees
+        // the other. The lock then waits for it to be asleep before waking it.
+        if (sleepers_.load() == 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+        }
+        wake_.notify_one();
+    }
+
+    // Takes the oldest job of the thread's own queue, or else steals the
+    // newest job of another queue
+    bool Executor::Take(size_t index, Job *job)
+    {
+        for (size_t i = 0; i < queues_.size(); i++)
+        {
+            Queue &queue = *queues_[(index + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.jobs.empty())
+                continue;
+            if (i == 0)
+            {
+                *job = std::move(queue.jobs.front());
+                queue.jobs.pop_front();
+            }
+            else
+            {
+                *job = std::move(queue.jobs.back());
+                queue.jobs.pop_back();
+            }
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void Executor::Run(size_t index)
+    {
+        Job job;
+        while (true)
+        {
+            if (Take(index, &job))
+            {
+                job();
+                job = nullptr; // release what it holds before sleeping
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            sleepers_.fetch_add(1);
+            wake_.wait(lock, [this]()
+                       { return pending_.load() > 0 || !running_; });
+            sleepers_.fetch_sub(1);
+            if (!running_ && pending_.load() == 0)
+                return;
+        }
+    }
+
+} // namespace simple_http_server
@@ -0,0 +1,62 @@
+// Defines the thread pool that runs the handlers which may block, away
+// from the I/O workers
+
+#ifndef EXECUTOR_H_
+#define EXECUTOR_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace simple_http_server
+{
+
+    // Every thread has its own queue of jobs. Jobs are spread over the
+    // queues in turn, and a thread whose queue is empty steals from the
+    // back of the others, so a few slow jobs do not hold back the ones
+    // queued behind them while other threads are idle.
+    class Executor
+    {
+    public:
+        using Job = std::function<void()>;
+
+        Executor() : pending_(0), next_(0), sleepers_(0), running_(false) {}
+        ~Executor() { Stop(); }
+        Executor(const Executor &) = delete;
+        Executor &operator=(const Executor &) = delete;
+
+        void Start(size_t threads);
+        // Runs the jobs that are still queued, then joins the threads
+        void Stop();
+        // Thread-safe. Must be called between Start() and Stop().
+        void Submit(Job job);
+
+    private:
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<Job> jobs;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues_;
+        std::vector<std::thread> threads_;
+        std::mutex sleep_mutex_;
+        std::condition_variable wake_;
+        std::atomic<size_t> pending_;  // jobs submitted and not taken yet
+        std::atomic<size_t> next_;     // queue of the next job
+        std::atomic<size_t> sleepers_; // threads waiting on wake_
+        bool running_;                 // guarded by sleep_mutex_
+
+        void Run(size_t index);
+        bool Take(size_t index, Job *job);
+    };
+
+} // namespace simple_http_server
+
+#endif // EXECUTOR_H_
@@ -1,12 +1,20 @@
 #include "http_message.h"
+#include "scan.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <iterator>
-#include <map>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <utility>
 
@@ -57,81 +65,307 @@ namespace simple_http_server
         }
     }
 
-    std::string to_string(HttpStatusCode status_code)
+    // The HTTP/1.1 status line of every status code we know, so that
+    // serializing a response copies a literal instead of building it
+    static constexpr std::string_view status_line(HttpStatusCode status_code)
     {
         switch (status_code)
         {
         case HttpStatusCode::Continue:
-            return "Continue";
+            return "HTTP/1.1 100 Continue\r\n";
+        case HttpStatusCode::SwitchingProtocols:
+            return "HTTP/1.1 101 Switching Protocols\r\n";
+        case HttpStatusCode::EarlyHints:
+            return "HTTP/1.1 103 Early Hints\r\n";
         case HttpStatusCode::Ok:
-            return "OK";
+            return "HTTP/1.1 200 OK\r\n";
+        case HttpStatusCode::Created:
+            return "HTTP/1.1 201 Created\r\n";
         case HttpStatusCode::Accepted:
-            return "Accepted";
+            return "HTTP/1.1 202 Accepted\r\n";
+        case HttpStatusCode::NonAuthoritativeInformation:
+            return "HTTP/1.1 203 Non-Authoritative Information\r\n";
+        case HttpStatusCode::NoContent:
+            return "HTTP/1.1 204 No Content\r\n";
+        case HttpStatusCode::ResetContent:
+            return "HTTP/1.1 205 Reset Content\r\n";
+        case HttpStatusCode::PartialContent:
+            return "HTTP/1.1 206 Partial Content\r\n";
+        case HttpStatusCode::MultipleChoices:
+            return "HTTP/1.1 300 Multiple Choices\r\n";
         case HttpStatusCode::MovedPermanently:
-            return "Moved Permanently";
+            return "HTTP/1.1 301 Moved Permanently\r\n";
         case HttpStatusCode::Found:
-            return "Found";
+            return "HTTP/1.1 302 Found\r\n";
+        case HttpStatusCode::NotModified:
+            return "HTTP/1.1 304 Not Modified\r\n";
         case HttpStatusCode::BadRequest:
-            return "Bad Request";
+            return "HTTP/1.1 400 Bad Request\r\n";
+        case HttpStatusCode::Unauthorized:
+            return "HTTP/1.1 401 Unauthorized\r\n";
         case HttpStatusCode::Forbidden:
-            return "Forbidden";
+            return "HTTP/1.1 403 Forbidden\r\n";
         case HttpStatusCode::NotFound:
-            return "Not Found";
+            return "HTTP/1.1 404 Not Found\r\n";
         case HttpStatusCode::MethodNotAllowed:
-            return "Method Not Allowed";
+            return "HTTP/1.1 405 Method Not Allowed\r\n";
+        case HttpStatusCode::RequestTimeout:
+            return "HTTP/1.1 408 Request Timeout\r\n";
+        case HttpStatusCode::ContentTooLarge:
+            return "HTTP/1.1 413 Content Too Large\r\n";
+        case HttpStatusCode::RangeNotSatisfiable:
+            return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+        case HttpStatusCode::ExpectationFailed:
+            return "HTTP/1.1 417 Expectation Failed\r\n";
         case HttpStatusCode::ImATeapot:
-            return "I'm a Teapot";
+            return "HTTP/1.1 418 I'm a Teapot\r\n";
         case HttpStatusCode::InternalServerError:
-            return "Internal Server Error";
+            return "HTTP/1.1 500 Internal Server Error\r\n";
         case HttpStatusCode::NotImplemented:
-            return "Not Implemented";
+            return "HTTP/1.1 501 Not Implemented\r\n";
         case HttpStatusCode::BadGateway:
-            return "Bad Gateway";
+            return "HTTP/1.1 502 Bad Gateway\r\n";
+        case HttpStatusCode::ServiceUnvailable:
+            return "HTTP/1.1 503 Service Unavailable\r\n";
+        case HttpStatusCode::GatewayTimeout:
+            return "HTTP/1.1 504 Gateway Timeout\r\n";
+        case HttpStatusCode::HttpVersionNotSupported:
+            return "HTTP/1.1 505 HTTP Version Not Supported\r\n";
         default:
-            return std::string();
+            return std::string_view();
+        }
+    }
+
+    // The reason phrase is what follows "HTTP/1.1 xyz " in the status line
+    static constexpr std::string_view reason_phrase(HttpStatusCode status_code)
+    {
+        std::string_view line = status_line(status_code);
+        if (line.empty())
+            return line;
+        return line.substr(13, line.length() - 15);
+    }
+
+    std::string to_string(HttpStatusCode status_code)
+    {
+        return std::string(reason_phrase(status_code));
+    }
+
+    bool equals_ignore_case(std::string_view lhs, std::string_view rhs)
+    {
+        if (lhs.length() != rhs.length())
+            return false;
+        for (size_t i = 0; i < lhs.length(); i++)
+        {
+            if (tolower(static_cast<unsigned char>(lhs[i])) !=
+                tolower(static_cast<unsigned char>(rhs[i])))
+                return false;
         }
+        return true;
+    }
+
+    static std::string_view trim_whitespace(std::string_view value)
+    {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+        return value;
     }
 
-    HttpMethod string_to_method(const std::string &method_string)
+    bool accepts_encoding(std::string_view accept_encoding, std::string_view coding)
     {
-        std::string method_string_uppercase;
-        std::transform(method_string.begin(), method_string.end(),
-                       std::back_inserter(method_string_uppercase),
-                       [](char c)
-                       { return toupper(c); });
-        if (method_string_uppercase == "GET")
+        // A coding is accepted if it is listed, or if "*" is, unless its
+        // weight is 0 ("gzip;q=0")
+        bool star = false;
+        while (!accept_encoding.empty())
+        {
+            size_t comma = accept_encoding.find(',');
+            std::string_view element = accept_encoding.substr(0, comma);
+            accept_encoding.remove_prefix(comma == std::string_view::npos ? accept_encoding.length() : comma + 1);
+
+            size_t semicolon = element.find(';');
+            std::string_view name = trim_whitespace(element.substr(0, semicolon));
+            bool accepted = true;
+            if (semicolon != std::string_view::npos)
+            {
+                std::string_view weight = trim_whitespace(element.substr(semicolon + 1));
+                if (weight.length() >= 2 && (weight[0] == 'q' || weight[0] == 'Q') && weight[1] == '=')
+                {
+                    weight.remove_prefix(2);
+                    // "0", "0." or "0.000"
+                    accepted = weight.empty() || weight[0] != '0' ||
+                               weight.find_first_not_of("0.", 0) != std::string_view::npos;
+                }
+            }
+            if (equals_ignore_case(name, coding))
+                return accepted;
+            if (name == "*")
+                star = accepted;
+        }
+        return star;
+    }
+
+    static constexpr const char *kDayNames[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static constexpr const char *kMonthNames[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                                  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+    std::string format_http_date(int64_t seconds)
+    {
+        time_t time = static_cast<time_t>(seconds);
+        struct tm tm;
+        gmtime_r(&time, &tm);
+        char date[32];
+        snprintf(date, sizeof(date), "%s, %02d %s %04d %02d:%02d:%02d GMT", kDayNames[tm.tm_wday],
+                 tm.tm_mday, kMonthNames[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        return date;
+    }
+
+    bool parse_http_date(std::string_view date, int64_t *seconds)
+    {
+        // "Sun, 06 Nov 1994 08:49:37 GMT"
+        if (date.length() != 29 || date.substr(3, 2) != ", " || date.substr(25) != " GMT" ||
+            date[7] != ' ' || date[11] != ' ' || date[16] != ' ' || date[19] != ':' || date[22] != ':')
+            return false;
+        auto number = [&](size_t offset, size_t length, int *value) {
+            *value = 0;
+            for (size_t i = offset; i < offset + length; i++)
+            {
+                if (date[i] < '0' || date[i] > '9')
+                    return false;
+                *value = *value * 10 + (date[i] - '0');
+            }
+            return true;
+        };
+        struct tm tm = {};
+        int year;
+        if (!number(5, 2, &tm.tm_mday) || !number(12, 4, &year) || !number(17, 2, &tm.tm_hour) ||
+            !number(20, 2, &tm.tm_min) || !number(23, 2, &tm.tm_sec))
+            return false;
+        tm.tm_year = year - 1900;
+        tm.tm_mon = -1;
+        for (int i = 0; i < 12; i++)
+        {
+            if (date.substr(8, 3) == kMonthNames[i])
+                tm.tm_mon = i;
+        }
+        if (tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 ||
+            tm.tm_sec > 60)
+            return false;
+        *seconds = timegm(&tm);
+        return true;
+    }
+
+    bool matches_etag(std::string_view if_none_match, std::string_view etag)
+    {
+        // the weak comparison ignores the W/ prefix of both tags
+        if (etag.substr(0, 2) == "W/")
+            etag.remove_prefix(2);
+        while (!if_none_match.empty())
+        {
+            size_t comma = if_none_match.find(',');
+            std::string_view tag = trim_whitespace(if_none_match.substr(0, comma));
+            if_none_match.remove_prefix(comma == std::string_view::npos ? if_none_match.length() : comma + 1);
+            if (tag.substr(0, 2) == "W/")
+                tag.remove_prefix(2);
+            if (tag == "*" || tag == etag)
+                return true;
+        }
+        return false;
+    }
+
+    // Reads the digits of a byte position, false if there are none or too many
+    static bool parse_position(std::string_view digits, size_t *position)
+    {
+        if (digits.empty())
+            return false;
+        auto result = std::from_chars(digits.data(), digits.data() + digits.length(), *position);
+        return result.ec == std::errc() && result.ptr == digits.data() + digits.length();
+    }
+
+    RangeStatus parse_byte_ranges(std::string_view range, size_t size,
+                                  ByteRange ranges[kMaxByteRanges], size_t *count)
+    {
+        *count = 0;
+        if (range.length() < 6 || !equals_ignore_case(range.substr(0, 6), "bytes="))
+            return RangeStatus::Ignored;
+        range.remove_prefix(6);
+        size_t specs = 0;
+        while (!range.empty())
+        {
+            size_t comma = range.find(',');
+            std::string_view spec = trim_whitespace(range.substr(0, comma));
+            range.remove_prefix(comma == std::string_view::npos ? range.length() : comma + 1);
+            if (spec.empty())
+                continue; // empty list elements are allowed
+            if (++specs > kMaxByteRanges)
+                return RangeStatus::Ignored;
+            size_t dash = spec.find('-');
+            if (dash == std::string_view::npos)
+                return RangeStatus::Ignored;
+            size_t first, last;
+            if (dash == 0)
+            { // "-500": the last 500 bytes
+                if (!parse_position(spec.substr(1), &last))
+                    return RangeStatus::Ignored;
+                if (last == 0 || size == 0)
+                    continue;
+                first = size - std::min(last, size);
+                last = size - 1;
+            }
+            else
+            { // "500-999" or "500-"
+                if (!parse_position(spec.substr(0, dash), &first))
+                    return RangeStatus::Ignored;
+                if (dash + 1 == spec.length())
+                    last = SIZE_MAX;
+                else if (!parse_position(spec.substr(dash + 1), &last) || last < first)
+                    return RangeStatus::Ignored;
+                if (first >= size)
+                    continue;
+                last = std::min(last, size - 1);
+            }
+            ranges[(*count)++] = ByteRange{first, last};
+        }
+        if (specs == 0)
+            return RangeStatus::Ignored;
+        return *count > 0 ? RangeStatus::Satisfiable : RangeStatus::Unsatisfiable;
+    }
+
+    HttpMethod string_to_method(std::string_view method_string)
+    {
+        if (equals_ignore_case(method_string, "GET"))
         {
             return HttpMethod::GET;
         }
-        else if (method_string_uppercase == "HEAD")
+        else if (equals_ignore_case(method_string, "HEAD"))
         {
             return HttpMethod::HEAD;
         }
-        else if (method_string_uppercase == "POST")
+        else if (equals_ignore_case(method_string, "POST"))
         {
             return HttpMethod::POST;
         }
-        else if (method_string_uppercase == "PUT")
+        else if (equals_ignore_case(method_string, "PUT"))
         {
             return HttpMethod::PUT;
         }
-        else if (method_string_uppercase == "DELETE")
+        else if (equals_ignore_case(method_string, "DELETE"))
         {
             return HttpMethod::DELETE;
         }
-        else if (method_string_uppercase == "CONNECT")
+        else if (equals_ignore_case(method_string, "CONNECT"))
         {
             return HttpMethod::CONNECT;
         }
-        else if (method_string_uppercase == "OPTIONS")
+        else if (equals_ignore_case(method_string, "OPTIONS"))
         {
             return HttpMethod::OPTIONS;
         }
-        else if (method_string_uppercase == "TRACE")
+        else if (equals_ignore_case(method_string, "TRACE"))
         {
             return HttpMethod::TRACE;
         }
-        else if (method_string_uppercase == "PATCH")
+        else if (equals_ignore_case(method_string, "PATCH"))
         {
             return HttpMethod::PATCH;
         }
@@ -141,27 +375,22 @@ namespace simple_http_server
         }
     }
 
-    HttpVersion string_to_version(const std::string &version_string)
+    HttpVersion string_to_version(std::string_view version_string)
     {
-        std::string version_string_uppercase;
-        std::transform(version_string.begin(), version_string.end(),
-                       std::back_inserter(version_string_uppercase),
-                       [](char c)
-                       { return toupper(c); });
-        if (version_string_uppercase == "HTTP/0.9")
+        if (equals_ignore_case(version_string, "HTTP/0.9"))
         {
             return HttpVersion::HTTP_0_9;
         }
-        else if (version_string_uppercase == "HTTP/1.0")
+        else if (equals_ignore_case(version_string, "HTTP/1.0"))
         {
             return HttpVersion::HTTP_1_0;
         }
-        else if (version_string_uppercase == "HTTP/1.1")
+        else if (equals_ignore_case(version_string, "HTTP/1.1"))
         {
             return HttpVersion::HTTP_1_1;
         }
-        else if (version_string_uppercase == "HTTP/2" ||
-                 version_string_uppercase == "HTTP/2.0")
+        else if (equals_ignore_case(version_string, "HTTP/2") ||
+                 equals_ignore_case(version_string, "HTTP/2.0"))
         {
             return HttpVersion::HTTP_2_0;
         }
@@ -171,6 +400,116 @@ namespace simple_http_server
         }
     }
 
+    // Names of the KnownHeader fields, in the same order
+    static constexpr std::string_view kKnownHeaderNames[] = {
+        "Content-Length", "Content-Type", "Connection", "Host", "Accept-Encoding",
+        "If-None-Match", "If-Modified-Since", "Range", "If-Range"};
+
+    static int known_header_index(std::string_view name)
+    {
+        for (int i = 0; i < static_cast<int>(KnownHeader::Count); i++)
+        {
+            if (equals_ignore_case(name, kKnownHeaderNames[i]))
+                return i;
+        }
+        return -1;
+    }
+
+    HeaderView HeaderList::at(size_t index) const
+    {
+        const Field &f = field(index);
+        return HeaderView{std::string_view(bytes_).substr(f.name_offset, f.name_length),
+                          std::string_view(bytes_).substr(f.value_offset, f.value_length)};
+    }
+
+    int HeaderList::Find(std::string_view name) const
+    {
+        int known = known_header_index(name);
+        if (known >= 0)
+            return known_[known];
+        for (size_t i = 0; i < size_; i++)
+        {
+            if (equals_ignore_case(at(i).name, name))
+                return static_cast<int>(i);
+        }
+        return -1;
+    }
+
+    std::string_view HeaderList::Get(std::string_view name) const
+    {
+        int index = Find(name);
+        return index < 0 ? std::string_view() : at(index).value;
+    }
+
+    void HeaderList::Set(std::string_view name, std::string_view value)
+    {
+        int index = Find(name);
+        if (index >= 0)
+        {
+            Field &f = field(index);
+            if (value.length() > f.value_length)
+            { // the old value is left unused in bytes_
+                f.value_offset = static_cast<uint32_t>(bytes_.length());
+                bytes_.append(value);
+            }
+            else
+            {
+                bytes_.replace(f.value_offset, value.length(), value);
+            }
+            f.value_length = static_cast<uint32_t>(value.length());
+            return;
+        }
+
+        Field f;
+        f.name_offset = static_cast<uint32_t>(bytes_.length());
+        f.name_length = static_cast<uint32_t>(name.length());
+        bytes_.append(name);
+        f.value_offset = static_cast<uint32_t>(bytes_.length());
+        f.value_length = static_cast<uint32_t>(value.length());
+        bytes_.append(value);
+        if (size_ < kInlineHeaderCount)
+            inline_fields_[size_] = f;
+        else
+            more_fields_.push_back(f);
+        IndexKnown(size_++);
+    }
+
+    void HeaderList::Remove(std::string_view name)
+    {
+        int index = Find(name);
+        if (index < 0)
+            return;
+        for (size_t i = index; i + 1 < size_; i++)
+            field(i) = field(i + 1);
+        if (size_ > kInlineHeaderCount)
+            more_fields_.pop_back();
+        size_--;
+        ClearKnown();
+        for (size_t i = 0; i < size_; i++)
+            IndexKnown(i);
+    }
+
+    void HeaderList::Clear()
+    {
+        bytes_.clear();
+        more_fields_.clear();
+        size_ = 0;
+        ClearKnown();
+    }
+
+    void HeaderList::ClearKnown()
+    {
+        for (int16_t &index : known_)
+            index = -1;
+    }
+
+    void HeaderList::IndexKnown(size_t index)
+    {
+        int known = known_header_index(at(index).name);
+        if (known >= 0 && known_[known] < 0)
+            known_[known] = static_cast<int16_t>(index);
+    }
+
     std::string to_string(const HttpRequest &request)
     {
         std::ostringstream oss;
@@ -178,102 +517,358 @@ namespace simple_http_server
         oss << to_string(request.method()) << ' ';
         oss << request.uri().path() << ' ';
         oss << to_string(request.version()) << "\r\n";
-        for (const auto &p : request.headers())
-            oss << p.first << ": " << p.second << "\r\n";
+        for (HeaderView field : request.headers())
+            oss << field.name << ": " << field.value << "\r\n";
         oss << "\r\n";
         oss << request.content();
 
         return oss.str();
     }
 
-    std::string to_string(const HttpResponse &response, bool send_content)
+    void SerializeHeader(const HttpResponse &response, std::string *out)
     {
-        std::ostringstream oss;
+        const BodySegment &header = response.serialized_header_;
+        if (header.data != nullptr)
+        {
+            out->append(header.data, header.length);
+            return;
+        }
 
-        oss << to_string(response.version()) << ' ';
-        oss << static_cast<int>(response.status_code()) << ' ';
-        oss << to_string(response.status_code()) << "\r\n";
-        for (const auto &p : response.headers())
-            oss << p.first << ": " << p.second << "\r\n";
-        oss << "\r\n";
+        std::string_view line = status_line(response.status_code());
+        if (response.version() == HttpVersion::HTTP_1_1 && !line.empty())
+        {
+            out->append(line);
+        }
+        else
+        {
+            out->append(to_string(response.version())).append(" ");
+            out->append(std::to_string(static_cast<int>(response.status_code())));
+            out->append(" ").append(reason_phrase(response.status_code())).append("\r\n");
+        }
+        for (HeaderView field : response.headers_)
+        {
+            out->append(field.name).append(": ").append(field.value).append("\r\n");
+        }
+        out->append("\r\n");
+    }
+
+    std::string to_string(const HttpResponse &response, bool send_content)
+    {
+        std::string result;
+        SerializeHeader(response, &result);
         if (send_content)
-            oss << response.content();
+            result.append(response.content_);
 
-        return oss.str();
+        return result;
     }
 
-    HttpRequest stringToRequest(const std::string &request_string)
+    HttpRequest viewToRequest(const RequestView &view)
     {
-        std::string start_line, header_lines, message_body;
-        std::istringstream iss;
         HttpRequest request;
-        std::string line, method, path, version; // used for first line
-        std::string key, value;                  // used for header fields
-        Uri uri;
-        size_t lpos = 0, rpos = 0;
-
-        rpos = request_string.find("\r\n", lpos);
-        if (rpos == std::string::npos)
-        {
-            throw std::invalid_argument("Could not find request start line");
-        }
-
-        start_line = request_string.substr(lpos, rpos - lpos);
-        lpos = rpos + 2;
-        rpos = request_string.find("\r\n\r\n", lpos);
-        if (rpos != std::string::npos)
-        { // has header
-            header_lines = request_string.substr(lpos, rpos - lpos);
-            lpos = rpos + 4;
-            rpos = request_string.length();
-            if (lpos < rpos)
-            {
-                message_body = request_string.substr(lpos, rpos - lpos);
-            }
+
+        request.SetMethod(string_to_method(view.method));
+        request.SetUri(Uri::CaseSensitive(std::string(view.target)));
+        if (string_to_version(view.version) != request.version())
+        {
+            throw std::logic_error("HTTP version not supported");
+        }
+        for (size_t i = 0; i < view.header_count; i++)
+        {
+            request.SetHeader(view.headers[i].name, view.headers[i].value);
         }
+        request.SetContent(std::string(view.body));
 
-        iss.clear(); // parse the start line
-        iss.str(start_line);
-        iss >> method >> path >> version;
-        if (!iss.good() && !iss.eof())
+        return request;
+    }
+
+    HttpRequest stringToRequest(const std::string &request_string)
+    {
+        RequestView view;
+        size_t scan_offset = 0;
+
+        switch (ParseRequest(request_string, &scan_offset, &view))
         {
-            throw std::invalid_argument("Invalid start line format");
+        case ParseStatus::Complete:
+            return viewToRequest(view);
+        case ParseStatus::Incomplete:
+            throw std::invalid_argument("Incomplete request");
+        default:
+            throw std::invalid_argument(view.error);
         }
-        request.SetMethod(string_to_method(method));
-        request.SetUri(Uri(path));
-        if (string_to_version(version) != request.version())
+    }
+
+    HttpResponse stringToRespone(const std::string &response_string)
+    {
+        throw std::logic_error("Method not implemented");
+    }
+
+    static constexpr bool is_target_char(unsigned char c)
+    {
+        return c > 0x20 && c != 0x7f;
+    }
+
+    std::string_view RequestView::header(std::string_view name) const
+    {
+        for (size_t i = 0; i < header_count; i++)
         {
-            throw std::logic_error("HTTP version not supported");
+            if (equals_ignore_case(headers[i].name, name))
+                return headers[i].value;
+        }
+        return std::string_view();
+    }
+
+    // Returns the end of the line whose field value (or HTTP version) starts
+    // at pos: the first control character, which must start a CRLF.
+    // The caller has made sure that the header block ends with one.
+    static size_t find_line_end(std::string_view buffer, size_t pos,
+                                size_t header_end, bool *valid)
+    {
+        size_t end = pos + scan_field_value(buffer.data() + pos, header_end + 2 - pos);
+        *valid = buffer[end] == '\r' && buffer[end + 1] == '\n';
+        return end;
+    }
+
+    static ParseStatus malformed(RequestView *view, const char *error)
+    {
+        view->error = error;
+        return ParseStatus::Malformed;
+    }
+
+    ParseStatus ParseRequest(std::string_view buffer, size_t *scan_offset,
+                             RequestView *view)
+    {
+        view->header_count = 0;
+        view->content_length = 0;
+        view->chunked = false;
+        view->header_length = 0;
+        view->length = 0;
+        view->error = nullptr;
+
+        // RFC 9112 2.2: ignore empty lines received before the request line
+        size_t start = 0;
+        while (start + 1 < buffer.length() && buffer[start] == '\r' &&
+               buffer[start + 1] == '\n')
+            start += 2;
+
+        // Find the end of the header block first, so that an incomplete
+        // request costs a single scan of the bytes that arrived since the
+        // previous call. "\r\n\r\n" may straddle the end of that scan.
+        size_t pos = std::max(start, *scan_offset < 3 ? 0 : *scan_offset - 3);
+        size_t header_end = find_header_end(buffer.data(), buffer.length(), pos);
+        if (header_end == buffer.length())
+        {
+            if (buffer.length() - start > kMaxHeaderSize)
+                return malformed(view, "Request header is too large");
+            *scan_offset = buffer.length();
+            return ParseStatus::Incomplete;
         }
+        *scan_offset = header_end;
+        if (header_end + 4 - start > kMaxHeaderSize)
+            return malformed(view, "Request header is too large");
+
+        // request-line = method SP request-target SP HTTP-version CRLF
+        pos = start + scan_token(buffer.data() + start, header_end - start);
+        if (pos == start || buffer[pos] != ' ')
+            return malformed(view, "Invalid request method");
+        view->method = buffer.substr(start, pos - start);
+
+        size_t target = ++pos;
+        while (pos < header_end && is_target_char(buffer[pos]))
+            pos++;
+        if (pos == target || buffer[pos] != ' ')
+            return malformed(view, "Invalid request target");
+        view->target = buffer.substr(target, pos - target);
+
+        bool valid;
+        size_t line_end = find_line_end(buffer, pos + 1, header_end, &valid);
+        view->version = buffer.substr(pos + 1, line_end - pos - 1);
+        if (!valid || view->version.length() != 8 ||
+            view->version.compare(0, 5, "HTTP/") != 0 ||
+            !std::isdigit(static_cast<unsigned char>(view->version[5])) ||
+            view->version[6] != '.' ||
+            !std::isdigit(static_cast<unsigned char>(view->version[7])))
+            return malformed(view, "Invalid HTTP version");
 
-        iss.clear(); // parse header fields
-        iss.str(header_lines);
-        while (std::getline(iss, line))
+        // field-line = field-name ":" OWS field-value OWS CRLF
+        bool has_content_length = false;
+        bool has_transfer_encoding = false;
+        for (pos = line_end + 2; pos < header_end + 2; pos = line_end + 2)
         {
-            std::istringstream header_stream(line);
-            std::getline(header_stream, key, ':');
-            std::getline(header_stream, value);
+            if (view->header_count == kMaxHeaderCount)
+                return malformed(view, "Too many header fields");
 
-            // remove whitespaces from the two strings
-            key.erase(std::remove_if(key.begin(), key.end(),
-                                     [](char c)
-                                     { return std::isspace(c); }),
-                      key.end());
-            value.erase(std::remove_if(value.begin(), value.end(),
-                                       [](char c)
-                                       { return std::isspace(c); }),
-                        value.end());
-            request.SetHeader(key, value);
+            size_t name = pos;
+            pos += scan_token(buffer.data() + pos, header_end - pos);
+            if (pos == name || buffer[pos] != ':')
+                return malformed(view, "Invalid header field name");
+            HeaderView &header = view->headers[view->header_count++];
+            header.name = buffer.substr(name, pos - name);
+
+            pos++;
+            while (buffer[pos] == ' ' || buffer[pos] == '\t')
+                pos++;
+            line_end = find_line_end(buffer, pos, header_end, &valid);
+            if (!valid)
+                return malformed(view, "Invalid header field value");
+            size_t value_end = line_end;
+            while (value_end > pos && (buffer[value_end - 1] == ' ' || buffer[value_end - 1] == '\t'))
+                value_end--;
+            header.value = buffer.substr(pos, value_end - pos);
+
+            if (equals_ignore_case(header.name, "Transfer-Encoding"))
+            { // chunked is the only coding we decode, and it comes last
+                if (has_transfer_encoding || !equals_ignore_case(header.value, "chunked"))
+                    return malformed(view, "Transfer-Encoding is not supported");
+                has_transfer_encoding = true;
+                view->chunked = true;
+                continue;
+            }
+            if (!equals_ignore_case(header.name, "Content-Length"))
+                continue;
+
+            size_t content_length = 0;
+            if (header.value.empty() || header.value.length() > 18)
+                return malformed(view, "Invalid Content-Length");
+            for (char c : header.value)
+            {
+                if (!std::isdigit(static_cast<unsigned char>(c)))
+                    return malformed(view, "Invalid Content-Length");
+                content_length = content_length * 10 + (c - '0');
+            }
+            if (has_content_length && content_length != view->content_length)
+                return malformed(view, "Conflicting Content-Length");
+            has_content_length = true;
+            view->content_length = content_length;
         }
+        // RFC 9112 6.3: a message with both may be an attempt at smuggling
+        if (has_content_length && has_transfer_encoding)
+            return malformed(view, "Both Content-Length and Transfer-Encoding");
 
-        request.SetContent(message_body);
+        view->header_length = header_end + 4;
+        if (view->chunked)
+        {
+            view->length = view->header_length;
+            return ParseStatus::Incomplete;
+        }
+        view->length = header_end + 4 + view->content_length;
+        if (buffer.length() < view->length)
+            return ParseStatus::Incomplete;
+        view->body = buffer.substr(header_end + 4, view->content_length);
+        return ParseStatus::Complete;
+    }
 
-        return request;
+    ParseStatus ChunkedDecoder::Decode(std::string_view buffer, size_t *consumed,
+                                       std::string_view *data)
+    {
+        *data = std::string_view();
+        size_t pos = 0;
+        while (true)
+        {
+            *consumed = pos;
+            if (state_ == State::Data)
+            { // hand over what arrived of the data, one piece per call
+                size_t length = std::min(remaining_, buffer.length() - pos);
+                if (length == 0)
+                    return ParseStatus::Incomplete;
+                *data = buffer.substr(pos, length);
+                *consumed = pos + length;
+                remaining_ -= length;
+                if (remaining_ == 0)
+                    state_ = State::DataEnd;
+                return ParseStatus::Incomplete;
+            }
+            if (state_ == State::DataEnd)
+            {
+                if (buffer.length() - pos < 2)
+                    return ParseStatus::Incomplete;
+                if (buffer[pos] != '\r' || buffer[pos + 1] != '\n')
+                    return ParseStatus::Malformed;
+                pos += 2;
+                state_ = State::Size;
+                continue;
+            }
+            if (state_ == State::Done)
+                return ParseStatus::Complete;
+
+            // a chunk-size line or a trailer field line
+            size_t line_end = buffer.find("\r\n", pos);
+            if (line_end == std::string_view::npos)
+            {
+                if (buffer.length() - pos > kMaxLineLength)
+                    return ParseStatus::Malformed;
+                return ParseStatus::Incomplete;
+            }
+            if (line_end - pos > kMaxLineLength)
+                return ParseStatus::Malformed;
+            if (state_ == State::Trailer)
+            { // trailer fields are dropped; an empty line ends the body
+                if (line_end == pos)
+                {
+                    state_ = State::Done;
+                    *consumed = pos + 2;
+                    return ParseStatus::Complete;
+                }
+                pos = line_end + 2;
+                continue;
+            }
+
+            // chunk-size = 1*HEXDIG, then chunk extensions we ignore
+            size_t size = 0, digits = 0;
+            for (; pos + digits < line_end; digits++)
+            {
+                char c = buffer[pos + digits];
+                int value = std::isdigit(static_cast<unsigned char>(c)) ? c - '0'
+                            : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10
+                                                                     : -1;
+                if (value < 0)
+                    break;
+                if (digits == 15) // more than we could ever receive
+                    return ParseStatus::Malformed;
+                size = size * 16 + value;
+            }
+            char next = pos + digits < line_end ? buffer[pos + digits] : ';';
+            if (digits == 0 || (next != ';' && next != ' ' && next != '\t'))
+                return ParseStatus::Malformed;
+            pos = line_end + 2;
+            remaining_ = size;
+            state_ = size == 0 ? State::Trailer : State::Data;
+        }
     }
 
-    HttpResponse stringToRespone(const std::string &response_string)
+    FileBodySink::FileBodySink(const std::string &directory) : fd_(-1), size_(0)
     {
-        throw std::logic_error("Method not implemented");
+        fd_ = open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd_ < 0)
+        { // e.g. a file system without O_TMPFILE: unlink a named file instead
+            std::string path = directory + "/body.XXXXXX";
+            fd_ = mkostemp(&path[0], O_CLOEXEC);
+            if (fd_ >= 0)
+                unlink(path.c_str());
+        }
+        if (fd_ < 0)
+            throw std::runtime_error("Failed to create a file in " + directory + ": " +
+                                     std::strerror(errno));
+    }
+
+    FileBodySink::~FileBodySink()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    void FileBodySink::Write(std::string_view piece)
+    {
+        while (!piece.empty())
+        {
+            ssize_t written = write(fd_, piece.data(), piece.length());
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                throw std::runtime_error(std::string("Failed to write the request body: ") +
+                                         std::strerror(errno));
+            piece.remove_prefix(written);
+            size_ += written;
+        }
     }
 
 } // namespace simple_http_server
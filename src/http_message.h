@@ -4,15 +4,26 @@
 #ifndef HTTP_MESSAGE_H_
 #define HTTP_MESSAGE_H_
 
-#include <map>
+#include <charconv>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 #include "uri.h"
 
 namespace simple_http_server
 {
 
+    // Limits on the size of a single request we are willing to buffer
+    constexpr size_t kMaxHeaderSize = 64 * 1024;
+    constexpr size_t kMaxContentLength = 8 * 1024 * 1024;
+    constexpr size_t kMaxHeaderCount = 64;
+
     // HTTP methods defined in the following document:
     // https://developer.mozilla.org/en-US/docs/Web/HTTP/Methods
     enum class HttpMethod
@@ -62,6 +73,9 @@ namespace simple_http_server
         NotFound = 404,
         MethodNotAllowed = 405,
         RequestTimeout = 408,
+        ContentTooLarge = 413,
+        RangeNotSatisfiable = 416,
+        ExpectationFailed = 417,
         ImATeapot = 418,
         InternalServerError = 500,
         NotImplemented = 501,
@@ -75,8 +89,224 @@ namespace simple_http_server
     std::string to_string(HttpMethod method);
     std::string to_string(HttpVersion version);
     std::string to_string(HttpStatusCode status_code);
-    HttpMethod string_to_method(const std::string &method_string);
-    HttpVersion string_to_version(const std::string &version_string);
+    HttpMethod string_to_method(std::string_view method_string);
+    HttpVersion string_to_version(std::string_view version_string);
+    bool equals_ignore_case(std::string_view lhs, std::string_view rhs);
+    // Whether a request with this Accept-Encoding field value accepts a
+    // response with this content coding, e.g. "gzip" (RFC 9110 12.5.3)
+    bool accepts_encoding(std::string_view accept_encoding, std::string_view coding);
+    // An HTTP-date in the IMF-fixdate format, e.g. "Sun, 06 Nov 1994 08:49:37
+    // GMT", from seconds since the epoch
+    std::string format_http_date(int64_t seconds);
+    // Reads an IMF-fixdate, the only format that senders may generate (RFC
+    // 9110 5.6.7). Returns false for anything else.
+    bool parse_http_date(std::string_view date, int64_t *seconds);
+    // Whether an If-None-Match field value lists this entity tag, or "*",
+    // using the weak comparison (RFC 9110 13.1.2)
+    bool matches_etag(std::string_view if_none_match, std::string_view etag);
+
+    // Ranges of a Range field that we serve; a request asking for more gets
+    // the whole representation instead
+    constexpr size_t kMaxByteRanges = 8;
+
+    // The bytes [first, last] of a representation
+    struct ByteRange
+    {
+        size_t first;
+        size_t last;
+    };
+
+    enum class RangeStatus
+    {
+        Ignored,      // not a valid bytes range set, or too many ranges: send everything
+        Satisfiable,  // send the ranges, with 206
+        Unsatisfiable // none of the ranges overlaps the representation: 416
+    };
+
+    // Reads a Range field value such as "bytes=0-499, -500" against a
+    // representation of size bytes (RFC 9110 14.1.2). The satisfiable ranges
+    // are stored in ranges, clipped to the representation, in the order they
+    // were asked for.
+    RangeStatus parse_byte_ranges(std::string_view range, size_t size,
+                                  ByteRange ranges[kMaxByteRanges], size_t *count);
+
+    // A piece of a response body that is sent without being copied into the
+    // response. It refers either to bytes in memory (data is not null) or to a
+    // region of an open file, which is sent with sendfile(2). owner keeps the
+    // memory or the file descriptor alive until the segment has been sent.
+    struct BodySegment
+    {
+        BodySegment() : data(nullptr), fd(-1), offset(0), length(0) {}
+        BodySegment(std::shared_ptr<const void> owner, const char *data, size_t length)
+            : owner(std::move(owner)), data(data), fd(-1), offset(0), length(length) {}
+        BodySegment(std::shared_ptr<const void> owner, int fd, size_t offset, size_t length)
+            : owner(std::move(owner)), data(nullptr), fd(fd), offset(offset), length(length) {}
+
+        std::shared_ptr<const void> owner;
+        const char *data;
+        int fd;
+        size_t offset;
+        size_t length;
+    };
+
+    // Writes the next bytes of a streamed response body into buffer, at
+    // most size of them, and returns how many, or 0 once the body is
+    // complete. It is called on the worker of the connection whenever what
+    // it gave before has been sent, so it must not block, and after the
+    // handler returned, so it owns what it reads from. What it throws cuts
+    // the body short.
+    using BodyProducer = std::function<size_t(char *buffer, size_t size)>;
+
+    // Receives the body of a request piece by piece while it arrives, for
+    // the handlers whose route makes one. Each piece is only valid during
+    // the call. What Write throws rejects the request.
+    class BodySink
+    {
+    public:
+        virtual ~BodySink() = default;
+        virtual void Write(std::string_view piece) = 0;
+        // The whole body arrived, just before the handler is called
+        virtual void Finish() {}
+    };
+
+    // Writes a request body straight to a new unnamed file in directory,
+    // which disappears once the sink is destroyed. The handler reads it
+    // back from fd(), e.g. with pread or sendfile. Writes go to the page
+    // cache from the worker of the connection.
+    class FileBodySink : public BodySink
+    {
+    public:
+        // Throws std::runtime_error if the file cannot be created
+        explicit FileBodySink(const std::string &directory = "/tmp");
+        ~FileBodySink() override;
+        FileBodySink(const FileBodySink &) = delete;
+        FileBodySink &operator=(const FileBodySink &) = delete;
+
+        void Write(std::string_view piece) override;
+        int fd() const { return fd_; }
+        size_t size() const { return size_; }
+
+    private:
+        int fd_;
+        size_t size_;
+    };
+
+    struct HeaderView
+    {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    // Values captured from the request path by the :name and *name segments
+    // of the route that matched it
+    constexpr size_t kMaxRouteParams = 8;
+
+    struct RouteParam
+    {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    struct RouteParams
+    {
+        RouteParams() : count(0) {}
+        RouteParam params[kMaxRouteParams];
+        size_t count;
+    };
+
+    // Header fields that are looked up on every request or response. A
+    // HeaderList remembers where they are, so finding them compares no string.
+    enum class KnownHeader
+    {
+        ContentLength,
+        ContentType,
+        Connection,
+        Host,
+        AcceptEncoding,
+        IfNoneMatch,
+        IfModifiedSince,
+        Range,
+        IfRange,
+        Count
+    };
+
+    // The header fields of a message, in the order they were set. Names are
+    // compared case-insensitively. The bytes of all names and values share a
+    // single buffer and the first kInlineHeaderCount fields are indexed from
+    // an array inside the list, so a typical message allocates once for all
+    // of its headers.
+    class HeaderList
+    {
+    public:
+        static constexpr size_t kInlineHeaderCount = 16;
+
+        class const_iterator
+        {
+        public:
+            const_iterator(const HeaderList *list, size_t index) : list_(list), index_(index) {}
+            HeaderView operator*() const { return list_->at(index_); }
+            const_iterator &operator++()
+            {
+                index_++;
+                return *this;
+            }
+            bool operator!=(const const_iterator &other) const { return index_ != other.index_; }
+
+        private:
+            const HeaderList *list_;
+            size_t index_;
+        };
+
+        HeaderList() : size_(0) { ClearKnown(); }
+
+        void Set(std::string_view name, std::string_view value);
+        void Remove(std::string_view name);
+        void Clear();
+
+        // Returns the value of the field, or an empty view if there is none
+        std::string_view Get(std::string_view name) const;
+        std::string_view Get(KnownHeader name) const
+        {
+            int index = known_[static_cast<int>(name)];
+            return index < 0 ? std::string_view() : at(index).value;
+        }
+
+        HeaderView at(size_t index) const;
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end() const { return const_iterator(this, size_); }
+
+    private:
+        // Where a field is in bytes_
+        struct Field
+        {
+            uint32_t name_offset;
+            uint32_t name_length;
+            uint32_t value_offset;
+            uint32_t value_length;
+        };
+
+        std::string bytes_;
+        Field inline_fields_[kInlineHeaderCount];
+        std::vector<Field> more_fields_;
+        size_t size_;
+        int16_t known_[static_cast<int>(KnownHeader::Count)];
+
+        Field &field(size_t index)
+        {
+            return index < kInlineHeaderCount ? inline_fields_[index]
+                                              : more_fields_[index - kInlineHeaderCount];
+        }
+        const Field &field(size_t index) const
+        {
+            return index < kInlineHeaderCount ? inline_fields_[index]
+                                              : more_fields_[index - kInlineHeaderCount];
+        }
+        int Find(std::string_view name) const;
+        void ClearKnown();
+        void IndexKnown(size_t index);
+    };
 
     // Defines the common interface of an HTTP request and HTTP response.
     // Each message will have an HTTP version, collection of header fields,
@@ -87,17 +317,22 @@ namespace simple_http_server
         HttpMessageInterface() : version_(HttpVersion::HTTP_1_1) {}
         virtual ~HttpMessageInterface() = default;
 
-        void SetHeader(const std::string &key, const std::string &value)
+        void SetHeader(std::string_view key, std::string_view value)
         {
-            headers_[key] = std::move(value);
+            headers_.Set(key, value);
         }
-        void RemoveHeader(const std::string &key) { headers_.erase(key); }
-        void ClearHeader() { headers_.clear(); }
+        void RemoveHeader(std::string_view key) { headers_.Remove(key); }
+        void ClearHeader() { headers_.Clear(); }
         void SetContent(const std::string &content)
         {
             content_ = std::move(content);
             SetContentLength();
         }
+        void SetContent(std::string &&content)
+        {
+            content_ = std::move(content);
+            SetContentLength();
+        }
         void ClearContent(const std::string &content)
         {
             content_.clear();
@@ -105,24 +340,24 @@ namespace simple_http_server
         }
 
         HttpVersion version() const { return version_; }
-        std::string header(const std::string &key) const
-        {
-            if (headers_.count(key) > 0)
-                return headers_.at(key);
-            return std::string();
-        }
-        std::map<std::string, std::string> headers() const { return headers_; }
-        std::string content() const { return content_; }
+        // The returned views are valid until the headers are modified
+        std::string_view header(std::string_view key) const { return headers_.Get(key); }
+        std::string_view header(KnownHeader key) const { return headers_.Get(key); }
+        const HeaderList &headers() const { return headers_; }
+        const std::string &content() const { return content_; }
         size_t content_length() const { return content_.length(); }
 
     protected:
         HttpVersion version_;
-        std::map<std::string, std::string> headers_;
+        HeaderList headers_;
         std::string content_;
 
-        void SetContentLength()
+        void SetContentLength() { SetContentLength(content_.length()); }
+        void SetContentLength(size_t length)
         {
-            SetHeader("Content-Length", std::to_string(content_.length()));
+            char digits[20];
+            auto result = std::to_chars(digits, digits + sizeof(digits), length);
+            SetHeader("Content-Length", std::string_view(digits, result.ptr - digits));
         }
     };
 
@@ -137,9 +372,34 @@ namespace simple_http_server
 
         void SetMethod(HttpMethod method) { method_ = method; }
         void SetUri(const Uri &uri) { uri_ = std::move(uri); }
+        // The values point into the path of this request and into the router
+        void SetParams(const RouteParams &params) { params_ = params; }
+        void SetBodySink(std::shared_ptr<BodySink> sink) { body_sink_ = std::move(sink); }
 
         HttpMethod method() const { return method_; }
-        Uri uri() const { return uri_; }
+        const Uri &uri() const { return uri_; }
+        // The path without its query string and fragment
+        std::string_view path() const
+        {
+            std::string_view path = uri_.path();
+            return path.substr(0, path.find_first_of("?#"));
+        }
+        // Value captured by the route parameter called name, or an empty view
+        std::string_view param(std::string_view name) const
+        {
+            for (size_t i = 0; i < params_.count; i++)
+            {
+                if (params_.params[i].name == name)
+                    return params_.params[i].value;
+            }
+            return std::string_view();
+        }
+        // Where the body went instead of the content, for the handlers
+        // whose route makes a sink, e.g. a FileBodySink
+        BodySink *body_sink() const { return body_sink_.get(); }
+        // Moves the content out of the request, e.g. into the sink of its
+        // route, leaving its Content-Length field as it was
+        std::string ReleaseContent() { return std::move(content_); }
 
         friend std::string to_string(const HttpRequest &request);
         friend HttpRequest stringToRequest(const std::string &request_string);
@@ -147,6 +407,8 @@ namespace simple_http_server
     private:
         HttpMethod method_;
         Uri uri_;
+        RouteParams params_;
+        std::shared_ptr<BodySink> body_sink_;
     };
 
     // An HTTPResponse object represents a single HTTP response
@@ -160,22 +422,167 @@ namespace simple_http_server
         ~HttpResponse() = default;
 
         void SetStatusCode(HttpStatusCode status_code) { status_code_ = status_code; }
+        // Uses bytes owned by someone else (typically Storage) as content,
+        // instead of a copy of them
+        void SetBody(const BodySegment &body)
+        {
+            content_.clear();
+            body_ = body;
+            more_body_.clear();
+            producer_ = nullptr;
+            SetContentLength(body_.length);
+        }
+        // Adds a piece after the body set with SetBody, e.g. for the parts
+        // of a multipart/byteranges body
+        void AppendBody(const BodySegment &body)
+        {
+            more_body_.push_back(body);
+            size_t length = body_.length;
+            for (const BodySegment &segment : more_body_)
+                length += segment.length;
+            SetContentLength(length);
+        }
+        // Streams the body from producer while the client reads it, instead
+        // of building it first: with Transfer-Encoding: chunked, or with
+        // Content-Length if its length is known, in which case producer
+        // must give exactly that many bytes
+        void StreamBody(BodyProducer producer)
+        {
+            SetProducer(std::move(producer), std::nullopt);
+            RemoveHeader("Content-Length");
+            SetHeader("Transfer-Encoding", "chunked");
+        }
+        void StreamBody(BodyProducer producer, size_t length)
+        {
+            SetProducer(std::move(producer), length);
+            RemoveHeader("Transfer-Encoding");
+            SetContentLength(length);
+        }
 
         HttpStatusCode status_code() const { return status_code_; }
+        // Sends a header block serialized ahead of time (status line included)
+        // instead of serializing the status code and headers of this response
+        void SetSerializedHeader(const BodySegment &header) { serialized_header_ = header; }
+
+        const BodySegment &body() const { return body_; }
+        const std::vector<BodySegment> &more_body() const { return more_body_; }
+        const BodySegment &serialized_header() const { return serialized_header_; }
+        const BodyProducer &producer() const { return producer_; }
+        // Length of the streamed body, or nullopt if it is chunked
+        std::optional<size_t> stream_length() const { return stream_length_; }
+        // Moves the content out of the response, e.g. to share it with the
+        // connection sending it instead of copying it
+        std::string ReleaseContent() { return std::move(content_); }
+        BodyProducer ReleaseProducer() { return std::exchange(producer_, nullptr); }
 
         friend std::string to_string(const HttpResponse &request, bool send_content);
+        friend void SerializeHeader(const HttpResponse &response, std::string *out);
         friend HttpResponse stringToRespone(const std::string &response_string);
 
     private:
         HttpStatusCode status_code_;
+        BodySegment body_;
+        std::vector<BodySegment> more_body_;
+        BodySegment serialized_header_;
+        BodyProducer producer_;
+        std::optional<size_t> stream_length_;
+
+        void SetProducer(BodyProducer producer, std::optional<size_t> length)
+        {
+            content_.clear();
+            body_ = BodySegment();
+            more_body_.clear();
+            producer_ = std::move(producer);
+            stream_length_ = length;
+        }
     };
 
-    // Utility functions to convert HTTP message objects to string and vice versa
+    // Utility functions to convert HTTP message objects to string and vice versa.
+    // The body of a response set with SetBody is not part of its string.
     std::string to_string(const HttpRequest &request);
     std::string to_string(const HttpResponse &response, bool send_content = true);
     HttpRequest stringToRequest(const std::string &request_string);
     HttpResponse stringToRespone(const std::string &response_string);
 
+    // Appends the status line and header block of response to out, which is
+    // typically a buffer reused from one response to the next. The content is
+    // left out so that it can be sent from where it already is.
+    void SerializeHeader(const HttpResponse &response, std::string *out);
+
+    // Outcome of parsing a request from a buffer that may not hold all of it
+    enum class ParseStatus
+    {
+        Complete,
+        Incomplete,
+        Malformed
+    };
+
+    // A request parsed in place: every field is a view into the parsed
+    // buffer, so it is only valid as long as that buffer is left untouched
+    struct RequestView
+    {
+        std::string_view method;
+        std::string_view target;
+        std::string_view version;
+        HeaderView headers[kMaxHeaderCount];
+        size_t header_count;
+        size_t content_length;
+        bool chunked;         // the body is chunked, and never in body
+        std::string_view body;
+        size_t header_length; // of the header block, once it is complete
+        size_t length;        // of the whole request, once its header block is complete
+        const char *error; // why the request is malformed
+
+        // Value of the first header field with this name (case-insensitive)
+        std::string_view header(std::string_view name) const;
+    };
+
+    // Parses the request at the start of buffer in a single pass and without
+    // allocating, validating its syntax against RFC 9112. Returns Incomplete
+    // until the header block and the Content-Length body have been received;
+    // header_length tells once the header block has, so that the caller can
+    // take the body as it arrives instead. A chunked body is always left to
+    // the caller, and the size of a body to the server's limits.
+    // *scan_offset keeps how far the buffer has already been searched so that
+    // the next call on the same, grown, buffer resumes there; it must be reset
+    // to 0 for the next request.
+    ParseStatus ParseRequest(std::string_view buffer, size_t *scan_offset,
+                             RequestView *view);
+    // Builds the request object handed to request handlers
+    HttpRequest viewToRequest(const RequestView &view);
+
+    // Decodes a chunked body (RFC 9112 7.1) from the bytes that follow the
+    // header block, as they arrive. The data is left where it is: each call
+    // gives the next piece of it as a view into the buffer. Chunk extensions
+    // and trailer fields are dropped.
+    class ChunkedDecoder
+    {
+    public:
+        ChunkedDecoder() : state_(State::Size), remaining_(0) {}
+
+        // Decodes from the start of buffer, and sets *data to the piece of
+        // data found, if any. The caller drops the *consumed first bytes of
+        // buffer before the next call. Returns Complete after the last chunk
+        // and the trailer section, Incomplete while there is more to come
+        // (and more bytes are needed if nothing was consumed), or Malformed.
+        ParseStatus Decode(std::string_view buffer, size_t *consumed, std::string_view *data);
+
+    private:
+        enum class State
+        {
+            Size,    // at a chunk-size line
+            Data,    // in the data of a chunk
+            DataEnd, // at the CRLF after it
+            Trailer, // in the trailer section, after the last chunk
+            Done
+        };
+        // Longest chunk-size line, or trailer field line, we wait for
+        static constexpr size_t kMaxLineLength = 4096;
+
+        State state_;
+        size_t remaining_; // bytes of data left in the chunk
+    };
+
 } // namespace simple_http_server
 
 #endif // HTTP_MESSAGE_H_
@@ -2,19 +2,24 @@
 
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/poll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <cstring>
 #include <functional>
-#include <map>
+#include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 
 #include "http_message.h"
 #include "uri.h"
@@ -27,47 +32,45 @@ namespace simple_http_server
           port_(port),
           sock_fd_(0),
           running_(false),
-          worker_epoll_fd_()
+          listen_mode_(ListenMode::SingleListener),
+          io_backend_(IoBackend::Epoll),
+          rejected_connections_(0),
+          busy_connections_(0),
+          worker_connections_(),
+          worker_delay_us_(),
+          worker_epoll_fd_(),
+          worker_listen_fd_(),
+          offload_threads_(std::thread::hardware_concurrency()),
+          worker_wakeup_fd_()
     {
-        CreateSocket();
-        storage = new Storage({"/index.html", "/overview.png", "/local_file.png", "/local_ram.png", "/cpu_idle.png", "/cpu_loading.png"});
+        sock_fd_ = CreateSocket();
+        storage = nullptr;
     }
 
     void HttpServer::Start()
     {
-        int opt = 1;
-        sockaddr_in server_address;
-
-        if (setsockopt(sock_fd_, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
-                       sizeof(opt)) < 0)
-        {
-            throw std::runtime_error("Failed to set socket options");
-        }
-
-        server_address.sin_family = AF_INET;
-        server_address.sin_addr.s_addr = INADDR_ANY;
-        inet_pton(AF_INET, host_.c_str(), &(server_address.sin_addr.s_addr));
-        server_address.sin_port = htons(port_);
-
-        if (bind(sock_fd_, (sockaddr *)&server_address, sizeof(server_address)) < 0)
-        {
-            throw std::runtime_error("Failed to bind to socket");
+        if (io_backend_ == IoBackend::IoUring)
+        { // every worker accepts from its own listener with io_uring
+            IoUring probe;
+            if (probe.Init(8, 8, kMaxBufferSize))
+            {
+                listen_mode_ = ListenMode::ReusePort;
+            }
+            else
+            {
+                std::cerr << "io_uring is not available (" << std::strerror(errno)
+                          << "), falling back to epoll" << std::endl;
+                io_backend_ = IoBackend::Epoll;
+            }
         }
-
-        if (listen(sock_fd_, BACK_LOG_SIZE) < 0)
+        SetUpEpoll();
+        if (listen_mode_ == ListenMode::ReusePort)
         {
-            std::ostringstream msg;
-            msg << "Failed to listen on port " << port_;
-            throw std::runtime_error(msg.str());
+            SetUpWorkerListeners();
         }
-
-        SetUpEpoll();
-        running_ = true;
-        listener_thread_ = std::thread(&HttpServer::Listen, this);
-        this->storage_watcher_ = std::thread(&HttpServer::Watch_Storage, this);
-        for (int i = 0; i < THREAD_POOL_SIZE; i++)
+        else
         {
-            worker_threads_[i] = std::thread(&HttpServer::ProcessEvents, this, i);
+            BindSocket(sock_fd_);
         }
 
         auto say_hello = [](const HttpRequest &request, Storage *storage) -> HttpResponse
@@ -77,63 +80,139 @@ namespace simple_http_server
             response.SetContent("Hello, world\n");
             return response;
         };
-        auto send_html = [](const HttpRequest &request, Storage *inStorage) -> HttpResponse
+        this->RegisterHttpRequestHandler("/", HttpMethod::GET, say_hello);
+
+        HttpResponse overloaded(HttpStatusCode::ServiceUnvailable);
+        overloaded.SetHeader("Retry-After", std::to_string(admission_.retry_after.count()));
+        overloaded.SetHeader("Connection", "close");
+        overloaded.SetHeader("Content-Length", "0");
+        overload_response_.clear();
+        SerializeHeader(overloaded, &overload_response_);
+
+        running_ = true;
+        executor_.Start(offload_threads_);
+        if (listen_mode_ == ListenMode::SingleListener)
         {
-            HttpResponse response(HttpStatusCode::Ok);
-            std::string path = request.uri().path();
-            std::string content;
-            inStorage->getResource(path, content);
-            response.SetHeader("Content-Type", "text/html");
-            response.SetContent(content);
-            return response;
-        };
+            listener_thread_ = std::thread(&HttpServer::Listen, this);
+        }
+        this->storage_watcher_ = std::thread(&HttpServer::Watch_Storage, this);
+        for (int i = 0; i < THREAD_POOL_SIZE; i++)
+        {
+            if (io_backend_ == IoBackend::IoUring)
+                worker_threads_[i] = std::thread(&HttpServer::ProcessUringEvents, this, i);
+            else
+                worker_threads_[i] = std::thread(&HttpServer::ProcessEvents, this, i);
+        }
+    }
+
+    static HttpResponse NotFound()
+    {
+        HttpResponse response(HttpStatusCode::NotFound);
+        response.SetHeader("Content-Type", "text/plain");
+        response.SetContent("NOT FOUND\n");
+        return response;
+    }
+
+    static HttpResponse ContentTooLarge()
+    {
+        HttpResponse response(HttpStatusCode::ContentTooLarge);
+        response.SetHeader("Content-Type", "text/plain");
+        response.SetContent("CONTENT TOO LARGE\n");
+        return response;
+    }
 
-        auto send_image = [](const HttpRequest &request, Storage *inStorage) -> HttpResponse
+    void HttpServer::ServeDirectory(const std::string &prefix, const std::string &root,
+                                    const StorageLimits &limits)
+    {
+        mounts_.emplace_back(new Storage(root, limits));
+        Storage *mount = mounts_.back().get();
+        if (storage == nullptr)
         {
-            HttpResponse response(HttpStatusCode::Ok);
-            std::string path = request.uri().path();
-            std::string content;
-            inStorage->getResource(path, content);
-            response.SetHeader("Content-Type", "image/png");
-            response.SetContent(content);
-            return response;
+            storage = mount;
+        }
+        auto send_file = [mount](const HttpRequest &request, Storage *) -> HttpResponse
+        {
+            // the path is looked up in the index as is, once ".." and
+            // percent-encoding are resolved
+            std::string path;
+            ResourcePtr resource;
+            if (!NormalizePath(request.param("path"), &path) || !mount->getResource(path, resource))
+            {
+                return NotFound();
+            }
+            return resourceResponse(resource, request);
         };
-
-        this->RegisterHttpRequestHandler("/", HttpMethod::GET, say_hello);
-        this->RegisterHttpRequestHandler("/index.html", HttpMethod::GET, send_html);
-        this->RegisterHttpRequestHandler("/overview.png", HttpMethod::GET, send_image);
-        this->RegisterHttpRequestHandler("/local_file.png", HttpMethod::GET, send_image);
-        this->RegisterHttpRequestHandler("/local_ram.png", HttpMethod::GET, send_image);
-        this->RegisterHttpRequestHandler("/cpu_idle.png", HttpMethod::GET, send_image);
-        this->RegisterHttpRequestHandler("/cpu_loading.png", HttpMethod::GET, send_image);
+        std::string route = prefix;
+        while (!route.empty() && route.back() == '/')
+        {
+            route.pop_back();
+        }
+        this->RegisterHttpRequestHandler(route + "/*path", HttpMethod::GET, send_file);
     }
 
     void HttpServer::Stop()
     {
         running_ = false;
-        listener_thread_.join();
-        storage_watcher_.join();
-        if (storage)
+        if (listener_thread_.joinable())
         {
-            delete storage;
+            listener_thread_.join();
         }
+        storage_watcher_.join();
         for (int i = 0; i < THREAD_POOL_SIZE; i++)
         {
             worker_threads_[i].join();
         }
+        executor_.Stop();
         for (int i = 0; i < THREAD_POOL_SIZE; i++)
         {
             close(worker_epoll_fd_[i]);
+            close(worker_wakeup_fd_[i]);
+            // worker 0 shares the socket created by the constructor
+            if (worker_listen_fd_[i] > 0 && worker_listen_fd_[i] != sock_fd_)
+            {
+                close(worker_listen_fd_[i]);
+            }
         }
         close(sock_fd_);
     }
 
-    void HttpServer::CreateSocket()
+    int HttpServer::CreateSocket()
     {
-        if ((sock_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        int sock_fd;
+        if ((sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
         {
             throw std::runtime_error("Failed to create a TCP socket");
         }
+        return sock_fd;
+    }
+
+    void HttpServer::BindSocket(int sock_fd)
+    {
+        int opt = 1;
+        sockaddr_in server_address;
+
+        if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+            setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+        {
+            throw std::runtime_error("Failed to set socket options");
+        }
+
+        server_address.sin_family = AF_INET;
+        server_address.sin_addr.s_addr = INADDR_ANY;
+        inet_pton(AF_INET, host_.c_str(), &(server_address.sin_addr.s_addr));
+        server_address.sin_port = htons(port_);
+
+        if (bind(sock_fd, (sockaddr *)&server_address, sizeof(server_address)) < 0)
+        {
+            throw std::runtime_error("Failed to bind to socket");
+        }
+
+        if (listen(sock_fd, BACK_LOG_SIZE) < 0)
+        {
+            std::ostringstream msg;
+            msg << "Failed to listen on port " << port_;
+            throw std::runtime_error(msg.str());
+        }
     }
 
     void HttpServer::SetUpEpoll()
@@ -145,6 +224,32 @@ namespace simple_http_server
                 throw std::runtime_error(
                     "Failed to create epoll file descriptor for worker");
             }
+            // registered with a pointer to itself, to tell it apart from
+            // the connections and the listening socket
+            if ((worker_wakeup_fd_[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            {
+                throw std::runtime_error("Failed to create eventfd for worker");
+            }
+            controlEpollEvent(worker_epoll_fd_[i], EPOLL_CTL_ADD, worker_wakeup_fd_[i],
+                              EPOLLIN, &worker_wakeup_fd_[i]);
+        }
+    }
+
+    void HttpServer::SetUpWorkerListeners()
+    {
+        // Every worker binds its own socket to the same address. The listening
+        // socket is registered without user data so ProcessEvents can tell it
+        // apart from client connections. io_uring workers accept from theirs
+        // with a multishot accept instead.
+        for (int i = 0; i < THREAD_POOL_SIZE; i++)
+        {
+            worker_listen_fd_[i] = (i == 0) ? sock_fd_ : CreateSocket();
+            BindSocket(worker_listen_fd_[i]);
+            if (io_backend_ == IoBackend::Epoll)
+            {
+                controlEpollEvent(worker_epoll_fd_[i], EPOLL_CTL_ADD,
+                                  worker_listen_fd_[i], EPOLLIN, nullptr);
+            }
         }
     }
 
@@ -155,18 +260,71 @@ namespace simple_http_server
 
     void HttpServer::Watch_Storage()
     {
+        // With inotify only the files that changed are looked at, as soon as
+        // they change; otherwise every directory is scanned every few seconds
+        std::vector<pollfd> watch_fds;
+        std::vector<Storage *> watched;
+        std::vector<Storage *> scanned;
+        std::vector<StorageStats> reported;
+        for (auto &mount : mounts_)
+        {
+            if (mount->watch())
+            {
+                watch_fds.push_back({mount->watchFd(), POLLIN, 0});
+                watched.push_back(mount.get());
+            }
+            else
+            {
+                scanned.push_back(mount.get());
+            }
+            reported.push_back(mount->stats());
+        }
+        auto last_scan = std::chrono::steady_clock::now();
         while (running_)
         {
-            sleep(5);
-            if (storage) {
-                this->storage->updateResource();
+            if (!watch_fds.empty())
+            {
+                if (poll(watch_fds.data(), watch_fds.size(), WATCH_POLL_TIMEOUT_MS) > 0)
+                {
+                    for (size_t i = 0; i < watch_fds.size(); i++)
+                    {
+                        if (watch_fds[i].revents & POLLIN)
+                            watched[i]->processEvents();
+                    }
+                }
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_POLL_TIMEOUT_MS));
+            }
+            if (!scanned.empty() && std::chrono::steady_clock::now() - last_scan >=
+                                        std::chrono::seconds(STORAGE_SCAN_INTERVAL))
+            {
+                for (Storage *mount : scanned)
+                    mount->updateResource();
+                last_scan = std::chrono::steady_clock::now();
+            }
+
+            for (size_t i = 0; i < mounts_.size(); i++)
+            {
+                StorageStats stats = mounts_[i]->stats();
+                if (stats.reloads != reported[i].reloads || stats.removals != reported[i].removals)
+                {
+                    std::cout << "Storage: reloaded " << stats.reloads - reported[i].reloads
+                              << " file(s), removed " << stats.removals - reported[i].removals;
+                    if (stats.reloads != reported[i].reloads)
+                        std::cout << ", " << stats.lastLatencyNs / 1000 << " us after the change"
+                                  << " (max " << stats.maxLatencyNs / 1000 << " us)";
+                    std::cout << std::endl;
+                }
+                reported[i] = stats;
             }
         }
     }
 
     void HttpServer::Listen()
     {
-        EventData *client_data;
+        Connection *conn;
         sockaddr_in client_address;
         socklen_t client_len = sizeof(client_address);
         int client_fd;
@@ -194,10 +352,12 @@ namespace simple_http_server
                 if (client_fd < 0)
                     continue;
 
-                client_data = new EventData();
-                client_data->fd = client_fd;
-                controlEpollEvent(worker_epoll_fd_[current_worker], EPOLL_CTL_ADD,
-                                    client_fd, EPOLLIN, client_data);
+                if (AdmitConnection(current_worker, client_fd))
+                {
+                    conn = new Connection(client_fd, current_worker);
+                    controlEpollEvent(worker_epoll_fd_[current_worker], EPOLL_CTL_ADD,
+                                      client_fd, EPOLLIN | EPOLLOUT | EPOLLET, conn);
+                }
                 current_worker++;
                 if (current_worker == HttpServer::THREAD_POOL_SIZE)
                     current_worker = 0;
@@ -205,182 +365,1353 @@ namespace simple_http_server
         }
     }
 
+    void HttpServer::AcceptConnections(int worker_id)
+    {
+        Connection *conn;
+        sockaddr_in client_address;
+        socklen_t client_len;
+        int client_fd;
+
+        // The listening socket is level-triggered, so connections left over
+        // after a full batch wake this worker up again on the next epoll_wait
+        for (int i = 0; i < ACCEPT_BATCH_SIZE; i++)
+        {
+            client_len = sizeof(client_address);
+            client_fd = accept4(worker_listen_fd_[worker_id], (sockaddr *)&client_address,
+                                &client_len, SOCK_NONBLOCK);
+            if (client_fd < 0)
+                break; // EAGAIN: the accept queue is drained
+
+            if (!AdmitConnection(worker_id, client_fd))
+                continue;
+            conn = new Connection(client_fd, worker_id);
+            controlEpollEvent(worker_epoll_fd_[worker_id], EPOLL_CTL_ADD,
+                              client_fd, EPOLLIN | EPOLLOUT | EPOLLET, conn);
+        }
+    }
+
+    // Counts a new connection of the worker, or turns it away if the server
+    // is over one of its AdmissionLimits. Shedding costs one send of a
+    // response serialized in advance, before the connection costs anything
+    // else. The 503 is best effort: if the request has already arrived,
+    // closing the socket with it unread may reset the connection instead.
+    bool HttpServer::AdmitConnection(int worker_id, int client_fd)
+    {
+        if (worker_connections_[worker_id].load(std::memory_order_relaxed) <
+                admission_.connections &&
+            busy_connections_.load(std::memory_order_relaxed) < admission_.requests &&
+            worker_delay_us_[worker_id].load(std::memory_order_relaxed) <=
+                static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(admission_.queue_delay)
+                        .count()))
+        {
+            worker_connections_[worker_id].fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        send(client_fd, overload_response_.data(), overload_response_.length(),
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(client_fd);
+        rejected_connections_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // What a completion is about: the low bits of its user_data, the other
+    // bits being the Connection it concerns (none for accepts and wakeups),
+    // or the Waiter of a coroutine for kResumeOp
+    enum UringOp : std::uint64_t
+    {
+        kAcceptOp,
+        kRecvOp,
+        kSendOp,
+        kPollOp,
+        kCancelOp,
+        kWakeupOp,
+        kResumeOp
+    };
+    constexpr std::uint64_t kUringOpMask = 7;
+    static_assert(alignof(Connection) > kUringOpMask && alignof(Waiter) > kUringOpMask,
+                  "the operation must fit in user_data");
+
+    static std::uint64_t UserData(Connection *conn, UringOp op)
+    {
+        return reinterpret_cast<std::uint64_t>(conn) | op;
+    }
+
+    // epoll user data of the fds coroutines wait for: the Waiter, tagged
+    constexpr std::uintptr_t kWaiterTag = 1;
+
+    // Resumes the coroutines of the worker's handlers from its event loop
+    class HttpServer::WorkerContext : public AsyncWorker
+    {
+    public:
+        WorkerContext(HttpServer *server, int worker_id, int epoll_fd, IoUring *ring,
+                      std::uint64_t now_ms)
+            : server_(server), worker_id_(worker_id), epoll_fd_(epoll_fd), ring_(ring),
+              timers_(now_ms)
+        {
+            AsyncWorker::SetCurrent(this);
+        }
+        ~WorkerContext() { AsyncWorker::SetCurrent(nullptr); }
+
+        void ResumeAt(std::uint64_t deadline_ms, Waiter *waiter) override
+        {
+            timers_.Arm(waiter, std::max<std::uint64_t>(deadline_ms, 1));
+        }
+
+        bool ResumeWhenReady(Waiter *waiter) override
+        {
+            if (ring_ != nullptr)
+            {
+                if (ring_->PreparePoll(waiter->fd, waiter->events,
+                                       reinterpret_cast<std::uint64_t>(waiter) | kResumeOp))
+                    return true;
+                waiter->result = -EBUSY;
+                return false;
+            }
+            // POLLIN and POLLOUT are EPOLLIN and EPOLLOUT
+            epoll_event event;
+            event.events = waiter->events | EPOLLONESHOT;
+            event.data.ptr = reinterpret_cast<void *>(reinterpret_cast<std::uintptr_t>(waiter) |
+                                                      kWaiterTag);
+            if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, waiter->fd, &event) == 0)
+                return true;
+            waiter->result = -errno;
+            return false;
+        }
+
+        void ResumeAfterWork(Waiter *waiter) override
+        {
+            HttpServer *server = server_;
+            int worker_id = worker_id_;
+            server->executor_.Submit([server, worker_id, waiter]()
+                                     {
+                waiter->work();
+                if (server->worker_resumed_[worker_id].Push(waiter))
+                    server->WakeUp(worker_id); });
+        }
+
+        // An fd a coroutine waited for is ready, with events or -errno
+        void Ready(void *tagged, int result)
+        {
+            Waiter *waiter = reinterpret_cast<Waiter *>(reinterpret_cast<std::uintptr_t>(tagged) &
+                                                        ~kWaiterTag);
+            if (ring_ == nullptr)
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, waiter->fd, nullptr);
+            waiter->result = result;
+            waiter->handle.resume();
+        }
+
+        void Advance(std::uint64_t now_ms)
+        {
+            timers_.Advance(now_ms, [](Waiter *waiter)
+                            { waiter->handle.resume(); });
+        }
+
+    private:
+        HttpServer *server_;
+        int worker_id_;
+        int epoll_fd_;
+        IoUring *ring_;
+        TimerWheel<Waiter, &Waiter::timer> timers_;
+    };
+
+    // Milliseconds of the monotonic clock, which is read from the vDSO
+    // without a syscall
+    static std::uint64_t ToMs(std::chrono::steady_clock::time_point time)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch())
+            .count();
+    }
+
     void HttpServer::ProcessEvents(int worker_id)
     {
-        EventData *data;
+        Connection *conn;
         int epoll_fd = worker_epoll_fd_[worker_id];
+        // The deadlines of the connections of this worker. Connections are
+        // armed on their first event, so the listener thread never touches it.
+        ConnectionTimers timers(ToMs(std::chrono::steady_clock::now()));
+        WorkerContext context(this, worker_id, epoll_fd, nullptr,
+                              ToMs(std::chrono::steady_clock::now()));
+        std::uint64_t delay_us = 0;
         while (running_)
         {
             int nfds = epoll_wait(worker_epoll_fd_[worker_id],
                                   worker_events_[worker_id], HttpServer::MAX_EVENTS, 5);
+            auto woken = std::chrono::steady_clock::now();
+            std::uint64_t now_ms = ToMs(woken);
             if (nfds < 0)
             {
-                continue;
+                nfds = 0;
             }
 
             for (int i = 0; i < nfds; i++)
             {
                 const epoll_event &current_event = worker_events_[worker_id][i];
-                data = reinterpret_cast<EventData *>(current_event.data.ptr);
-                if ((current_event.events & EPOLLHUP) ||
-                    (current_event.events & EPOLLERR))
+                conn = reinterpret_cast<Connection *>(current_event.data.ptr);
+                if (conn == nullptr)
+                { // our own listening socket (ListenMode::ReusePort)
+                    AcceptConnections(worker_id);
+                }
+                else if (current_event.data.ptr == &worker_wakeup_fd_[worker_id])
                 {
-                    controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, data->fd);
-                    close(data->fd);
-                    delete data;
+                    CompleteOffloaded(worker_id, epoll_fd, nullptr, &timers, now_ms);
                 }
-                else if ((current_event.events == EPOLLIN) ||
-                         (current_event.events == EPOLLOUT))
+                else if (reinterpret_cast<std::uintptr_t>(current_event.data.ptr) & kWaiterTag)
+                { // an fd a coroutine waits for
+                    context.Ready(current_event.data.ptr, current_event.events);
+                }
+                else if ((current_event.events & EPOLLHUP) ||
+                         (current_event.events & EPOLLERR))
                 {
-                    HandleEpollEvent(epoll_fd, data, current_event.events);
+                    CloseConnection(epoll_fd, &timers, conn);
                 }
                 else
-                { // something unexpected
-                    controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, data->fd);
-                    close(data->fd);
-                    delete data;
+                {
+                    HandleEpollEvent(epoll_fd, &timers, now_ms, conn, current_event.events);
                 }
             }
+
+            timers.Advance(now_ms, [&](Connection *expired)
+                           { ExpireConnection(epoll_fd, &timers, expired); });
+            context.Advance(now_ms);
+            RecordDelay(worker_id, woken, &delay_us);
         }
     }
 
-    void HttpServer::HandleEpollEvent(int epoll_fd, EventData *data,
+    // The events that arrived while a batch was handled waited up to its
+    // duration. The average moves by an eighth of the gap per batch, so that
+    // one slow batch does not make the server refuse connections.
+    void HttpServer::RecordDelay(int worker_id, std::chrono::steady_clock::time_point woken,
+                                 std::uint64_t *delay_us)
+    {
+        std::uint64_t batch_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::steady_clock::now() - woken)
+                                     .count();
+        *delay_us = *delay_us - *delay_us / 8 + batch_us / 8;
+        worker_delay_us_[worker_id].store(*delay_us, std::memory_order_relaxed);
+    }
+
+    void HttpServer::HandleEpollEvent(int epoll_fd, ConnectionTimers *timers,
+                                      std::uint64_t now_ms, Connection *conn,
                                       std::uint32_t events)
     {
-        int fd = data->fd;
-        EventData *request, *response;
+        // The socket is edge-triggered: we are only notified again once new
+        // data arrives or the send buffer drains, so both directions are
+        // driven until they would block. Reading pauses while too much output
+        // is pending and resumes from the EPOLLOUT that drains it.
+        if (events & EPOLLIN)
+        {
+            conn->readable = true;
+        }
 
-        if (events == EPOLLIN)
+        while (true)
         {
-            request = data;
-            char buffer[kMaxBufferSize];
-            ssize_t byte_count = recv(fd, buffer, kMaxBufferSize, 0);
-            request->buffer = buffer;
+            bool streaming = static_cast<bool>(conn->producer);
+            if (!WriteToConnection(conn))
+            { // error
+                CloseConnection(epoll_fd, timers, conn);
+                return;
+            }
+            if (streaming && !conn->producer)
+            { // serve what was pipelined behind the streamed body
+                ProcessInput(conn);
+                continue;
+            }
+            if (!conn->readable || conn->close_after_write ||
+                conn->pending_bytes >= MAX_PENDING_OUTPUT ||
+                ((conn->offloaded || conn->producer) && conn->input.length() >= MAX_READ_SIZE))
+            {
+                break;
+            }
+            if (!ReadFromConnection(conn))
+            { // error
+                CloseConnection(epoll_fd, timers, conn);
+                return;
+            }
+            ProcessInput(conn);
+        }
+        FinishIo(epoll_fd, timers, now_ms, conn);
+    }
+
+    // Closes the connection or accounts for the state it is left in, after
+    // either backend did what it could
+    void HttpServer::FinishIo(int epoll_fd, ConnectionTimers *timers, std::uint64_t now_ms,
+                              Connection *conn)
+    {
+        if ((conn->peer_closed || conn->close_after_write) &&
+            conn->pending_bytes == 0 && !conn->offloaded && !conn->producer)
+        { // nothing more will be sent on this connection
+            CloseConnection(epoll_fd, timers, conn);
+            return;
+        }
+        bool busy = conn->pending_bytes > 0 || !conn->input.empty() || conn->offloaded ||
+                    conn->producer || conn->incoming;
+        if (busy != conn->busy)
+        {
+            conn->busy = busy;
+            if (busy)
+                busy_connections_.fetch_add(1, std::memory_order_relaxed);
+            else
+                busy_connections_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        ArmTimer(timers, now_ms, conn);
+    }
+
+    bool HttpServer::ReadFromConnection(Connection *conn)
+    {
+        size_t read_size = 0;
+        while (read_size < MAX_READ_SIZE)
+        {
+            // receive straight into the connection buffer, which keeps its
+            // capacity between requests
+            size_t length = conn->input.length();
+            conn->input.resize(length + kMaxBufferSize);
+            ssize_t byte_count = recv(conn->fd, &conn->input[length], kMaxBufferSize, 0);
+            conn->input.resize(length + (byte_count > 0 ? byte_count : 0));
             if (byte_count > 0)
-            { // we have fully received the message
-                response = new EventData();
-                response->fd = fd;
-                HandleHttpData(*request, response);
-                controlEpollEvent(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLOUT, response);
-                delete request;
+            {
+                read_size += byte_count;
             }
             else if (byte_count == 0)
             { // client has closed connection
-                controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, fd);
-                close(fd);
-                delete request;
+                conn->peer_closed = true;
+                conn->readable = false;
+                return true;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            { // everything available has been read
+                conn->readable = false;
+                return true;
+            }
+            else if (errno != EINTR)
+            { // other error
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Queues the bytes appended to conn->output since from, e.g. a response
+    // header block that was serialized in place
+    static void CommitOutput(Connection *conn, size_t from)
+    {
+        size_t length = conn->output.length() - from;
+        if (length == 0)
+            return;
+        BodySegment *last = conn->segments.size() > conn->sent_segments
+                                ? &conn->segments.back()
+                                : nullptr;
+        if (last != nullptr && last->data == nullptr && last->fd < 0 &&
+            last->offset + last->length == from)
+        { // extend the previous chunk of output
+            last->length += length;
+        }
+        else
+        {
+            BodySegment segment;
+            segment.offset = from;
+            segment.length = length;
+            conn->segments.push_back(segment);
+        }
+        conn->pending_bytes += length;
+    }
+
+    // Queues a body that is sent from where it lives, without copying it
+    static void QueueBody(Connection *conn, const BodySegment &body)
+    {
+        if (body.length == 0)
+            return;
+        conn->segments.push_back(body);
+        conn->pending_bytes += body.length;
+    }
+
+    // A streamed body is pulled a chunk at a time, and only up to a window
+    // of bytes waits in memory for the client to read it
+    constexpr size_t kStreamChunkSize = 4 * kMaxBufferSize;
+    constexpr size_t kStreamWindow = 4 * kStreamChunkSize;
+    // Room for the size line in front of a chunk: 16 hex digits and CRLF
+    constexpr size_t kChunkLineRoom = 18;
+
+    // Pulls the body being streamed until a window of it is pending. The
+    // write paths call it once everything queued has been sent, so the
+    // output buffer is reused rather than grown. Returns false if the
+    // producer failed, or ended before its Content-Length: the body can
+    // only be cut short.
+    static bool PullBody(Connection *conn)
+    {
+        while (conn->producer && conn->pending_bytes < kStreamWindow)
+        {
+            size_t from = conn->output.length();
+            size_t room = conn->chunked ? kChunkLineRoom : 0;
+            size_t size = conn->chunked ? kStreamChunkSize
+                                        : std::min(kStreamChunkSize, conn->stream_remaining);
+            // the chunk is produced in place, behind room for its size line
+            conn->output.resize(from + room + size + 2);
+            char *data = &conn->output[from + room];
+            size_t length;
+            try
+            {
+                length = std::min(conn->producer(data, size), size);
+            }
+            catch (const std::exception &)
+            {
+                conn->output.resize(from);
+                conn->producer = nullptr;
+                return false;
+            }
+
+            if (!conn->chunked)
+            {
+                conn->output.resize(from + length);
+                CommitOutput(conn, from);
+                conn->stream_remaining -= length;
+                if (length == 0 || conn->stream_remaining == 0)
+                    conn->producer = nullptr;
+                if (length == 0 && conn->stream_remaining > 0)
+                    return false;
+                continue;
+            }
+            if (length == 0)
+            { // the last chunk, without trailers
+                conn->output.resize(from);
+                conn->output.append("0\r\n\r\n");
+                CommitOutput(conn, from);
+                conn->producer = nullptr;
+                break;
+            }
+            // the size line ends where the data starts, and the bytes left
+            // in front of it are skipped by the segment
+            char line[kChunkLineRoom];
+            char *end = std::to_chars(line, line + sizeof(line), length, 16).ptr;
+            *end++ = '\r';
+            *end++ = '\n';
+            size_t start = from + room - (end - line);
+            std::memcpy(&conn->output[start], line, end - line);
+            std::memcpy(data + length, "\r\n", 2);
+            conn->output.resize(from + room + length + 2);
+            BodySegment segment;
+            segment.offset = start;
+            segment.length = conn->output.length() - start;
+            conn->segments.push_back(segment);
+            conn->pending_bytes += segment.length;
+        }
+        return true;
+    }
+
+    // Queues a response: its header block is serialized straight into the
+    // connection buffer and its body is referenced, so that both leave with
+    // a single sendmsg. Content built by a handler is copied only if it is
+    // smaller than the cost of sharing it.
+    static void QueueResponse(Connection *conn, HttpResponse &response,
+                              bool send_content)
+    {
+        if (response.serialized_header().length > 0)
+        { // e.g. a cached file: nothing to build at all
+            QueueBody(conn, response.serialized_header());
+            if (send_content)
+            {
+                QueueBody(conn, response.body());
+                for (const BodySegment &body : response.more_body())
+                    QueueBody(conn, body);
             }
+            return;
+        }
+
+        size_t from = conn->output.length();
+        SerializeHeader(response, &conn->output);
+        if (send_content && response.content_length() <= kMaxBufferSize)
+        {
+            conn->output.append(response.content());
+        }
+        CommitOutput(conn, from);
+        if (!send_content)
+            return;
+        if (response.content_length() > kMaxBufferSize)
+        {
+            auto content = std::make_shared<const std::string>(response.ReleaseContent());
+            QueueBody(conn, BodySegment(content, content->data(), content->length()));
+        }
+        QueueBody(conn, response.body());
+        for (const BodySegment &body : response.more_body())
+            QueueBody(conn, body);
+        if (response.producer())
+        { // its first chunks leave with the header block
+            conn->chunked = !response.stream_length().has_value();
+            conn->stream_remaining = response.stream_length().value_or(0);
+            conn->producer = response.ReleaseProducer();
+            if (!PullBody(conn))
+                conn->close_after_write = true;
+        }
+    }
+
+    // Fills iov with the buffers of the output up to the next file region,
+    // and returns how many. *more tells whether more output follows them.
+    static size_t GatherOutput(const Connection *conn, iovec *iov, size_t max_iovecs,
+                               bool *more)
+    {
+        size_t first = conn->sent_segments, last = first;
+        for (; last < conn->segments.size() && last - first < max_iovecs &&
+               conn->segments[last].fd < 0;
+             last++)
+        {
+            const BodySegment &segment = conn->segments[last];
+            iov[last - first].iov_base = const_cast<char *>(
+                segment.data != nullptr ? segment.data
+                                        : conn->output.data() + segment.offset);
+            iov[last - first].iov_len = segment.length;
+        }
+        *more = last < conn->segments.size();
+        return last - first;
+    }
+
+    // Drops bytes that were sent from the front of the output
+    static void ConsumeOutput(Connection *conn, size_t sent)
+    {
+        conn->pending_bytes -= sent;
+        for (size_t i = conn->sent_segments; i < conn->segments.size() && sent > 0; i++)
+        {
+            BodySegment &segment = conn->segments[i];
+            size_t consumed = std::min(sent, segment.length);
+            sent -= consumed;
+            segment.length -= consumed;
+            if (segment.data != nullptr)
+                segment.data += consumed;
             else
+                segment.offset += consumed;
+            if (segment.length == 0)
+            { // release the body as soon as it is sent
+                segment.owner.reset();
+                conn->sent_segments++;
+            }
+        }
+        if (conn->sent_segments == conn->segments.size())
+        { // we have written the complete messages, reuse the buffers
+            conn->output.clear();
+            conn->segments.clear();
+            conn->sent_segments = 0;
+        }
+    }
+
+    bool HttpServer::WriteToConnection(Connection *conn)
+    {
+        iovec iov[MAX_IOVECS];
+        msghdr msg = {};
+        msg.msg_iov = iov;
+
+        while (true)
+        {
+            // once everything queued is sent, pull more of a streamed body
+            if (conn->sent_segments == conn->segments.size() && !PullBody(conn))
+                return false;
+            if (conn->sent_segments == conn->segments.size())
+                return true;
+            ssize_t byte_count;
+            BodySegment &segment = conn->segments[conn->sent_segments];
+            if (segment.fd >= 0)
             {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                { // retry
-                    request->fd = fd;
-                    controlEpollEvent(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLIN, request);
-                }
-                else
-                { // other error
-                    controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, fd);
-                    close(fd);
-                    delete request;
-                }
+                off_t offset = segment.offset;
+                byte_count = sendfile(conn->fd, segment.fd, &offset, segment.length);
+            }
+            else
+            { // gather every buffer up to the next file region
+                bool more;
+                msg.msg_iovlen = GatherOutput(conn, iov, MAX_IOVECS, &more);
+                // let the kernel coalesce these buffers with what follows them
+                byte_count = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+            }
+
+            if (byte_count > 0)
+            {
+                ConsumeOutput(conn, byte_count);
+            }
+            else if (byte_count == 0)
+            { // the file was truncated under us
+                return false;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            { // retry once EPOLLOUT tells us the socket is writable again
+                return true;
+            }
+            else if (errno != EINTR)
+            { // other error
+                return false;
             }
         }
-        else
+    }
+
+    void HttpServer::ProcessUringEvents(int worker_id)
+    {
+        IoUring ring;
+        int listen_fd = worker_listen_fd_[worker_id];
+        int wakeup_fd = worker_wakeup_fd_[worker_id];
+        if (!ring.Init(URING_ENTRIES, URING_BUFFER_COUNT, kMaxBufferSize) ||
+            !ring.PrepareMultishotAccept(listen_fd, kAcceptOp) ||
+            !ring.PreparePoll(wakeup_fd, POLLIN, kWakeupOp))
+        { // e.g. out of locked memory: this worker serves its listener with epoll
+            std::cerr << "Worker " << worker_id << " cannot use io_uring ("
+                      << std::strerror(errno) << "), falling back to epoll" << std::endl;
+            controlEpollEvent(worker_epoll_fd_[worker_id], EPOLL_CTL_ADD, listen_fd, EPOLLIN,
+                              nullptr);
+            ProcessEvents(worker_id);
+            return;
+        }
+
+        ConnectionTimers timers(ToMs(std::chrono::steady_clock::now()));
+        WorkerContext context(this, worker_id, -1, &ring, ToMs(std::chrono::steady_clock::now()));
+        std::uint64_t delay_us = 0;
+        while (running_)
         {
-            response = data;
-            // auto len = response->buffer.length();
-            // char* buffer = new char[len];
-            ssize_t byte_count =
-                send(fd, response->buffer.c_str() + response->cursor, response->length, 0);
-            if (byte_count >= 0)
-            {
-                if (byte_count < response->length)
-                { // there are still bytes to write
-                    response->cursor += byte_count;
-                    response->length -= byte_count;
-                    controlEpollEvent(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLOUT, response);
+            // what the last batch queued is submitted by the same call that
+            // waits for the next one
+            ring.SubmitAndWait(5);
+            auto woken = std::chrono::steady_clock::now();
+            std::uint64_t now_ms = ToMs(woken);
+
+            ring.ForEachCompletion([&](const io_uring_cqe &cqe)
+                                   {
+                if ((cqe.user_data & kUringOpMask) == kResumeOp)
+                {
+                    context.Ready(reinterpret_cast<void *>(cqe.user_data & ~kUringOpMask),
+                                  cqe.res);
+                    return;
                 }
-                else
-                { // we have written the complete message
-                    request = new EventData();
-                    request->fd = fd;
-                    controlEpollEvent(epoll_fd, EPOLL_CTL_MOD, fd, EPOLLIN, request);
-                    delete response;
+                if (cqe.user_data == kWakeupOp)
+                {
+                    CompleteOffloaded(worker_id, -1, &ring, &timers, now_ms);
+                    ring.PreparePoll(wakeup_fd, POLLIN, kWakeupOp);
+                    return;
                 }
-            }
-            else
+                if (cqe.user_data != kAcceptOp)
+                {
+                    HandleUringCompletion(&ring, &timers, now_ms, cqe);
+                    return;
+                }
+                if (cqe.res >= 0 && AdmitConnection(worker_id, cqe.res))
+                {
+                    Connection *conn = new Connection(cqe.res, worker_id);
+                    if (StartReceiving(&ring, conn))
+                        ArmTimer(&timers, now_ms, conn);
+                    else
+                        CloseConnection(-1, &timers, conn);
+                }
+                if (!(cqe.flags & IORING_CQE_F_MORE))
+                { // the kernel stopped accepting, e.g. out of file descriptors
+                    ring.PrepareMultishotAccept(listen_fd, kAcceptOp);
+                } });
+
+            timers.Advance(now_ms, [&](Connection *expired)
+                           { ExpireConnection(-1, &timers, expired); });
+            context.Advance(now_ms);
+            RecordDelay(worker_id, woken, &delay_us);
+        }
+    }
+
+    bool HttpServer::StartReceiving(IoUring *ring, Connection *conn)
+    {
+        if (!ring->PrepareMultishotRecv(conn->fd, UserData(conn, kRecvOp)))
+            return false;
+        conn->recv_armed = true;
+        conn->pending_ops++;
+        return true;
+    }
+
+    // Waits until the socket can take more of the output, when a send
+    // would block
+    static bool WaitWritable(IoUring *ring, Connection *conn)
+    {
+        if (!ring->PreparePoll(conn->fd, POLLOUT, UserData(conn, kPollOp)))
+            return false;
+        conn->send_in_flight = true;
+        conn->pending_ops++;
+        return true;
+    }
+
+    // Queues a sendmsg of the output up to the next file region. io_uring
+    // has no sendfile, so file regions are sent from here as with epoll.
+    bool HttpServer::SubmitSend(IoUring *ring, Connection *conn)
+    {
+        while (!conn->send_in_flight)
+        {
+            if (conn->sent_segments == conn->segments.size() && !PullBody(conn))
+                return false;
+            if (conn->sent_segments == conn->segments.size())
+                return true;
+            BodySegment &segment = conn->segments[conn->sent_segments];
+            if (segment.fd < 0)
             {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                { // retry
-                    controlEpollEvent(epoll_fd, EPOLL_CTL_ADD, fd, EPOLLOUT, response);
+                bool more;
+                conn->send_iov.resize(MAX_IOVECS);
+                conn->send_msg.msg_iov = conn->send_iov.data();
+                conn->send_msg.msg_iovlen = GatherOutput(conn, conn->send_iov.data(), MAX_IOVECS,
+                                                         &more);
+                if (!ring->PrepareSendmsg(conn->fd, &conn->send_msg,
+                                          MSG_NOSIGNAL | (more ? MSG_MORE : 0),
+                                          UserData(conn, kSendOp)))
+                {
+                    return false;
                 }
-                else
-                { // other error
-                    controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, fd);
-                    close(fd);
-                    delete response;
+                conn->send_in_flight = true;
+                conn->pending_ops++;
+                return true;
+            }
+
+            off_t offset = segment.offset;
+            ssize_t byte_count = sendfile(conn->fd, segment.fd, &offset, segment.length);
+            if (byte_count > 0)
+                ConsumeOutput(conn, byte_count);
+            else if (byte_count == 0)
+                return false; // the file was truncated under us
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return WaitWritable(ring, conn);
+            else if (errno != EINTR)
+                return false;
+        }
+        return true;
+    }
+
+    void HttpServer::HandleUringCompletion(IoUring *ring, ConnectionTimers *timers,
+                                           std::uint64_t now_ms, const io_uring_cqe &cqe)
+    {
+        Connection *conn = reinterpret_cast<Connection *>(cqe.user_data & ~kUringOpMask);
+        bool failed = false;
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+            conn->pending_ops--;
+
+        switch (cqe.user_data & kUringOpMask)
+        {
+        case kRecvOp:
+            if (cqe.flags & IORING_CQE_F_BUFFER)
+            { // copy the bytes out, so that the buffer serves the next receive
+                std::uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (cqe.res > 0 && !conn->closing)
+                {
+                    conn->input.append(ring->Buffer(id), cqe.res);
+                    conn->readable = true;
                 }
+                ring->RecycleBuffer(id);
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+            { // ENOBUFS when every buffer was taken, or a cancel: re-armed below
+                conn->recv_armed = false;
+                conn->recv_stopping = false;
+            }
+            if (cqe.res == 0)
+                conn->peer_closed = true;
+            else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+                failed = true;
+            break;
+        case kSendOp:
+            conn->send_in_flight = false;
+            if (cqe.res > 0)
+                ConsumeOutput(conn, cqe.res);
+            else if (cqe.res == -EAGAIN && !conn->closing)
+                failed = !WaitWritable(ring, conn);
+            else if (cqe.res < 0 && cqe.res != -EINTR)
+                failed = true;
+            break;
+        case kPollOp:
+            conn->send_in_flight = false;
+            failed = cqe.res < 0;
+            break;
+        default: // kCancelOp
+            break;
+        }
+
+        if (conn->closing)
+        {
+            if (conn->pending_ops == 0)
+            {
+                close(conn->fd);
+                delete conn;
+            }
+            return;
+        }
+        if (failed)
+        {
+            CloseConnection(-1, timers, conn);
+            return;
+        }
+        PumpUringConnection(ring, timers, now_ms, conn);
+    }
+
+    // Moves the connection on with what it received and sent so far
+    void HttpServer::PumpUringConnection(IoUring *ring, ConnectionTimers *timers,
+                                         std::uint64_t now_ms, Connection *conn)
+    {
+        if (!conn->send_in_flight && conn->finished)
+        { // a handler completed during the send, and holds back the input
+            std::unique_ptr<OffloadedRequest> done = std::move(conn->finished);
+            conn->offloaded = false;
+            QueueResponse(conn, done->response, done->send_content);
+            conn->readable = true;
+        }
+        // The requests that arrived are handled once the kernel is done with
+        // the output, and their responses leave together with the next send
+        if (!conn->send_in_flight && conn->readable && !conn->close_after_write &&
+            !conn->offloaded && !conn->producer && conn->pending_bytes < MAX_PENDING_OUTPUT)
+        {
+            conn->readable = false;
+            ProcessInput(conn);
+            // requests pipelined behind a streamed body are handled once it
+            // has been sent
+            conn->readable = conn->producer && !conn->input.empty();
+        }
+        if (!SubmitSend(ring, conn))
+        {
+            CloseConnection(-1, timers, conn);
+            return;
+        }
+
+        // Receiving stops while the client does not read its responses, or
+        // while a send or a blocking handler holds back what it sent, and
+        // resumes once they are done
+        bool receive = !conn->peer_closed && !conn->close_after_write &&
+                       conn->pending_bytes < MAX_PENDING_OUTPUT &&
+                       !(conn->readable && conn->input.length() >= MAX_READ_SIZE);
+        if (receive && !conn->recv_armed)
+        {
+            if (!StartReceiving(ring, conn))
+            {
+                CloseConnection(-1, timers, conn);
+                return;
+            }
+        }
+        else if (!receive && conn->recv_armed && !conn->recv_stopping)
+        {
+            if (!ring->PrepareCancel(UserData(conn, kRecvOp), UserData(conn, kCancelOp)))
+            {
+                CloseConnection(-1, timers, conn);
+                return;
             }
+            conn->recv_stopping = true;
+            conn->pending_ops++;
         }
+        FinishIo(-1, timers, now_ms, conn);
     }
 
-    void HttpServer::HandleHttpData(const EventData &raw_request,
-                                    EventData *raw_response)
+    // Every event pushes the deadline of the state the connection is left
+    // in, except the header deadline of a request, which is fixed when its
+    // first byte arrives so that trickling bytes do not keep it open
+    void HttpServer::ArmTimer(ConnectionTimers *timers, std::uint64_t now_ms,
+                              Connection *conn)
     {
-        std::string request_string(raw_request.buffer), response_string;
+        std::uint64_t deadline;
+        if (conn->offloaded && conn->pending_bytes == 0)
+        { // the client is waiting for us, not the other way round
+            timers->Cancel(conn);
+            return;
+        }
+        if (conn->pending_bytes > 0)
+        { // the client does not read what we send fast enough
+            deadline = now_ms + timeouts_.write.count();
+        }
+        else if (conn->awaiting_body)
+        {
+            deadline = now_ms + timeouts_.body.count();
+        }
+        else if (!conn->input.empty())
+        {
+            if (conn->header_deadline == 0)
+                conn->header_deadline = now_ms + timeouts_.header.count();
+            deadline = conn->header_deadline;
+        }
+        else
+        {
+            deadline = now_ms + timeouts_.idle.count();
+        }
+        timers->Arm(conn, deadline);
+    }
+
+    void HttpServer::ExpireConnection(int epoll_fd, ConnectionTimers *timers,
+                                      Connection *conn)
+    {
+        // A client that stopped in the middle of a request is told why, as
+        // far as its socket takes it without blocking. Idle connections and
+        // clients that stopped reading are just closed.
+        if (conn->pending_bytes == 0 && (!conn->input.empty() || conn->incoming))
+        {
+            HttpResponse response(HttpStatusCode::RequestTimeout);
+            response.SetHeader("Connection", "close");
+            response.SetHeader("Content-Type", "text/plain");
+            response.SetContent("REQUEST TIMEOUT\n");
+            QueueResponse(conn, response, true);
+            WriteToConnection(conn);
+        }
+        CloseConnection(epoll_fd, timers, conn);
+    }
+
+    void HttpServer::CloseConnection(int epoll_fd, ConnectionTimers *timers,
+                                     Connection *conn)
+    {
+        timers->Cancel(conn);
+        if (conn->busy)
+            busy_connections_.fetch_sub(1, std::memory_order_relaxed);
+        worker_connections_[conn->worker].fetch_sub(1, std::memory_order_relaxed);
+        if (epoll_fd < 0)
+        { // io_uring: shutting the socket down ends the operations that are
+          // still running on it
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        else
+        {
+            controlEpollEvent(epoll_fd, EPOLL_CTL_DEL, conn->fd);
+        }
+        // the last completion, or offloaded handler, deletes it
+        conn->closing = true;
+        if (conn->pending_ops > 0)
+            return;
+        close(conn->fd);
+        delete conn;
+    }
+
+    void HttpServer::ProcessInput(Connection *conn)
+    {
+        // Handle every complete request in the buffer, so that pipelined
+        // requests are answered together with a single send
+        RequestView view;
+        size_t start = 0;
+        while (!conn->close_after_write && !conn->offloaded && !conn->producer &&
+               start < conn->input.length())
+        {
+            if (conn->incoming)
+            { // the body of a request whose header block was handled
+                if (!ReceiveBody(conn, &start))
+                    break;
+                continue;
+            }
+            std::string_view buffer(conn->input.data() + start,
+                                    conn->input.length() - start);
+            ParseStatus status = ParseRequest(buffer, &conn->scan_offset, &view);
+            if (status == ParseStatus::Incomplete && view.header_length > 0)
+            { // take the body as it arrives rather than once all of it has
+                StartBody(conn, view);
+                start += view.header_length;
+                conn->scan_offset = 0;
+                conn->header_deadline = 0;
+                continue;
+            }
+            if (status == ParseStatus::Incomplete)
+            { // wait for the rest of the header block
+                break;
+            }
+            if (status == ParseStatus::Malformed)
+            { // we cannot tell where the next request starts
+                HttpResponse http_response(HttpStatusCode::BadRequest);
+                http_response.SetContent(view.error);
+                QueueResponse(conn, http_response, true);
+                conn->close_after_write = true;
+                break;
+            }
+
+            if (!HandleHttpData(view, conn))
+                conn->close_after_write = true;
+            start += view.length;
+            conn->scan_offset = 0;
+            conn->header_deadline = 0; // the next request has its own
+        }
+
+        conn->input.erase(0, start);
+        conn->awaiting_body = conn->incoming != nullptr;
+    }
+
+    // The response to an exception thrown while a request was parsed or
+    // handled
+    static HttpResponse ErrorResponse(const std::exception &e)
+    {
+        HttpResponse response(HttpStatusCode::InternalServerError);
+        if (dynamic_cast<const std::invalid_argument *>(&e) != nullptr)
+            response = HttpResponse(HttpStatusCode::BadRequest);
+        else if (dynamic_cast<const std::logic_error *>(&e) != nullptr)
+            response = HttpResponse(HttpStatusCode::HttpVersionNotSupported);
+        response.SetContent(e.what());
+        return response;
+    }
+
+    bool HttpServer::HandleHttpData(const RequestView &raw_request,
+                                    Connection *conn)
+    {
+        bool keep_alive = !equals_ignore_case(raw_request.header("Connection"), "close");
         HttpRequest http_request;
+        try
+        {
+            http_request = viewToRequest(raw_request);
+        }
+        catch (const std::exception &e)
+        {
+            HttpResponse http_response = ErrorResponse(e);
+            QueueResponse(conn, http_response, true);
+            return keep_alive;
+        }
+        DispatchRequest(conn, std::move(http_request));
+        return keep_alive;
+    }
+
+    // Hands a request whose body is complete to its handler
+    void HttpServer::DispatchRequest(Connection *conn, HttpRequest &&http_request)
+    {
         HttpResponse http_response;
+        try
+        {
+            const RouteHandler *handler = FindHandler(http_request, &http_response);
+            bool send_content = http_request.method() != HttpMethod::HEAD;
+            if (handler != nullptr && handler->make_sink && http_request.body_sink() == nullptr)
+            { // the body arrived with the header block
+                std::shared_ptr<BodySink> sink = handler->make_sink(http_request);
+                sink->Write(http_request.ReleaseContent());
+                sink->Finish();
+                http_request.SetBodySink(std::move(sink));
+            }
+            else if (handler != nullptr && !handler->make_sink &&
+                     http_request.content_length() > body_limits_.in_memory)
+            {
+                handler = nullptr;
+                http_response = ContentTooLarge();
+            }
+            if (handler != nullptr && handler->async_callback)
+            {
+                StartTask(conn, std::move(http_request), send_content);
+                return;
+            }
+            if (handler != nullptr && handler->mode == HandlerMode::Blocking)
+            { // its response is queued once the executor is done with it
+                Offload(conn, std::move(http_request), send_content);
+                return;
+            }
+            if (handler != nullptr)
+                http_response = handler->callback(http_request, this->storage);
+        }
+        catch (const std::exception &e)
+        {
+            http_response = ErrorResponse(e);
+        }
+
+        // Set response to write to client
+        QueueResponse(conn, http_response, http_request.method() != HttpMethod::HEAD);
+    }
 
+    // Handles the header block of a request whose body has not arrived yet.
+    // The body is then received piece by piece, after a 100 Continue if
+    // the client waits for one. A request rejected on its header block is
+    // answered at once: its body is read and dropped, or the connection
+    // closed if the body is large or the client waits before sending it.
+    void HttpServer::StartBody(Connection *conn, const RequestView &view)
+    {
+        std::unique_ptr<IncomingRequest> incoming(new IncomingRequest());
+        incoming->keep_alive = !equals_ignore_case(view.header("Connection"), "close");
+        incoming->chunked = view.chunked;
+        incoming->remaining = view.content_length;
+        bool expects_continue = equals_ignore_case(view.header("Expect"), "100-continue");
+        HttpResponse error;
+        bool rejected = true;
         try
         {
-            http_request = stringToRequest(request_string);
-            http_response = HandleHttpRequest(http_request);
+            incoming->request = viewToRequest(view);
+            const RouteHandler *handler = FindHandler(incoming->request, &error);
+            if (handler != nullptr)
+            {
+                incoming->limit = handler->make_sink ? body_limits_.streamed
+                                                     : body_limits_.in_memory;
+                if (!view.chunked && view.content_length > incoming->limit)
+                {
+                    error = ContentTooLarge();
+                }
+                else
+                {
+                    if (handler->make_sink)
+                        incoming->request.SetBodySink(handler->make_sink(incoming->request));
+                    else if (!view.chunked)
+                        incoming->content.reserve(view.content_length);
+                    rejected = false;
+                }
+            }
+        }
+        catch (const std::exception &e)
+        {
+            error = ErrorResponse(e);
         }
-        catch (const std::invalid_argument &e)
+
+        if (rejected)
         {
-            http_response = HttpResponse(HttpStatusCode::BadRequest);
-            http_response.SetContent(e.what());
+            QueueResponse(conn, error, incoming->request.method() != HttpMethod::HEAD);
+            if (expects_continue || incoming->remaining > body_limits_.in_memory)
+            {
+                conn->close_after_write = true;
+                return;
+            }
+            incoming->discard = true;
+            incoming->limit = body_limits_.in_memory;
         }
-        catch (const std::logic_error &e)
+        else if (expects_continue)
         {
-            http_response = HttpResponse(HttpStatusCode::HttpVersionNotSupported);
-            http_response.SetContent(e.what());
+            size_t from = conn->output.length();
+            conn->output.append("HTTP/1.1 100 Continue\r\n\r\n");
+            CommitOutput(conn, from);
+        }
+        conn->incoming = std::move(incoming);
+    }
+
+    // Takes what arrived of the body of conn->incoming, from *start in the
+    // input. Returns true once the body is complete and the request was
+    // dispatched, and false while more of it is needed or if it failed,
+    // which is answered and closes the connection.
+    bool HttpServer::ReceiveBody(Connection *conn, size_t *start)
+    {
+        IncomingRequest &incoming = *conn->incoming;
+        BodySink *sink = incoming.request.body_sink();
+        std::string_view input(conn->input.data() + *start, conn->input.length() - *start);
+        ParseStatus status = ParseStatus::Incomplete;
+        size_t used = 0;
+        HttpResponse error;
+        bool failed = false;
+        try
+        {
+            while (status == ParseStatus::Incomplete)
+            {
+                std::string_view piece;
+                size_t consumed;
+                if (incoming.chunked)
+                {
+                    status = incoming.decoder.Decode(input.substr(used), &consumed, &piece);
+                }
+                else
+                {
+                    consumed = std::min(incoming.remaining, input.length() - used);
+                    piece = input.substr(used, consumed);
+                    incoming.remaining -= consumed;
+                    if (incoming.remaining == 0)
+                        status = ParseStatus::Complete;
+                }
+                used += consumed;
+                incoming.received += piece.length();
+                if (incoming.received > incoming.limit)
+                { // only a chunked body is not checked up front
+                    error = ContentTooLarge();
+                    failed = true;
+                    break;
+                }
+                if (!incoming.discard && sink != nullptr)
+                    sink->Write(piece);
+                else if (!incoming.discard)
+                    incoming.content.append(piece);
+                if (consumed == 0 && status == ParseStatus::Incomplete)
+                    break;
+            }
         }
         catch (const std::exception &e)
         {
-            http_response = HttpResponse(HttpStatusCode::InternalServerError);
-            http_response.SetContent(e.what());
+            error = ErrorResponse(e);
+            failed = true;
+        }
+        *start += used;
+        if (status == ParseStatus::Malformed)
+        {
+            error = HttpResponse(HttpStatusCode::BadRequest);
+            error.SetContent("Invalid chunked body");
+            failed = true;
+        }
+        if (failed)
+        { // we cannot tell where the next request starts
+            if (!incoming.discard)
+                QueueResponse(conn, error, true);
+            conn->close_after_write = true;
+            conn->incoming.reset();
+            return false;
         }
+        if (status == ParseStatus::Incomplete)
+            return false;
 
-        // Set response to write to client
-        response_string =
-            to_string(http_response, http_request.method() != HttpMethod::HEAD);
-        std::size_t rpLen = response_string.length();
-        // std::size_t  cpLen = rpLen > kMaxBufferSize ? kMaxBufferSize : rpLen;
-        // memcpy(raw_response->buffer, response_string.c_str(), rpLen);
-        raw_response->buffer = response_string;
-        raw_response->length = rpLen;
+        std::unique_ptr<IncomingRequest> done = std::move(conn->incoming);
+        if (!done->keep_alive)
+            conn->close_after_write = true;
+        if (done->discard)
+            return true;
+        if (sink == nullptr)
+        { // the handler sees the body as if it had come with a Content-Length
+            done->request.SetContent(std::move(done->content));
+            done->request.RemoveHeader("Transfer-Encoding");
+        }
+        try
+        {
+            if (sink != nullptr)
+                sink->Finish();
+        }
+        catch (const std::exception &e)
+        {
+            HttpResponse http_response = ErrorResponse(e);
+            QueueResponse(conn, http_response, true);
+            return true;
+        }
+        DispatchRequest(conn, std::move(done->request));
+        return true;
     }
 
-    HttpResponse HttpServer::HandleHttpRequest(const HttpRequest &request)
+    // The handler of the request, with its path parameters set, or nullptr
+    // with the response to send instead in *error
+    const RouteHandler *HttpServer::FindHandler(HttpRequest &request, HttpResponse *error)
     {
-        auto it = request_handlers_.find(request.uri());
-        if (it == request_handlers_.end()) // this uri is not registered
+        RouteParams params;
+        bool path_found;
+        const RouteHandler *handler =
+            router_.Find(request.path(), request.method(), &params, &path_found);
+        if (!path_found) // this uri is not registered
         {
-            HttpResponse response(HttpStatusCode::NotFound);
-            response.SetHeader("Content-Type", "text/plain");
-            response.SetContent("NOT FOUND\n");
-            return response;
+            *error = NotFound();
+            return nullptr;
         }
-        auto callback_it = it->second.find(request.method());
-        if (callback_it == it->second.end())
+        if (handler == nullptr)
         { // no handler for this method
             HttpResponse response(HttpStatusCode::MethodNotAllowed);
             response.SetHeader("Content-Type", "text/plain");
             response.SetContent("NOT ALLOWED\n");
+            *error = std::move(response);
+            return nullptr;
+        }
+        request.SetParams(params);
+        return handler;
+    }
+
+    HttpResponse HttpServer::HandleHttpRequest(HttpRequest &request)
+    {
+        HttpResponse response;
+        const RouteHandler *handler = FindHandler(request, &response);
+        if (handler == nullptr)
             return response;
+        return handler->callback(request, this->storage); // call handler to process the request
+    }
+
+    // Runs the handler of the request on the executor. The connection reads
+    // on but handles nothing else until the response is back, so that
+    // responses leave in the order of the requests.
+    void HttpServer::Offload(Connection *conn, HttpRequest &&request, bool send_content)
+    {
+        OffloadedRequest *job = new OffloadedRequest();
+        job->conn = conn;
+        job->worker = conn->worker;
+        job->send_content = send_content;
+        job->request = std::move(request);
+        conn->offloaded = true;
+        conn->pending_ops++;
+        executor_.Submit([this, job]()
+                         {
+            // the route is found again, as the parameters of the request
+            // were views into the copy it was moved from
+            try
+            {
+                job->response = HandleHttpRequest(job->request);
+            }
+            catch (const std::exception &e)
+            {
+                job->response = ErrorResponse(e);
+            }
+            if (worker_completed_[job->worker].Push(job))
+                WakeUp(job->worker); });
+    }
+
+    // Runs a coroutine handler until it first suspends. If it does, the
+    // connection waits for its response as for a blocking handler, and the
+    // worker gets it back once the coroutine completes.
+    void HttpServer::StartTask(Connection *conn, HttpRequest &&request, bool send_content)
+    {
+        std::unique_ptr<OffloadedRequest> job(new OffloadedRequest());
+        job->conn = conn;
+        job->worker = conn->worker;
+        job->send_content = send_content;
+        job->request = std::move(request);
+        // find the route again to point the parameters into the moved request
+        const RouteHandler *handler = FindHandler(job->request, &job->response);
+        job->task = handler->async_callback(job->request, this->storage);
+
+        OffloadedRequest *pending = job.get();
+        auto take_response = [pending]()
+        {
+            try
+            {
+                pending->response = pending->task.Result();
+            }
+            catch (const std::exception &e)
+            {
+                pending->response = ErrorResponse(e);
+            }
+        };
+        bool done = job->task.Start([this, pending, take_response]()
+                                    {
+            take_response();
+            if (worker_completed_[pending->worker].Push(pending))
+                WakeUp(pending->worker); });
+        if (!done)
+        {
+            conn->offloaded = true;
+            conn->pending_ops++;
+            job.release();
+            return;
+        }
+        take_response();
+        if (conn->send_in_flight)
+        { // as in CompleteOffloaded: queued once the kernel is done with the output
+            conn->offloaded = true;
+            conn->finished = std::move(job);
+            return;
+        }
+        QueueResponse(conn, job->response, send_content);
+    }
+
+    void HttpServer::WakeUp(int worker_id)
+    {
+        std::uint64_t one = 1;
+        write(worker_wakeup_fd_[worker_id], &one, sizeof(one));
+    }
+
+    // Resumes the coroutines whose work the executor ran, then queues the
+    // responses of the handlers that completed for the connections of the
+    // worker, and serves what was pipelined behind them
+    void HttpServer::CompleteOffloaded(int worker_id, int epoll_fd, IoUring *ring,
+                                       ConnectionTimers *timers, std::uint64_t now_ms)
+    {
+        // reset the eventfd first: a response pushed after PopAll wakes us
+        // up again
+        std::uint64_t count;
+        read(worker_wakeup_fd_[worker_id], &count, sizeof(count));
+        Waiter *waiter = worker_resumed_[worker_id].PopAll();
+        while (waiter != nullptr)
+        { // may complete handlers, whose responses are queued below
+            Waiter *next = waiter->next;
+            waiter->handle.resume();
+            waiter = next;
+        }
+        OffloadedRequest *job = worker_completed_[worker_id].PopAll();
+        while (job != nullptr)
+        {
+            std::unique_ptr<OffloadedRequest> done(job);
+            job = job->next;
+            Connection *conn = done->conn;
+            conn->pending_ops--;
+            if (conn->closing)
+            {
+                if (conn->pending_ops == 0)
+                {
+                    close(conn->fd);
+                    delete conn;
+                }
+                continue;
+            }
+            if (conn->send_in_flight)
+            { // the kernel still reads the output: appending may move it
+                conn->finished = std::move(done);
+                continue;
+            }
+            conn->offloaded = false;
+            QueueResponse(conn, done->response, done->send_content);
+            if (ring != nullptr)
+            {
+                conn->readable = true;
+                PumpUringConnection(ring, timers, now_ms, conn);
+            }
+            else
+            {
+                ProcessInput(conn);
+                HandleEpollEvent(epoll_fd, timers, now_ms, conn, 0);
+            }
         }
-        return callback_it->second(request, this->storage); // call handler to process the request
     }
 
     void HttpServer::controlEpollEvent(int epoll_fd, int op, int fd,
@@ -7,49 +7,242 @@
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <atomic>
 
 #include <chrono>
 #include <functional>
-#include <map>
+#include <memory>
 #include <string>
 #include <thread>
 #include <utility>
+#include <vector>
 
+#include "async.h"
+#include "executor.h"
 #include "http_message.h"
+#include "io_uring.h"
+#include "mpsc_queue.h"
+#include "router.h"
+#include "task.h"
+#include "timer_wheel.h"
 #include "uri.h"
 #include <storage.h>
 
 namespace simple_http_server
 {
 
-    // Maximum size of an HTTP message is limited by how much bytes
-    // we can read or send via socket each time
+    // Number of bytes we try to read from a socket with each recv call
     // constexpr size_t kMaxBufferSize = 65104;
     constexpr size_t kMaxBufferSize = 4096;
 
-    struct EventData
+    // A request whose body arrives after its header block was handled. The
+    // body is decoded from the input of the connection as it arrives, into
+    // content or into the sink of the route, and the request dispatched
+    // once it is complete.
+    struct IncomingRequest
     {
-        EventData() : fd(0), length(0), cursor(0), buffer() {}
+        HttpRequest request;
+        bool keep_alive = true;
+        bool discard = false; // already answered: the body is read and dropped
+        bool chunked = false;
+        ChunkedDecoder decoder;
+        size_t remaining = 0; // of a Content-Length body
+        size_t received = 0;  // of the body so far
+        size_t limit = 0;     // past which the body is too large
+        std::string content;  // unless the request has a sink
+    };
+
+    struct OffloadedRequest;
+
+    // State of a client connection. A Connection lives as long as its socket
+    // and is registered once in the worker's epoll set (edge-triggered, for
+    // both reading and writing), so serving a request on a keep-alive
+    // connection needs neither heap allocations nor epoll_ctl calls. With
+    // io_uring it has instead a multishot receive armed while it may read.
+    struct Connection
+    {
+        Connection(int fd, int worker)
+            : fd(fd), worker(worker), scan_offset(0), sent_segments(0), pending_bytes(0),
+              chunked(false), stream_remaining(0), readable(false), peer_closed(false), close_after_write(false),
+              awaiting_body(false), busy(false), offloaded(false), header_deadline(0),
+              pending_ops(0), closing(false), recv_armed(false), recv_stopping(false),
+              send_in_flight(false), send_msg() {}
         int fd;
-        size_t length;
-        size_t cursor;
-        std::string buffer;
-        // char buffer[kMaxBufferSize];
-        // char* buffer = new char[kMaxBufferSize];
-        // ~EventData() {
-        //     if (buffer) {
-        //         delete[] buffer;
-        //     }
-        // }
+        int worker;         // whose epoll set the connection is in
+        std::string input;  // bytes received but not handled yet
+        size_t scan_offset; // how much of the next request was searched by ParseRequest
+        // What is waiting to be sent, in order. Segments without data or file
+        // are bytes of output, which holds the headers and bodies we built
+        // ourselves; the others reference bodies owned by someone else.
+        std::string output;
+        std::vector<BodySegment> segments;
+        size_t sent_segments;   // segments that have been fully sent
+        size_t pending_bytes;   // bytes of the remaining segments
+        // The body streamed after them, pulled from its producer whenever
+        // everything before has been sent. Requests pipelined behind it wait.
+        BodyProducer producer;
+        bool chunked;            // framed as chunks
+        size_t stream_remaining; // or the bytes it still has to give
+        // The request whose body is being received, if any
+        std::unique_ptr<IncomingRequest> incoming;
+        // epoll: recv has not returned EAGAIN since the last EPOLLIN.
+        // io_uring: bytes arrived that ProcessInput has not seen.
+        bool readable;
+        bool peer_closed;       // the client will not send anything else
+        bool close_after_write; // close once everything has been sent
+        bool awaiting_body;     // the body of a request is being received
+        bool busy;              // a request is being received or answered
+        bool offloaded;         // the handler of its next response has not returned yet
+        // When the header block of the request being received must be
+        // complete, or 0 while no request has started: unlike the other
+        // deadlines it is not pushed back when more bytes arrive
+        std::uint64_t header_deadline;
+        TimerLink<Connection> timer; // in the wheel of its worker once it had an event
+        // The Connection outlives every operation that refers to it: an
+        // offloaded handler, and with io_uring the operations submitted
+        int pending_ops; // operations that will complete again
+        bool closing;    // closed, deleted once pending_ops drops to 0
+        // io_uring only. The kernel reads send_msg and the output it points
+        // to until the send completes, so nothing is appended meanwhile.
+        bool recv_armed;     // the multishot receive is running
+        bool recv_stopping;  // and is being cancelled
+        bool send_in_flight; // a sendmsg or a poll for POLLOUT is running
+        // A handler that completed while a send was running, whose response
+        // is queued once the send completes
+        std::unique_ptr<OffloadedRequest> finished;
+        msghdr send_msg;
+        std::vector<iovec> send_iov;
+    };
+
+    using ConnectionTimers = TimerWheel<Connection, &Connection::timer>;
+
+    // How long a connection may wait in each state before the server closes
+    // it, so that idle or stalled clients cannot hold file descriptors:
+    // - idle: between two requests of a keep-alive connection
+    // - header: from the first byte of a request to the end of its header
+    //   block, however slowly the bytes arrive
+    // - body: between two reads while a request body is being received
+    // - write: between two writes while a response is being sent
+    // A request cut short by the header or body deadline is answered with 408.
+    struct ConnectionTimeouts
+    {
+        std::chrono::milliseconds idle = std::chrono::seconds(60);
+        std::chrono::milliseconds header = std::chrono::seconds(10);
+        std::chrono::milliseconds body = std::chrono::seconds(30);
+        std::chrono::milliseconds write = std::chrono::seconds(30);
+    };
+
+    // When the server turns new connections away instead of accepting work
+    // it cannot do in time. Past any of these limits a new connection gets
+    // a 503 with Retry-After, written on the accept path, and is closed, so
+    // the clients already admitted keep their latency:
+    // - connections: open connections of the worker it would go to
+    // - requests: connections of all workers with a request being received
+    //   or answered
+    // - queue_delay: how late the worker it would go to handles the events
+    //   it is woken up for, i.e. how long its last batches of events took
+    struct AdmissionLimits
+    {
+        size_t connections = 10000;
+        size_t requests = 5000;
+        std::chrono::milliseconds queue_delay = std::chrono::milliseconds(200);
+        std::chrono::seconds retry_after = std::chrono::seconds(1);
+    };
+
+    // How large request bodies may be, past which the request is answered
+    // with 413 and the connection closed:
+    // - in_memory: bodies handed whole to handlers, in request.content()
+    // - streamed: bodies handed to the sink of the route as they arrive,
+    //   which keeps at most a read's worth of them in memory
+    struct BodyLimits
+    {
+        size_t in_memory = kMaxContentLength;
+        size_t streamed = size_t(1) << 30;
+    };
+
+    // How workers wait for and perform socket I/O:
+    // - Epoll: readiness notifications, then read, write and accept calls
+    // - IoUring: completions of multishot accepts and receives (into rings
+    //   of buffers the kernel picks from) and of sends, submitted and reaped
+    //   with one io_uring_enter per batch. Files are still sent with
+    //   sendfile. Needs Linux 6.0; Start() falls back to Epoll otherwise.
+    // Both share the connection state, the parser and the handlers.
+    enum class IoBackend
+    {
+        Epoll,
+        IoUring
     };
 
     // A request handler should expect a request as argument and returns a response
     using HttpRequestHandler_t = std::function<HttpResponse(const HttpRequest &, Storage *)>;
+    // A coroutine handler runs on the worker until it co_awaits something
+    // from async.h, which lets the worker serve other connections until the
+    // coroutine is resumed. The request lives until the coroutine completes.
+    using AsyncHttpRequestHandler_t =
+        std::function<Task<HttpResponse>(const HttpRequest &, Storage *)>;
+    // Makes the sink the body of a request goes to, once its header block
+    // has arrived: what it throws rejects the request before the body is
+    // read. The handler finds the sink in request.body_sink().
+    using BodySinkFactory_t = std::function<std::shared_ptr<BodySink>(const HttpRequest &)>;
+
+    // Where a handler runs:
+    // - Inline: on the worker that received the request, which handles
+    //   nothing else meanwhile. For handlers that only compute a little.
+    // - Blocking: on the executor, a pool with a thread per core, for
+    //   handlers that read files, wait on other servers or compute a lot.
+    //   The response goes back to the worker, which goes on serving its
+    //   other connections meanwhile. Requests pipelined behind it on the
+    //   same connection wait for it.
+    enum class HandlerMode
+    {
+        Inline,
+        Blocking
+    };
+
+    struct RouteHandler
+    {
+        HttpRequestHandler_t callback;
+        HandlerMode mode = HandlerMode::Inline;
+        AsyncHttpRequestHandler_t async_callback; // instead of callback
+        BodySinkFactory_t make_sink;              // instead of request.content()
+
+        explicit operator bool() const
+        {
+            return static_cast<bool>(callback) || static_cast<bool>(async_callback);
+        }
+    };
+
+    // A request whose handler did not return on the worker (a blocking
+    // handler on the executor, or a coroutine that suspended), then its
+    // response on the way back to the worker of the connection
+    struct OffloadedRequest
+    {
+        OffloadedRequest *next = nullptr;
+        Connection *conn = nullptr;
+        int worker = 0;
+        bool send_content = true;
+        HttpRequest request;
+        HttpResponse response;
+        Task<HttpResponse> task;
+    };
+
+    // How the server accepts new connections:
+    // - SingleListener: 1 listener thread accepts every connection and hands
+    //   them to the workers in round-robin order
+    // - ReusePort: every worker owns a SO_REUSEPORT listening socket in its
+    //   own epoll set, so the kernel spreads connections between workers and
+    //   accept throughput scales with the number of workers
+    enum class ListenMode
+    {
+        SingleListener,
+        ReusePort
+    };
 
     // The server consists of:
     // - 1 main thread
     // - 1 listener thread that is responsible for accepting new connections
+    //   (only in ListenMode::SingleListener)
     // - Possibly many threads that process HTTP messages and communicate with
     // clients via socket.
     //   The number of workers is defined by a constant
@@ -65,48 +258,168 @@ namespace simple_http_server
 
         void Start();
         void Stop();
+        // Must be called before Start()
+        void SetListenMode(ListenMode mode) { listen_mode_ = mode; }
+        // Must be called before Start(). IoBackend::IoUring implies
+        // ListenMode::ReusePort.
+        void SetIoBackend(IoBackend backend) { io_backend_ = backend; }
+        // Threads of the executor that runs blocking handlers, by default
+        // one per core. Must be called before Start().
+        void SetOffloadThreads(size_t threads) { offload_threads_ = threads; }
+        // Must be called before Start()
+        void SetTimeouts(const ConnectionTimeouts &timeouts) { timeouts_ = timeouts; }
+        // Must be called before Start()
+        void SetAdmissionLimits(const AdmissionLimits &limits) { admission_ = limits; }
+        // Must be called before Start()
+        void SetBodyLimits(const BodyLimits &limits) { body_limits_ = limits; }
+        // The path is a route as described in router.h, e.g. "/users/:id" or
+        // "/assets/*file", taken as is: literal segments match request paths
+        // of the same case, and parameters keep the names given
         void RegisterHttpRequestHandler(const std::string &path, HttpMethod method,
-                                        const HttpRequestHandler_t callback)
+                                        const HttpRequestHandler_t callback,
+                                        HandlerMode mode = HandlerMode::Inline)
         {
-            Uri uri(path);
-            request_handlers_[uri].insert(std::make_pair(method, std::move(callback)));
+            router_.Add(path, method, RouteHandler{std::move(callback), mode, nullptr, nullptr});
         }
         void RegisterHttpRequestHandler(const Uri &uri, HttpMethod method,
-                                        const HttpRequestHandler_t callback)
+                                        const HttpRequestHandler_t callback,
+                                        HandlerMode mode = HandlerMode::Inline)
+        {
+            router_.Add(uri.path(), method, RouteHandler{std::move(callback), mode, nullptr, nullptr});
+        }
+        void RegisterHttpRequestHandler(const std::string &path, HttpMethod method,
+                                        const AsyncHttpRequestHandler_t callback)
         {
-            request_handlers_[uri].insert(std::make_pair(method, std::move(callback)));
+            router_.Add(path, method,
+                        RouteHandler{nullptr, HandlerMode::Inline, std::move(callback), nullptr});
         }
+        // The body of the requests goes to the sink made by make_sink as it
+        // arrives, e.g. to a FileBodySink for uploads, instead of content()
+        void RegisterHttpRequestHandler(const std::string &path, HttpMethod method,
+                                        const BodySinkFactory_t make_sink,
+                                        const HttpRequestHandler_t callback,
+                                        HandlerMode mode = HandlerMode::Inline)
+        {
+            router_.Add(path, method,
+                        RouteHandler{std::move(callback), mode, nullptr, std::move(make_sink)});
+        }
+        // Serves the files below root under prefix, e.g. "/static" and
+        // "./public" serve ./public/css/site.css at /static/css/site.css.
+        // The first directory served is the Storage handed to the other
+        // handlers, which get nullptr without any. Must be called before
+        // Start(): nothing is served unless it is mounted here.
+        void ServeDirectory(const std::string &prefix, const std::string &root,
+                            const StorageLimits &limits = StorageLimits());
 
         std::string host() const { return host_; }
         std::uint16_t port() const { return port_; }
         bool running() const { return running_; }
+        ListenMode listen_mode() const { return listen_mode_; }
+        // The backend in use once Start() has checked the kernel supports it
+        IoBackend io_backend() const { return io_backend_; }
+        const ConnectionTimeouts &timeouts() const { return timeouts_; }
+        const AdmissionLimits &admission_limits() const { return admission_; }
+        // Connections turned away with a 503 since the server started
+        std::uint64_t rejected_connections() const { return rejected_connections_; }
 
     private:
         static constexpr int BACK_LOG_SIZE = 5000;
         static constexpr int MAX_EVENTS = 10000;
         static constexpr int THREAD_POOL_SIZE = 5;
+        // Maximum number of connections a worker accepts per wakeup, so that
+        // a connection storm cannot starve the clients it already serves
+        static constexpr int ACCEPT_BATCH_SIZE = 64;
+        // Bytes read from a connection before handling what arrived, and
+        // unsent bytes after which we stop reading until the client catches up
+        static constexpr size_t MAX_READ_SIZE = 16 * kMaxBufferSize;
+        static constexpr size_t MAX_PENDING_OUTPUT = 1024 * 1024;
+        // Buffers handed to a single sendmsg call
+        static constexpr size_t MAX_IOVECS = 64;
+        // Submission queue entries of a worker's io_uring, and receive
+        // buffers (of kMaxBufferSize) shared by its connections
+        static constexpr unsigned URING_ENTRIES = 4096;
+        static constexpr unsigned URING_BUFFER_COUNT = 256;
+        // How often the storage watcher checks running_, and how often it
+        // stats every file when inotify is not available (in seconds)
+        static constexpr int WATCH_POLL_TIMEOUT_MS = 500;
+        static constexpr int STORAGE_SCAN_INTERVAL = 5;
 
         std::string host_;
         std::uint16_t port_;
         int sock_fd_;
         std::atomic_bool running_;
+        ListenMode listen_mode_;
+        IoBackend io_backend_;
+        ConnectionTimeouts timeouts_;
+        AdmissionLimits admission_;
+        BodyLimits body_limits_;
+        // The whole 503 response, serialized by Start()
+        std::string overload_response_;
+        std::atomic<std::uint64_t> rejected_connections_;
+        std::atomic<size_t> busy_connections_;
+        std::atomic<size_t> worker_connections_[THREAD_POOL_SIZE];
+        // Smoothed duration of the event batches of each worker, in us
+        std::atomic<std::uint64_t> worker_delay_us_[THREAD_POOL_SIZE];
         std::thread listener_thread_;
         std::thread storage_watcher_;
         std::thread worker_threads_[THREAD_POOL_SIZE];
         int worker_epoll_fd_[THREAD_POOL_SIZE];
+        int worker_listen_fd_[THREAD_POOL_SIZE];
         epoll_event worker_events_[THREAD_POOL_SIZE][MAX_EVENTS];
-        std::map<Uri, std::map<HttpMethod, HttpRequestHandler_t>> request_handlers_;
+        Router<RouteHandler> router_;
+        size_t offload_threads_;
+        Executor executor_;
+        // Where the executor hands the responses of blocking handlers, and
+        // the coroutines whose work it ran, back to each worker, and the
+        // eventfd that wakes the worker up
+        MpscQueue<OffloadedRequest, &OffloadedRequest::next> worker_completed_[THREAD_POOL_SIZE];
+        MpscQueue<Waiter, &Waiter::next> worker_resumed_[THREAD_POOL_SIZE];
+        int worker_wakeup_fd_[THREAD_POOL_SIZE];
+        std::vector<std::unique_ptr<Storage>> mounts_;
         Storage *storage;
 
-        void CreateSocket();
+        class WorkerContext;
+
+        int CreateSocket();
+        void BindSocket(int sock_fd);
         void SetUpEpoll();
+        void SetUpWorkerListeners();
         void Listen();
+        void AcceptConnections(int worker_id);
+        bool AdmitConnection(int worker_id, int client_fd);
         void Watch_Storage();
         void setStorage(Storage *inStorage);
         void ProcessEvents(int worker_id);
-        void HandleEpollEvent(int epoll_fd, EventData *event, std::uint32_t events);
-        void HandleHttpData(const EventData &request, EventData *response);
-        HttpResponse HandleHttpRequest(const HttpRequest &request);
+        void HandleEpollEvent(int epoll_fd, ConnectionTimers *timers, std::uint64_t now_ms,
+                              Connection *conn, std::uint32_t events);
+        void ProcessUringEvents(int worker_id);
+        void HandleUringCompletion(IoUring *ring, ConnectionTimers *timers,
+                                   std::uint64_t now_ms, const io_uring_cqe &cqe);
+        bool StartReceiving(IoUring *ring, Connection *conn);
+        bool SubmitSend(IoUring *ring, Connection *conn);
+        void FinishIo(int epoll_fd, ConnectionTimers *timers, std::uint64_t now_ms,
+                      Connection *conn);
+        void Offload(Connection *conn, HttpRequest &&request, bool send_content);
+        void StartTask(Connection *conn, HttpRequest &&request, bool send_content);
+        void WakeUp(int worker_id);
+        void CompleteOffloaded(int worker_id, int epoll_fd, IoUring *ring,
+                               ConnectionTimers *timers, std::uint64_t now_ms);
+        void PumpUringConnection(IoUring *ring, ConnectionTimers *timers,
+                                 std::uint64_t now_ms, Connection *conn);
+        void RecordDelay(int worker_id, std::chrono::steady_clock::time_point woken,
+                         std::uint64_t *delay_us);
+        bool ReadFromConnection(Connection *conn);
+        bool WriteToConnection(Connection *conn);
+        void ArmTimer(ConnectionTimers *timers, std::uint64_t now_ms, Connection *conn);
+        void ExpireConnection(int epoll_fd, ConnectionTimers *timers, Connection *conn);
+        void CloseConnection(int epoll_fd, ConnectionTimers *timers, Connection *conn);
+        void ProcessInput(Connection *conn);
+        bool HandleHttpData(const RequestView &raw_request, Connection *conn);
+        void DispatchRequest(Connection *conn, HttpRequest &&request);
+        void StartBody(Connection *conn, const RequestView &view);
+        bool ReceiveBody(Connection *conn, size_t *start);
+        HttpResponse HandleHttpRequest(HttpRequest &request);
+        const RouteHandler *FindHandler(HttpRequest &request, HttpResponse *error);
 
         void controlEpollEvent(int epoll_fd, int op, int fd,
                                  std::uint32_t events = 0, void *data = nullptr);
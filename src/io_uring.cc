@@ -0,0 +1,291 @@
+#include "io_uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace simple_http_server
+{
+
+    IoUring::~IoUring()
+    {
+        if (buffer_ring_ != nullptr)
+            munmap(buffer_ring_, buffer_ring_size_);
+        delete[] buffers_;
+        if (sqes_ != nullptr)
+            munmap(sqes_, sqes_size_);
+        if (cq_ring_ != nullptr && cq_ring_ != sq_ring_)
+            munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_ != nullptr)
+            munmap(sq_ring_, sq_ring_size_);
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    bool IoUring::Init(unsigned entries, unsigned buffer_count, size_t buffer_size)
+    {
+        // The worker is the only thread that submits, so the kernel may run
+        // completion work when it waits instead of interrupting it. Older
+        // kernels get a plainer ring.
+        static constexpr unsigned kSetupFlags[] = {
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+            IORING_SETUP_COOP_TASKRUN, 0};
+        io_uring_params params;
+        for (unsigned flags : kSetupFlags)
+        {
+            std::memset(&params, 0, sizeof(params));
+            params.flags = flags | IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4; // multishot requests complete many times
+            fd_ = syscall(__NR_io_uring_setup, entries, &params);
+            if (fd_ >= 0 || errno != EINVAL)
+                break;
+        }
+        if (fd_ < 0)
+            return false;
+        if (!(params.features & IORING_FEAT_EXT_ARG))
+        {
+            errno = EINVAL;
+            return false;
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap && cq_ring_size_ > sq_ring_size_)
+            sq_ring_size_ = cq_ring_size_;
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED)
+        {
+            sq_ring_ = nullptr;
+            return false;
+        }
+        if (single_mmap)
+        {
+            cq_ring_ = sq_ring_;
+        }
+        else
+        {
+            cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd_, IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED)
+            {
+                cq_ring_ = nullptr;
+                return false;
+            }
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+        char *sq = static_cast<char *>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries_; i++)
+            sq_array_[i] = i; // submission i is always in slot i
+        sq_local_tail_ = *sq_tail_;
+        char *cq = static_cast<char *>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        // Entering a registered ring skips looking its fd up on every call
+        io_uring_rsrc_update update = {};
+        update.offset = -1U;
+        update.data = fd_;
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_RING_FDS, &update, 1) == 1)
+        {
+            ring_index_ = update.offset;
+            enter_flags_ = IORING_ENTER_REGISTERED_RING;
+        }
+
+        // The buffers that receives land in: the kernel takes one from the
+        // ring when data arrives, instead of every idle connection holding one
+        buffer_count_ = buffer_count;
+        buffer_size_ = buffer_size;
+        buffer_ring_size_ = buffer_count * sizeof(io_uring_buf);
+        void *ring = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+            return false;
+        buffer_ring_ = static_cast<io_uring_buf_ring *>(ring);
+        io_uring_buf_reg reg = {};
+        reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+        reg.ring_entries = buffer_count;
+        reg.bgid = kBufferGroup;
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return false;
+        buffers_ = new char[buffer_count * buffer_size];
+        for (unsigned i = 0; i < buffer_count; i++)
+            RecycleBuffer(i);
+
+        return ProbeMultishotRecv();
+    }
+
+    // Multishot receives came after provided buffer rings (6.0 and 5.19),
+    // and cannot be probed for: try one
+    bool IoUring::ProbeMultishotRecv()
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+            return false;
+        PrepareMultishotRecv(fds[0], 1);
+        bool supported = write(fds[1], "x", 1) == 1;
+        bool done = false;
+        for (int i = 0; i < 10 && !done; i++)
+        {
+            SubmitAndWait(100);
+            ForEachCompletion([&](const io_uring_cqe &cqe)
+                              {
+                if (cqe.res < 0)
+                    supported = false;
+                if (cqe.flags & IORING_CQE_F_BUFFER)
+                    RecycleBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                if (cqe.res <= 0 || !(cqe.flags & IORING_CQE_F_MORE))
+                    done = true;
+                else if (fds[1] >= 0)
+                {
+                    close(fds[1]); // ends the receive
+                    fds[1] = -1;
+                }
+            });
+        }
+        close(fds[0]);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        if (!done || !supported)
+        {
+            errno = EINVAL;
+            return false;
+        }
+        return true;
+    }
+
+    void IoUring::RecycleBuffer(uint16_t id)
+    {
+        // The tail overlays the reserved field of the first buffer. bufs is
+        // not used: in C++ the uapi header may put it 8 bytes in.
+        uint16_t tail = buffer_ring_->tail;
+        io_uring_buf &buffer =
+            reinterpret_cast<io_uring_buf *>(buffer_ring_)[tail & (buffer_count_ - 1)];
+        buffer.addr = reinterpret_cast<uint64_t>(buffers_ + id * buffer_size_);
+        buffer.len = buffer_size_;
+        buffer.bid = id;
+        __atomic_store_n(&buffer_ring_->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+    }
+
+    int IoUring::Enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+                       size_t arg_size)
+    {
+        int fd = enter_flags_ & IORING_ENTER_REGISTERED_RING ? ring_index_ : fd_;
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags | enter_flags_, arg,
+                       arg_size);
+    }
+
+    // Publishes the prepared submissions and returns how many the kernel has
+    // not consumed yet
+    unsigned IoUring::Flush()
+    {
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+        return sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    }
+
+    io_uring_sqe *IoUring::GetSqe()
+    {
+        if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+        {
+            Enter(Flush(), 0, 0, nullptr, 0);
+            if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+                return nullptr;
+        }
+        io_uring_sqe *sqe = &sqes_[sq_local_tail_ & sq_mask_];
+        sq_local_tail_++;
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    int IoUring::SubmitAndWait(int timeout_ms)
+    {
+        __kernel_timespec timeout = {};
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        io_uring_getevents_arg arg = {};
+        arg.ts = reinterpret_cast<uint64_t>(&timeout);
+        return Enter(Flush(), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+
+    bool IoUring::PrepareMultishotAccept(int listen_fd, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = GetSqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    bool IoUring::PrepareMultishotRecv(int fd, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = GetSqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kBufferGroup;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    bool IoUring::PrepareSendmsg(int fd, const msghdr *msg, int flags, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = GetSqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(msg);
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    bool IoUring::PreparePoll(int fd, unsigned events, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = GetSqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+    bool IoUring::PrepareCancel(uint64_t target, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = GetSqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = target;
+        sqe->user_data = user_data;
+        return true;
+    }
+
+} // namespace simple_http_server
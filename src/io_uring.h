@@ -0,0 +1,105 @@
+// Defines a minimal io_uring wrapper over the raw system calls, with the
+// few operations the server's io_uring backend needs
+
+#ifndef IO_URING_H_
+#define IO_URING_H_
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace simple_http_server
+{
+
+    // A submission and a completion queue shared with the kernel, plus a ring
+    // of provided buffers that multishot receives pick their buffer from.
+    // Owned by a single thread: the ring is set up for a single issuer.
+    class IoUring
+    {
+    public:
+        IoUring() = default;
+        ~IoUring();
+        IoUring(const IoUring &) = delete;
+        IoUring &operator=(const IoUring &) = delete;
+
+        // Sets the rings up and checks that the kernel has what we use
+        // (multishot accept and receive, provided buffer rings). Returns
+        // false with errno set otherwise, e.g. ENOSYS or EINVAL on kernels
+        // older than 6.0, or EPERM when io_uring is disabled. buffer_count
+        // must be a power of 2.
+        bool Init(unsigned entries, unsigned buffer_count, size_t buffer_size);
+
+        // The next free submission, zeroed, or nullptr if the queue is full
+        // even after submitting what it holds
+        io_uring_sqe *GetSqe();
+        // Submits the queued submissions and waits until there is at least
+        // one completion or timeout_ms has passed, in one system call
+        int SubmitAndWait(int timeout_ms);
+
+        // Calls handle(cqe) for every completion available, then releases them
+        template <typename Handle>
+        unsigned ForEachCompletion(Handle handle)
+        {
+            unsigned head = *cq_head_;
+            unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            unsigned count = 0;
+            for (; head != tail; head++, count++)
+            {
+                handle(cqes_[head & cq_mask_]);
+                // handle may have submitted things, but never touches the
+                // completion queue
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            return count;
+        }
+
+        // Bytes of a provided buffer, and handing it back to the kernel
+        static constexpr uint16_t kBufferGroup = 0;
+        const char *Buffer(uint16_t id) const { return buffers_ + id * buffer_size_; }
+        void RecycleBuffer(uint16_t id);
+
+        // Queue a submission, whose user_data comes back in its completions.
+        // They return false if the submission queue is full.
+        bool PrepareMultishotAccept(int listen_fd, uint64_t user_data);
+        bool PrepareMultishotRecv(int fd, uint64_t user_data);
+        bool PrepareSendmsg(int fd, const msghdr *msg, int flags, uint64_t user_data);
+        bool PreparePoll(int fd, unsigned events, uint64_t user_data);
+        bool PrepareCancel(uint64_t target, uint64_t user_data);
+
+    private:
+        int fd_ = -1;
+        unsigned enter_flags_ = 0; // IORING_ENTER_REGISTERED_RING if the ring fd is registered
+        int ring_index_ = -1;      // what io_uring_enter takes instead of fd_ then
+        void *sq_ring_ = nullptr;
+        size_t sq_ring_size_ = 0;
+        void *cq_ring_ = nullptr;
+        size_t cq_ring_size_ = 0;
+        io_uring_sqe *sqes_ = nullptr;
+        size_t sqes_size_ = 0;
+        unsigned *sq_head_ = nullptr;
+        unsigned *sq_tail_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned sq_entries_ = 0;
+        unsigned *sq_array_ = nullptr;
+        unsigned sq_local_tail_ = 0; // submissions prepared but not published
+        unsigned *cq_head_ = nullptr;
+        unsigned *cq_tail_ = nullptr;
+        unsigned cq_mask_ = 0;
+        io_uring_cqe *cqes_ = nullptr;
+
+        io_uring_buf_ring *buffer_ring_ = nullptr;
+        size_t buffer_ring_size_ = 0;
+        unsigned buffer_count_ = 0;
+        char *buffers_ = nullptr;
+        size_t buffer_size_ = 0;
+
+        int Enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size);
+        unsigned Flush();
+        bool ProbeMultishotRecv();
+    };
+
+} // namespace simple_http_server
+
+#endif // IO_URING_H_
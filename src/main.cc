@@ -17,19 +17,35 @@ using simple_http_server::HttpRequest;
 using simple_http_server::HttpResponse;
 using simple_http_server::HttpServer;
 using simple_http_server::HttpStatusCode;
+using simple_http_server::IoBackend;
+using simple_http_server::ListenMode;
 
-int main(void)
+int main(int argc, char *argv[])
 {
     std::string host = "0.0.0.0";
     int port = 8080;
     HttpServer server(host, port);
+    server.SetListenMode(ListenMode::ReusePort);
+    // SimpleHttpServer [--io-uring] [root]
+    // --io-uring: serve with io_uring where the kernel supports it
+    // root: the directory whose files are served, ./www by default
+    std::string root = "www";
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "--io-uring")
+            server.SetIoBackend(IoBackend::IoUring);
+        else
+            root = argv[i];
+    }
 
     try
     {
 
         std::cout << "Starting the server.." << std::endl;
+        server.ServeDirectory("/", root);
         server.Start();
-        std::cout << "Server is listening on " << host << ":" << port << std::endl;
+        std::cout << "Server is listening on " << host << ":" << port << " and serves "
+                  << root << std::endl;
 
         std::cout << "Type [q] and then enter to stop the server" << std::endl;
         std::string command;
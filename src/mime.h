@@ -0,0 +1,128 @@
+// Defines the media types of static files, picked from their extension
+// with a table that is sorted and searched at compile time when possible
+
+#ifndef MIME_H_
+#define MIME_H_
+
+#include <cstddef>
+#include <string_view>
+
+namespace simple_http_server
+{
+
+    struct MimeType
+    {
+        std::string_view extension;
+        std::string_view type;
+        bool compressible; // worth compressing with gzip, unlike images or archives
+    };
+
+    // Sorted by extension, in lowercase
+    constexpr MimeType kMimeTypes[] = {
+        {"avif", "image/avif", false},
+        {"bmp", "image/bmp", true},
+        {"css", "text/css; charset=utf-8", true},
+        {"csv", "text/csv; charset=utf-8", true},
+        {"gif", "image/gif", false},
+        {"gz", "application/gzip", false},
+        {"htm", "text/html; charset=utf-8", true},
+        {"html", "text/html; charset=utf-8", true},
+        {"ico", "image/x-icon", true},
+        {"jpeg", "image/jpeg", false},
+        {"jpg", "image/jpeg", false},
+        {"js", "text/javascript; charset=utf-8", true},
+        {"json", "application/json", true},
+        {"map", "application/json", true},
+        {"md", "text/markdown; charset=utf-8", true},
+        {"mjs", "text/javascript; charset=utf-8", true},
+        {"mp3", "audio/mpeg", false},
+        {"mp4", "video/mp4", false},
+        {"otf", "font/otf", true},
+        {"pdf", "application/pdf", false},
+        {"png", "image/png", false},
+        {"svg", "image/svg+xml", true},
+        {"tar", "application/x-tar", false},
+        {"ttf", "font/ttf", true},
+        {"txt", "text/plain; charset=utf-8", true},
+        {"wasm", "application/wasm", true},
+        {"webm", "video/webm", false},
+        {"webp", "image/webp", false},
+        {"woff", "font/woff", false},
+        {"woff2", "font/woff2", false},
+        {"xml", "application/xml", true},
+        {"zip", "application/zip", false},
+    };
+
+    constexpr std::string_view kDefaultMimeType = "application/octet-stream";
+
+    constexpr bool mime_types_sorted()
+    {
+        for (size_t i = 1; i < sizeof(kMimeTypes) / sizeof(kMimeTypes[0]); i++)
+        {
+            if (!(kMimeTypes[i - 1].extension < kMimeTypes[i].extension))
+                return false;
+        }
+        return true;
+    }
+    static_assert(mime_types_sorted(), "kMimeTypes must be sorted by extension");
+
+    // Compares an extension as found in a path, in any case, with a
+    // lowercase one from the table
+    constexpr int compare_extension(std::string_view extension, std::string_view lowercase)
+    {
+        for (size_t i = 0; i < extension.length() && i < lowercase.length(); i++)
+        {
+            char c = extension[i] >= 'A' && extension[i] <= 'Z' ? extension[i] - 'A' + 'a' : extension[i];
+            if (c != lowercase[i])
+                return c < lowercase[i] ? -1 : 1;
+        }
+        if (extension.length() == lowercase.length())
+            return 0;
+        return extension.length() < lowercase.length() ? -1 : 1;
+    }
+
+    // Entry of the extension of the last segment of path, or nullptr
+    constexpr const MimeType *find_mime_type(std::string_view path)
+    {
+        size_t dot = path.rfind('.');
+        size_t slash = path.rfind('/');
+        if (dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash))
+            return nullptr;
+        std::string_view extension = path.substr(dot + 1);
+        size_t low = 0;
+        size_t high = sizeof(kMimeTypes) / sizeof(kMimeTypes[0]);
+        while (low < high)
+        {
+            size_t middle = (low + high) / 2;
+            int order = compare_extension(extension, kMimeTypes[middle].extension);
+            if (order == 0)
+                return &kMimeTypes[middle];
+            if (order < 0)
+                high = middle;
+            else
+                low = middle + 1;
+        }
+        return nullptr;
+    }
+
+    // Media type of the file at path, from the extension of its last segment
+    constexpr std::string_view mime_type(std::string_view path)
+    {
+        const MimeType *entry = find_mime_type(path);
+        return entry ? entry->type : kDefaultMimeType;
+    }
+
+    constexpr bool is_compressible(std::string_view path)
+    {
+        const MimeType *entry = find_mime_type(path);
+        return entry && entry->compressible;
+    }
+
+    static_assert(mime_type("/index.HTML") == "text/html; charset=utf-8", "");
+    static_assert(mime_type("/archive.tar.gz") == "application/gzip", "");
+    static_assert(mime_type("/.config/file") == kDefaultMimeType, "");
+    static_assert(is_compressible("/app.js") && !is_compressible("/logo.png"), "");
+
+} // namespace simple_http_server
+
+#endif // MIME_H_
@@ -0,0 +1,59 @@
+// Defines an intrusive queue through which any number of threads hand
+// items to a single consumer without locking
+
+#ifndef MPSC_QUEUE_H_
+#define MPSC_QUEUE_H_
+
+#include <atomic>
+
+namespace simple_http_server
+{
+
+    // Producers push with one compare-and-swap and the consumer takes every
+    // item at once with one exchange, so neither ever waits for the other.
+    // Next is the T* member of T that links the items; an item belongs to
+    // the queue from Push until PopAll returns it.
+    template <typename T, T *T::*Next>
+    class MpscQueue
+    {
+    public:
+        MpscQueue() : head_(nullptr) {}
+        MpscQueue(const MpscQueue &) = delete;
+        MpscQueue &operator=(const MpscQueue &) = delete;
+
+        // Returns true if the queue was empty, i.e. if the consumer may be
+        // waiting for a wakeup. Thread-safe.
+        bool Push(T *item)
+        {
+            T *head = head_.load(std::memory_order_relaxed);
+            do
+            {
+                item->*Next = head;
+            } while (!head_.compare_exchange_weak(head, item, std::memory_order_release,
+                                                  std::memory_order_relaxed));
+            return head == nullptr;
+        }
+
+        // Takes every item pushed so far, linked in the order they were
+        // pushed. Only called by the consumer.
+        T *PopAll()
+        {
+            T *item = head_.exchange(nullptr, std::memory_order_acquire);
+            T *ordered = nullptr;
+            while (item != nullptr)
+            { // the items were stacked: reverse them
+                T *next = item->*Next;
+                item->*Next = ordered;
+                ordered = item;
+                item = next;
+            }
+            return ordered;
+        }
+
+    private:
+        std::atomic<T *> head_;
+    };
+
+} // namespace simple_http_server
+
+#endif // MPSC_QUEUE_H_
@@ -0,0 +1,372 @@
+#include "multipart.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+namespace simple_http_server
+{
+
+    static std::string_view trim(std::string_view value)
+    {
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+            value.remove_prefix(1);
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+            value.remove_suffix(1);
+        return value;
+    }
+
+    // The characters of a boundary, none of which is '\r', so a boundary
+    // can only start at the first byte of a delimiter
+    static bool is_boundary(std::string_view boundary)
+    {
+        if (boundary.empty() || boundary.length() > 70 || boundary.back() == ' ')
+            return false;
+        for (char c : boundary)
+        {
+            if (!isalnum(static_cast<unsigned char>(c)) &&
+                std::strchr("'()+_,-./:=? ", c) == nullptr)
+                return false;
+        }
+        return true;
+    }
+
+    // Takes the next "; key=value" of a header value, with value unquoted.
+    // Returns false at the end of the value or if it is malformed.
+    static bool next_parameter(std::string_view *rest, std::string_view *key, std::string *value)
+    {
+        std::string_view params = trim(*rest);
+        if (params.empty() || params.front() != ';')
+            return false;
+        params = trim(params.substr(1));
+        size_t equals = params.find('=');
+        if (equals == std::string_view::npos)
+            return false;
+        *key = trim(params.substr(0, equals));
+        params = trim(params.substr(equals + 1));
+        value->clear();
+        if (!params.empty() && params.front() == '"')
+        {
+            size_t i = 1;
+            for (; i < params.length() && params[i] != '"'; i++)
+            {
+                if (params[i] == '\\' && i + 1 < params.length())
+                    i++;
+                value->push_back(params[i]);
+            }
+            if (i == params.length())
+                return false;
+            *rest = params.substr(i + 1);
+        }
+        else
+        {
+            size_t end = std::min(params.find(';'), params.length());
+            value->assign(trim(params.substr(0, end)));
+            *rest = params.substr(end);
+        }
+        return true;
+    }
+
+    std::string multipart_boundary(std::string_view content_type)
+    {
+        size_t end = std::min(content_type.find(';'), content_type.length());
+        if (!equals_ignore_case(trim(content_type.substr(0, end)), "multipart/form-data"))
+            return {};
+        std::string_view rest = content_type.substr(end), key;
+        std::string value;
+        while (next_parameter(&rest, &key, &value))
+        {
+            if (equals_ignore_case(key, "boundary"))
+                return is_boundary(value) ? value : std::string();
+        }
+        return {};
+    }
+
+    MultipartParser::MultipartParser(std::string_view boundary, PartBegin_t on_begin,
+                                     PartData_t on_data, PartEnd_t on_end)
+        : state_(State::Preamble), on_begin_(std::move(on_begin)),
+          on_data_(std::move(on_data)), on_end_(std::move(on_end))
+    {
+        if (!is_boundary(boundary))
+            throw std::invalid_argument("Invalid multipart boundary");
+        delimiter_ = "\r\n--";
+        delimiter_.append(boundary);
+        // how far the search can move on when the last byte it compared is c
+        size_t length = delimiter_.length();
+        skip_.fill(length);
+        for (size_t i = 0; i + 1 < length; i++)
+            skip_[static_cast<unsigned char>(delimiter_[i])] = length - 1 - i;
+        // the body may start with the first boundary, without a line break
+        held_ = "\r\n";
+    }
+
+    ParseStatus MultipartParser::Feed(std::string_view piece)
+    {
+        while (!piece.empty() && state_ != State::Epilogue && state_ != State::Malformed)
+        {
+            if (state_ == State::Preamble || state_ == State::Body)
+                piece.remove_prefix(FeedBody(piece));
+            else
+                piece.remove_prefix(FeedLine(piece));
+        }
+        if (state_ == State::Malformed)
+            return ParseStatus::Malformed;
+        return state_ == State::Epilogue ? ParseStatus::Complete : ParseStatus::Incomplete;
+    }
+
+    // The first delimiter in data, with Boyer-Moore-Horspool
+    size_t MultipartParser::Find(std::string_view data) const
+    {
+        size_t length = delimiter_.length();
+        const char *last = delimiter_.data() + length - 1;
+        for (size_t i = 0; i + length <= data.length();)
+        {
+            unsigned char c = data[i + length - 1];
+            if (c == static_cast<unsigned char>(*last) &&
+                std::memcmp(data.data() + i, delimiter_.data(), length - 1) == 0)
+                return i;
+            i += skip_[c];
+        }
+        return std::string_view::npos;
+    }
+
+    // Where the end of data that may be the start of a delimiter begins,
+    // given that no whole delimiter is in data
+    size_t MultipartParser::HeldSuffix(std::string_view data) const
+    {
+        size_t from = data.length() - std::min(data.length(), delimiter_.length() - 1);
+        for (size_t i = from; i < data.length(); i++)
+        {
+            if (data[i] == '\r' &&
+                delimiter_.compare(0, data.length() - i, data.data() + i, data.length() - i) == 0)
+                return i;
+        }
+        return data.length();
+    }
+
+    // Hands on the body of a part, or drops the preamble, up to the next
+    // delimiter. Returns how much of piece was used.
+    size_t MultipartParser::FeedBody(std::string_view piece)
+    {
+        size_t length = delimiter_.length();
+        if (!held_.empty())
+        { // the end of the last piece may go on into a delimiter
+            size_t wanted = std::min(length - held_.length(), piece.length());
+            if (piece.compare(0, wanted, delimiter_, held_.length(), wanted) != 0)
+            {
+                Emit(held_);
+                held_.clear();
+            }
+            else if (held_.length() + wanted < length)
+            {
+                held_.append(piece);
+                return piece.length();
+            }
+            else
+            {
+                held_.clear();
+                if (state_ == State::Body)
+                    on_end_();
+                state_ = State::Delimiter;
+                return wanted;
+            }
+        }
+
+        size_t found = Find(piece);
+        if (found != std::string_view::npos)
+        {
+            Emit(piece.substr(0, found));
+            if (state_ == State::Body)
+                on_end_();
+            state_ = State::Delimiter;
+            return found + length;
+        }
+        size_t held = HeldSuffix(piece);
+        Emit(piece.substr(0, held));
+        held_.assign(piece.substr(held));
+        return piece.length();
+    }
+
+    // Reads the rest of a boundary line and the header block of the next
+    // part. Returns how much of piece was used.
+    size_t MultipartParser::FeedLine(std::string_view piece)
+    {
+        size_t used = 0;
+        while (used < piece.length())
+        {
+            char c = piece[used];
+            switch (state_)
+            {
+            case State::Delimiter:
+                state_ = c == '-' ? State::CloseDash : State::Padding;
+                if (c == '-')
+                    used++;
+                break;
+            case State::CloseDash:
+                state_ = c == '-' ? State::Epilogue : State::Malformed;
+                return used + 1;
+            case State::Padding:
+                if (c == '\r')
+                    state_ = State::LineFeed;
+                else if (c != ' ' && c != '\t')
+                    state_ = State::Malformed;
+                used++;
+                break;
+            case State::LineFeed:
+                state_ = c == '\n' ? State::Headers : State::Malformed;
+                header_.clear();
+                used++;
+                break;
+            case State::Headers:
+            {
+                size_t end = piece.find('\n', used);
+                size_t line_end = end == std::string_view::npos ? piece.length() : end + 1;
+                header_.append(piece.substr(used, line_end - used));
+                used = line_end;
+                if (header_.length() > kMaxPartHeaderLength)
+                {
+                    state_ = State::Malformed;
+                }
+                else if (header_ == "\r\n" ||
+                         (header_.length() >= 4 && header_.compare(header_.length() - 4, 4, "\r\n\r\n") == 0))
+                {
+                    state_ = BeginPart() ? State::Body : State::Malformed;
+                }
+                break;
+            }
+            default:
+                return used;
+            }
+            if (state_ == State::Malformed || state_ == State::Body)
+                return used;
+        }
+        return used;
+    }
+
+    // Parses the header block of the part that starts
+    bool MultipartParser::BeginPart()
+    {
+        MultipartPart part;
+        std::string_view block(header_.data(), header_.length() - 2);
+        while (!block.empty())
+        {
+            size_t end = block.find("\r\n");
+            if (end == std::string_view::npos)
+                return false;
+            std::string_view line = block.substr(0, end);
+            block.remove_prefix(end + 2);
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos || colon == 0 || line.front() == ' ' ||
+                line.front() == '\t')
+                return false;
+            part.headers.push_back({trim(line.substr(0, colon)), trim(line.substr(colon + 1))});
+        }
+
+        bool form_data = false;
+        for (const HeaderView &header : part.headers)
+        {
+            if (equals_ignore_case(header.name, "Content-Type"))
+            {
+                part.content_type = header.value;
+            }
+            else if (equals_ignore_case(header.name, "Content-Disposition"))
+            {
+                size_t end = std::min(header.value.find(';'), header.value.length());
+                form_data = equals_ignore_case(trim(header.value.substr(0, end)), "form-data");
+                std::string_view rest = header.value.substr(end), key;
+                std::string value;
+                bool named = false;
+                while (next_parameter(&rest, &key, &value))
+                {
+                    if (equals_ignore_case(key, "name"))
+                        part.name = value, named = true;
+                    else if (equals_ignore_case(key, "filename"))
+                        part.filename = value;
+                }
+                form_data = form_data && named && trim(rest).empty();
+            }
+        }
+        if (!form_data)
+            return false;
+        on_begin_(part);
+        return true;
+    }
+
+    void MultipartParser::Emit(std::string_view data)
+    {
+        if (state_ == State::Body && !data.empty())
+            on_data_(data);
+    }
+
+    MultipartBodySink::MultipartBodySink(std::string_view boundary, const std::string &directory,
+                                         const FormLimits &limits)
+        : directory_(directory), limits_(limits), field_bytes_(0), files_(0),
+          parser_(
+              boundary,
+              [this](const MultipartPart &part)
+              {
+                  field_bytes_ += part.name.length() + part.filename.length() +
+                                  part.content_type.length();
+                  if (field_bytes_ > limits_.fields)
+                      throw std::invalid_argument("The form fields are too large");
+                  FormPart form_part;
+                  form_part.name = part.name;
+                  form_part.filename = part.filename;
+                  form_part.content_type = part.content_type;
+                  if (!part.filename.empty())
+                  {
+                      if (++files_ > limits_.files)
+                          throw std::invalid_argument("The form has too many files");
+                      form_part.file = std::make_shared<FileBodySink>(directory_);
+                  }
+                  parts_.push_back(std::move(form_part));
+              },
+              [this](std::string_view data)
+              {
+                  FormPart &part = parts_.back();
+                  if (part.file != nullptr)
+                  {
+                      part.file->Write(data);
+                      return;
+                  }
+                  field_bytes_ += data.length();
+                  if (field_bytes_ > limits_.fields)
+                      throw std::invalid_argument("The form fields are too large");
+                  part.value.append(data);
+              },
+              []() {})
+    {
+    }
+
+    std::shared_ptr<BodySink> MultipartBodySink::ForRequest(const HttpRequest &request)
+    {
+        std::string boundary = multipart_boundary(request.header("Content-Type"));
+        if (boundary.empty())
+            throw std::invalid_argument("Expected a multipart/form-data body");
+        return std::make_shared<MultipartBodySink>(boundary);
+    }
+
+    void MultipartBodySink::Write(std::string_view piece)
+    {
+        if (parser_.Feed(piece) == ParseStatus::Malformed)
+            throw std::invalid_argument("Invalid multipart body");
+    }
+
+    void MultipartBodySink::Finish()
+    {
+        if (!parser_.done())
+            throw std::invalid_argument("Incomplete multipart body");
+    }
+
+    const FormPart *MultipartBodySink::part(std::string_view name) const
+    {
+        for (const FormPart &part : parts_)
+        {
+            if (part.name == name)
+                return &part;
+        }
+        return nullptr;
+    }
+
+} // namespace simple_http_server
@@ -0,0 +1,145 @@
+// Defines the parser of multipart/form-data request bodies, which takes
+// the body piece by piece as it arrives, and the body sink that keeps the
+// fields of a form and writes its files to disk
+
+#ifndef MULTIPART_H_
+#define MULTIPART_H_
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "http_message.h"
+
+namespace simple_http_server
+{
+
+    // The boundary of a multipart/form-data Content-Type, or an empty string
+    // if content_type is not one or its boundary is invalid
+    std::string multipart_boundary(std::string_view content_type);
+
+    struct MultipartPart
+    {
+        std::string name;         // from Content-Disposition
+        std::string filename;     // as sent, empty for a plain field: not a safe path
+        std::string content_type; // as sent, or empty
+        // All the headers of the part, only valid until the begin callback
+        // returns
+        std::vector<HeaderView> headers;
+    };
+
+    // Splits a multipart body into its parts without buffering it: the body
+    // of a part is handed on as views into the pieces fed to it, and only
+    // the few bytes at the end of a piece that may start a boundary are
+    // held until the next one. Boundaries are found with Boyer-Moore-
+    // Horspool, which skips most bytes of the body without looking at them.
+    class MultipartParser
+    {
+    public:
+        using PartBegin_t = std::function<void(const MultipartPart &)>;
+        using PartData_t = std::function<void(std::string_view)>;
+        using PartEnd_t = std::function<void()>;
+
+        // The header block of a part must fit in this
+        static constexpr size_t kMaxPartHeaderLength = 8192;
+
+        // Throws std::invalid_argument if boundary is not a valid one
+        MultipartParser(std::string_view boundary, PartBegin_t on_begin,
+                        PartData_t on_data, PartEnd_t on_end);
+
+        // Takes the next piece of the body, which does not have to be kept
+        // once it returns. Returns Malformed once the body cannot be
+        // multipart, Complete once the last boundary was read, and
+        // Incomplete while more of the body is needed.
+        ParseStatus Feed(std::string_view piece);
+        bool done() const { return state_ == State::Epilogue; }
+
+    private:
+        enum class State
+        {
+            Preamble,     // before the first boundary, dropped
+            Delimiter,    // right after a boundary: "--" or a line break
+            CloseDash,    // after the first '-' of "--"
+            Padding,      // whitespace after a boundary
+            LineFeed,     // the '\n' that ends the boundary line
+            Headers,      // the header block of a part
+            Body,         // the body of a part
+            Epilogue,     // after the last boundary, dropped
+            Malformed
+        };
+
+        std::string delimiter_; // "\r\n--" and the boundary
+        std::array<size_t, 256> skip_;
+        State state_;
+        std::string held_;   // a prefix of delimiter_ that ended a piece
+        std::string header_; // the header block of the current part
+        PartBegin_t on_begin_;
+        PartData_t on_data_;
+        PartEnd_t on_end_;
+
+        size_t Find(std::string_view data) const;
+        size_t HeldSuffix(std::string_view data) const;
+        size_t FeedBody(std::string_view piece);
+        size_t FeedLine(std::string_view piece);
+        bool BeginPart();
+        void Emit(std::string_view data);
+    };
+
+    // A field of a form, with its value, or a file, written to disk
+    struct FormPart
+    {
+        std::string name;
+        std::string filename;
+        std::string content_type;
+        std::string value;                  // for a field
+        std::shared_ptr<FileBodySink> file; // for a file
+    };
+
+    // What a form may hold
+    struct FormLimits
+    {
+        size_t fields = 1 << 20; // bytes of names and values in memory
+        size_t files = 16;       // parts written to disk
+    };
+
+    // A body sink for routes that take forms: fields are kept in memory,
+    // and every part with a filename is written to a FileBodySink in
+    // directory as it arrives. The handler finds the parts with
+    // dynamic_cast<const MultipartBodySink *>(request.body_sink()). Throws
+    // std::invalid_argument, i.e. the request gets 400, if the body is not
+    // a valid form or is over the limits.
+    class MultipartBodySink : public BodySink
+    {
+    public:
+        MultipartBodySink(std::string_view boundary, const std::string &directory = "/tmp",
+                          const FormLimits &limits = FormLimits());
+        MultipartBodySink(const MultipartBodySink &) = delete;
+        MultipartBodySink &operator=(const MultipartBodySink &) = delete;
+
+        // A BodySinkFactory_t: makes the sink for the Content-Type of the
+        // request, and rejects requests that do not send a form
+        static std::shared_ptr<BodySink> ForRequest(const HttpRequest &request);
+
+        void Write(std::string_view piece) override;
+        void Finish() override;
+
+        const std::vector<FormPart> &parts() const { return parts_; }
+        // The first part named name, or nullptr
+        const FormPart *part(std::string_view name) const;
+
+    private:
+        std::vector<FormPart> parts_;
+        std::string directory_;
+        FormLimits limits_;
+        size_t field_bytes_;
+        size_t files_;
+        MultipartParser parser_;
+    };
+
+} // namespace simple_http_server
+
+#endif // MULTIPART_H_
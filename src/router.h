@@ -0,0 +1,215 @@
+// Defines a compressed radix tree that maps request paths to handlers,
+// with static, parameter (":name") and catch-all ("*name") segments
+
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "http_message.h"
+
+namespace simple_http_server
+{
+
+    constexpr size_t kMethodCount = static_cast<size_t>(HttpMethod::PATCH) + 1;
+
+    // A Router finds the handler of a path in O(path length) without
+    // allocating. Routes are made of:
+    // - static text, e.g. "/index.html"
+    // - parameters, e.g. "/users/:id", which match one path segment
+    // - a trailing catch-all, e.g. "/assets/*file", which matches the rest of
+    //   the path including its leading '/' ("/assets/css/a.css" gives
+    //   file = "/css/a.css")
+    // Static text takes precedence over parameters, which take precedence
+    // over catch-alls. Handler must be default constructible and convert to
+    // false when it is empty, like std::function.
+    template <typename Handler>
+    class Router
+    {
+    public:
+        Router() : root_(new Node()) {}
+
+        // Throws std::invalid_argument if the route is malformed or conflicts
+        // with a route that was added before
+        void Add(std::string_view route, HttpMethod method, Handler handler)
+        {
+            if (route.empty() || route[0] != '/')
+                throw std::invalid_argument("Routes must start with '/'");
+            Node *node = Insert(root_.get(), route);
+            node->handlers[static_cast<size_t>(method)] = std::move(handler);
+        }
+
+        // Returns the handler of path for method, or nullptr. *path_found
+        // tells a path without any route (404) from a path whose route has no
+        // handler for this method (405). HEAD falls back on the GET handler.
+        // The captured parameters are views into path and into the router.
+        const Handler *Find(std::string_view path, HttpMethod method,
+                            RouteParams *params, bool *path_found) const
+        {
+            params->count = 0;
+            const Node *node = Match(root_.get(), path, 0, params);
+            *path_found = node != nullptr;
+            if (node == nullptr)
+                return nullptr;
+            const Handler *handler = &node->handlers[static_cast<size_t>(method)];
+            if (!*handler && method == HttpMethod::HEAD)
+                handler = &node->handlers[static_cast<size_t>(HttpMethod::GET)];
+            return *handler ? handler : nullptr;
+        }
+
+    private:
+        struct Node
+        {
+            std::string prefix;                          // static text matched by this node
+            std::vector<std::unique_ptr<Node>> children; // static children, by first character
+            std::unique_ptr<Node> param;                 // child matching a ":name" segment
+            std::string param_name;
+            std::unique_ptr<Node> catch_all; // child matching "*name"
+            std::string catch_all_name;
+            Handler handlers[kMethodCount];
+
+            bool has_handler() const
+            {
+                for (const Handler &handler : handlers)
+                {
+                    if (handler)
+                        return true;
+                }
+                return false;
+            }
+        };
+
+        std::unique_ptr<Node> root_;
+
+        // Returns the node of route below node, creating it if needed
+        static Node *Insert(Node *node, std::string_view route)
+        {
+            while (!route.empty())
+            {
+                if (route[0] == ':' || route[0] == '*')
+                {
+                    size_t end = route[0] == ':' ? route.find('/') : route.length();
+                    if (end == std::string_view::npos)
+                        end = route.length();
+                    std::string_view name = route.substr(1, end - 1);
+                    if (name.empty())
+                        throw std::invalid_argument("Route parameters must have a name");
+                    if (route[0] == '*' && (node->prefix.empty() || node->prefix.back() != '/'))
+                        throw std::invalid_argument("A catch-all must follow a '/'");
+
+                    std::unique_ptr<Node> &child = route[0] == ':' ? node->param : node->catch_all;
+                    std::string &child_name = route[0] == ':' ? node->param_name : node->catch_all_name;
+                    if (!child)
+                    {
+                        child.reset(new Node());
+                        child_name = std::string(name);
+                    }
+                    else if (child_name != name)
+                    {
+                        throw std::invalid_argument("Conflicting route parameter names");
+                    }
+                    node = child.get();
+                    route.remove_prefix(end);
+                    continue;
+                }
+
+                // the static text up to the next parameter
+                size_t end = route.find_first_of(":*");
+                std::string_view text = route.substr(0, end);
+                Node *child = nullptr;
+                for (auto &candidate : node->children)
+                {
+                    if (candidate->prefix[0] == text[0])
+                    {
+                        child = candidate.get();
+                        break;
+                    }
+                }
+                if (child == nullptr)
+                {
+                    node->children.emplace_back(new Node());
+                    child = node->children.back().get();
+                    child->prefix = std::string(text);
+                }
+                else
+                {
+                    size_t common = 0;
+                    while (common < text.length() && common < child->prefix.length() &&
+                           text[common] == child->prefix[common])
+                        common++;
+                    if (common < child->prefix.length())
+                    { // split the child at the end of the common part
+                        std::unique_ptr<Node> tail(new Node());
+                        tail->prefix = child->prefix.substr(common);
+                        tail->children = std::move(child->children);
+                        tail->param = std::move(child->param);
+                        tail->param_name = std::move(child->param_name);
+                        tail->catch_all = std::move(child->catch_all);
+                        tail->catch_all_name = std::move(child->catch_all_name);
+                        for (size_t i = 0; i < kMethodCount; i++)
+                            tail->handlers[i] = std::move(child->handlers[i]);
+                        child->prefix = std::string(text.substr(0, common));
+                        child->children.push_back(std::move(tail));
+                    }
+                    text = text.substr(0, common);
+                }
+                node = child;
+                route.remove_prefix(text.length());
+            }
+            return node;
+        }
+
+        // Matches path[pos..] below node, backtracking from static children
+        // to the parameter and then the catch-all
+        static const Node *Match(const Node *node, std::string_view path, size_t pos,
+                                 RouteParams *params)
+        {
+            if (pos == path.length() && node->has_handler())
+                return node;
+
+            if (pos < path.length())
+            {
+                for (const auto &child : node->children)
+                {
+                    if (child->prefix[0] != path[pos] ||
+                        path.compare(pos, child->prefix.length(), child->prefix) != 0)
+                        continue;
+                    const Node *found = Match(child.get(), path, pos + child->prefix.length(), params);
+                    if (found != nullptr)
+                        return found;
+                    break; // children have distinct first characters
+                }
+            }
+
+            if (node->param && pos < path.length() && path[pos] != '/' &&
+                params->count < kMaxRouteParams)
+            {
+                size_t end = path.find('/', pos);
+                if (end == std::string_view::npos)
+                    end = path.length();
+                size_t count = params->count;
+                params->params[params->count++] = {node->param_name, path.substr(pos, end - pos)};
+                const Node *found = Match(node->param.get(), path, end, params);
+                if (found != nullptr)
+                    return found;
+                params->count = count;
+            }
+
+            if (node->catch_all && node->catch_all->has_handler() &&
+                params->count < kMaxRouteParams)
+            {
+                params->params[params->count++] = {node->catch_all_name, path.substr(pos - 1)};
+                return node->catch_all.get();
+            }
+            return nullptr;
+        }
+    };
+
+} // namespace simple_http_server
+
+#endif // ROUTER_H_
@@ -0,0 +1,281 @@
+#include "scan.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMPLE_HTTP_SERVER_X86 1
+#endif
+
+namespace simple_http_server
+{
+
+    // Characters of a token, RFC 9110 5.6.2
+    static constexpr bool is_token_char(unsigned char c)
+    {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+               (c >= 'A' && c <= 'Z') || c == '!' || c == '#' || c == '$' ||
+               c == '%' || c == '&' || c == '\'' || c == '*' || c == '+' ||
+               c == '-' || c == '.' || c == '^' || c == '_' || c == '`' ||
+               c == '|' || c == '~';
+    }
+
+    static constexpr bool is_field_char(unsigned char c)
+    {
+        return c >= 0x20 ? c != 0x7f : c == '\t';
+    }
+
+    // Token characters all have a high nibble between 2 and 7, so a byte is a
+    // token character iff lo[c & 0xf] & hi[c >> 4] is not zero, where hi gives
+    // every such high nibble its own bit. This is what pshufb looks up 16 or
+    // 32 bytes at a time.
+    struct NibbleTable
+    {
+        unsigned char lo[16];
+        unsigned char hi[16];
+    };
+
+    static constexpr NibbleTable make_token_table()
+    {
+        NibbleTable table = {};
+        for (int h = 2; h < 8; h++)
+        {
+            table.hi[h] = static_cast<unsigned char>(1 << (h - 2));
+            for (int l = 0; l < 16; l++)
+            {
+                if (is_token_char(static_cast<unsigned char>(h * 16 + l)))
+                    table.lo[l] |= table.hi[h];
+            }
+        }
+        return table;
+    }
+
+    static constexpr NibbleTable kTokenTable = make_token_table();
+
+    static size_t find_header_end_scalar(const char *data, size_t length, size_t from)
+    {
+        for (size_t i = from; i + 3 < length; i++)
+        {
+            const char *p = static_cast<const char *>(memchr(data + i, '\r', length - 3 - i));
+            if (p == nullptr)
+                break;
+            i = p - data;
+            if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
+                return i;
+        }
+        return length;
+    }
+
+    static size_t scan_token_scalar(const char *data, size_t length)
+    {
+        size_t i = 0;
+        while (i < length && is_token_char(data[i]))
+            i++;
+        return i;
+    }
+
+    static size_t scan_field_value_scalar(const char *data, size_t length)
+    {
+        size_t i = 0;
+        while (i < length && is_field_char(data[i]))
+            i++;
+        return i;
+    }
+
+#ifdef SIMPLE_HTTP_SERVER_X86
+
+    __attribute__((target("sse4.2"))) static size_t
+    find_header_end_sse42(const char *data, size_t length, size_t from)
+    {
+        const __m128i cr = _mm_set1_epi8('\r');
+        const __m128i lf = _mm_set1_epi8('\n');
+        size_t i = from;
+        // the loads at i + 1..3 read up to 3 bytes past the block
+        for (; i + 16 + 3 <= length; i += 16)
+        {
+            __m128i m0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), cr);
+            __m128i m1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 1)), lf);
+            __m128i m2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 2)), cr);
+            __m128i m3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 3)), lf);
+            int mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_and_si128(m0, m1), _mm_and_si128(m2, m3)));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+        return find_header_end_scalar(data, length, i);
+    }
+
+    __attribute__((target("sse4.2"))) static size_t
+    scan_token_sse42(const char *data, size_t length)
+    {
+        const __m128i lo_table = _mm_loadu_si128((const __m128i *)kTokenTable.lo);
+        const __m128i hi_table = _mm_loadu_si128((const __m128i *)kTokenTable.hi);
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            __m128i lo = _mm_shuffle_epi8(lo_table, _mm_and_si128(v, nibble));
+            __m128i hi = _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+            __m128i bad = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+            int mask = _mm_movemask_epi8(bad);
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+        return i + scan_token_scalar(data + i, length - i);
+    }
+
+    __attribute__((target("sse4.2"))) static size_t
+    scan_field_value_sse42(const char *data, size_t length)
+    {
+        // Control characters as ranges for pcmpestri: 0x00-0x08, 0x0a-0x1f
+        // and 0x7f (HTAB is allowed)
+        const __m128i ranges = _mm_setr_epi8(0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f,
+                                             0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            int index = _mm_cmpestri(ranges, 6, v, 16,
+                                     _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                                         _SIDD_LEAST_SIGNIFICANT);
+            if (index < 16)
+                return i + index;
+        }
+        return i + scan_field_value_scalar(data + i, length - i);
+    }
+
+    __attribute__((target("avx2"))) static size_t
+    find_header_end_avx2(const char *data, size_t length, size_t from)
+    {
+        const __m256i cr = _mm256_set1_epi8('\r');
+        const __m256i lf = _mm256_set1_epi8('\n');
+        size_t i = from;
+        for (; i + 32 + 3 <= length; i += 32)
+        {
+            __m256i m0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), cr);
+            __m256i m1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 1)), lf);
+            __m256i m2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 2)), cr);
+            __m256i m3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 3)), lf);
+            unsigned mask = _mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_and_si256(m0, m1), _mm256_and_si256(m2, m3)));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+        return find_header_end_sse42(data, length, i);
+    }
+
+    __attribute__((target("avx2"))) static size_t
+    scan_token_avx2(const char *data, size_t length)
+    {
+        const __m256i lo_table = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)kTokenTable.lo));
+        const __m256i hi_table = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)kTokenTable.hi));
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+            __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+            __m256i hi = _mm256_shuffle_epi8(
+                hi_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            __m256i bad = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+            unsigned mask = _mm256_movemask_epi8(bad);
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+        return i + scan_token_sse42(data + i, length - i);
+    }
+
+    __attribute__((target("avx2"))) static size_t
+    scan_field_value_avx2(const char *data, size_t length)
+    {
+        // x is a control character iff min(x, 0x1f) == x, except HTAB, or x == 0x7f
+        const __m256i ctl_max = _mm256_set1_epi8(0x1f);
+        const __m256i tab = _mm256_set1_epi8('\t');
+        const __m256i del = _mm256_set1_epi8(0x7f);
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+            __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl_max), v);
+            ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), ctl);
+            ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, del));
+            unsigned mask = _mm256_movemask_epi8(ctl);
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+        return i + scan_field_value_sse42(data + i, length - i);
+    }
+
+#endif // SIMPLE_HTTP_SERVER_X86
+
+    struct ScanKernels
+    {
+        const char *name;
+        size_t (*find_header_end)(const char *, size_t, size_t);
+        size_t (*scan_token)(const char *, size_t);
+        size_t (*scan_field_value)(const char *, size_t);
+    };
+
+    static const ScanKernels kScalarKernels = {
+        "scalar", find_header_end_scalar, scan_token_scalar, scan_field_value_scalar};
+#ifdef SIMPLE_HTTP_SERVER_X86
+    static const ScanKernels kSse42Kernels = {
+        "sse4.2", find_header_end_sse42, scan_token_sse42, scan_field_value_sse42};
+    static const ScanKernels kAvx2Kernels = {
+        "avx2", find_header_end_avx2, scan_token_avx2, scan_field_value_avx2};
+#endif
+
+    static const ScanKernels *supported_kernels(const char *name)
+    {
+#ifdef SIMPLE_HTTP_SERVER_X86
+        __builtin_cpu_init();
+        bool has_sse42 = __builtin_cpu_supports("sse4.2");
+        bool has_avx2 = has_sse42 && __builtin_cpu_supports("avx2");
+        if (name == nullptr)
+            return has_avx2 ? &kAvx2Kernels : has_sse42 ? &kSse42Kernels : &kScalarKernels;
+        if (strcmp(name, "avx2") == 0)
+            return has_avx2 ? &kAvx2Kernels : nullptr;
+        if (strcmp(name, "sse4.2") == 0)
+            return has_sse42 ? &kSse42Kernels : nullptr;
+#else
+        if (name == nullptr)
+            return &kScalarKernels;
+#endif
+        return strcmp(name, "scalar") == 0 ? &kScalarKernels : nullptr;
+    }
+
+    static const ScanKernels *kernels = supported_kernels(nullptr);
+
+    size_t find_header_end(const char *data, size_t length, size_t from)
+    {
+        return kernels->find_header_end(data, length, from);
+    }
+
+    size_t scan_token(const char *data, size_t length)
+    {
+        return kernels->scan_token(data, length);
+    }
+
+    size_t scan_field_value(const char *data, size_t length)
+    {
+        return kernels->scan_field_value(data, length);
+    }
+
+    const char *scan_kernel_name()
+    {
+        return kernels->name;
+    }
+
+    bool set_scan_kernel(const char *name)
+    {
+        const ScanKernels *selected = supported_kernels(name);
+        if (selected == nullptr)
+            return false;
+        kernels = selected;
+        return true;
+    }
+
+} // namespace simple_http_server
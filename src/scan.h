@@ -0,0 +1,36 @@
+// Defines the byte scanning kernels used by the request parser.
+// Each kernel has a scalar version and, on x86, SSE4.2 and AVX2 versions
+// that look at 16 or 32 bytes at a time. The best version supported by
+// the CPU is picked once, at startup.
+
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <cstddef>
+
+namespace simple_http_server
+{
+
+    // Returns the position of the first "\r\n\r\n" in data[from, length),
+    // or length if there is none
+    size_t find_header_end(const char *data, size_t length, size_t from);
+
+    // Returns the length of the longest prefix of data made of token
+    // characters (RFC 9110 5.6.2), as found in methods and field names
+    size_t scan_token(const char *data, size_t length);
+
+    // Returns the length of the longest prefix of data that may appear in a
+    // field value, i.e. the position of the first control character other
+    // than HTAB. On a well-formed line this is where its CRLF starts.
+    size_t scan_field_value(const char *data, size_t length);
+
+    // Name of the kernels in use: "avx2", "sse4.2" or "scalar"
+    const char *scan_kernel_name();
+
+    // Switches to the kernels with this name, e.g. to compare them in a
+    // benchmark. Returns false if the CPU does not support them.
+    bool set_scan_kernel(const char *name);
+
+} // namespace simple_http_server
+
+#endif // SCAN_H_
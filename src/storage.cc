@@ -1,81 +1,1162 @@
 #include <storage.h>
-#include <fstream>
+#include <mime.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef SIMPLE_HTTP_SERVER_ZLIB
+#include <zlib.h>
+#endif
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <random>
+#include <thread>
 
-Storage::Storage(const std::vector<std::string> &files) : files(files), baseDir("./")
+Resource::~Resource()
 {
-    this->updateResource();
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+simple_http_server::BodySegment resourceBody(const ResourcePtr &resource)
+{
+    return resourceBody(resource, 0, resource->size);
+}
+
+simple_http_server::BodySegment resourceBody(const ResourcePtr &resource, size_t offset, size_t length)
+{
+    if (resource->fd >= 0)
+    {
+        return simple_http_server::BodySegment(resource, resource->fd, offset, length);
+    }
+    return simple_http_server::BodySegment(resource, resource->content.data() + offset, length);
+}
+
+// Whether the client already has the variant, from the conditional fields
+// of its request (RFC 9110 13.2.2): If-Modified-Since is only looked at
+// without If-None-Match
+static bool isNotModified(const Resource &resource, const simple_http_server::HttpRequest &request)
+{
+    std::string_view ifNoneMatch = request.header(simple_http_server::KnownHeader::IfNoneMatch);
+    if (!ifNoneMatch.empty())
+    {
+        return simple_http_server::matches_etag(ifNoneMatch, resource.etag);
+    }
+    int64_t since;
+    return simple_http_server::parse_http_date(
+               request.header(simple_http_server::KnownHeader::IfModifiedSince), &since) &&
+           resource.mtime / 1000000000 <= since;
+}
+
+// Whether the Range field of the request still applies to the resource:
+// without If-Range, or if If-Range holds the current entity tag (strong
+// comparison) or modification date (RFC 9110 13.1.5)
+static bool isRangeCurrent(const Resource &resource, const simple_http_server::HttpRequest &request)
+{
+    std::string_view ifRange = request.header(simple_http_server::KnownHeader::IfRange);
+    if (ifRange.empty())
+    {
+        return true;
+    }
+    if (ifRange[0] == '"')
+    {
+        return ifRange == resource.etag;
+    }
+    int64_t date;
+    return simple_http_server::parse_http_date(ifRange, &date) && date == resource.mtime / 1000000000;
+}
+
+// A boundary that the files we serve are very unlikely to contain
+static const std::string &multipartBoundary()
+{
+    static const std::string boundary = []() {
+        std::random_device random;
+        char digits[40];
+        snprintf(digits, sizeof(digits), "%08x%08x%08x", random(), random(), random());
+        return std::string(digits);
+    }();
+    return boundary;
+}
+
+// The 206 or 416 response to a request for ranges of the resource. Only
+// the identity representation is sent in ranges.
+static simple_http_server::HttpResponse rangeResponse(const ResourcePtr &resource,
+                                                      const simple_http_server::ByteRange *ranges, size_t count,
+                                                      simple_http_server::RangeStatus status)
+{
+    using simple_http_server::HttpResponse;
+    using simple_http_server::HttpStatusCode;
+    std::string length = std::to_string(resource->size);
+    if (status == simple_http_server::RangeStatus::Unsatisfiable)
+    {
+        HttpResponse response(HttpStatusCode::RangeNotSatisfiable);
+        response.SetHeader("Content-Range", "bytes */" + length);
+        response.SetHeader("Content-Length", "0");
+        return response;
+    }
+
+    HttpResponse response(HttpStatusCode::PartialContent);
+    response.SetHeader("ETag", resource->etag);
+    response.SetHeader("Last-Modified", simple_http_server::format_http_date(resource->mtime / 1000000000));
+    if (resource->brotli || resource->gzip)
+    {
+        response.SetHeader("Vary", "Accept-Encoding");
+    }
+    auto contentRange = [&](const simple_http_server::ByteRange &range) {
+        return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + length;
+    };
+    if (count == 1)
+    {
+        response.SetHeader("Content-Type", resource->contentType);
+        response.SetHeader("Content-Range", contentRange(ranges[0]));
+        response.SetBody(resourceBody(resource, ranges[0].first, ranges[0].last - ranges[0].first + 1));
+        return response;
+    }
+
+    // The part headers go in one buffer shared by the segments between the
+    // slices of the file
+    const std::string &boundary = multipartBoundary();
+    auto parts = std::make_shared<std::string>();
+    size_t offsets[simple_http_server::kMaxByteRanges + 1];
+    for (size_t i = 0; i < count; i++)
+    {
+        offsets[i] = parts->length();
+        parts->append(i == 0 ? "--" : "\r\n--").append(boundary).append("\r\n");
+        parts->append("Content-Type: ").append(resource->contentType).append("\r\n");
+        parts->append("Content-Range: ").append(contentRange(ranges[i])).append("\r\n\r\n");
+    }
+    offsets[count] = parts->length();
+    parts->append("\r\n--").append(boundary).append("--\r\n");
+
+    response.SetHeader("Content-Type", "multipart/byteranges; boundary=" + boundary);
+    for (size_t i = 0; i < count; i++)
+    {
+        simple_http_server::BodySegment header(parts, parts->data() + offsets[i], offsets[i + 1] - offsets[i]);
+        if (i == 0)
+        {
+            response.SetBody(header);
+        }
+        else
+        {
+            response.AppendBody(header);
+        }
+        response.AppendBody(resourceBody(resource, ranges[i].first, ranges[i].last - ranges[i].first + 1));
+    }
+    response.AppendBody(simple_http_server::BodySegment(parts, parts->data() + offsets[count],
+                                                        parts->length() - offsets[count]));
+    return response;
+}
+
+simple_http_server::HttpResponse resourceResponse(const ResourcePtr &resource,
+                                                  const simple_http_server::HttpRequest &request)
+{
+    // ranges are of the identity representation, whatever the request accepts
+    std::string_view range = request.header(simple_http_server::KnownHeader::Range);
+    std::string_view acceptEncoding =
+        range.empty() ? request.header(simple_http_server::KnownHeader::AcceptEncoding) : std::string_view();
+    const ResourcePtr *variant = &resource;
+    if (resource->brotli && simple_http_server::accepts_encoding(acceptEncoding, "br"))
+    {
+        variant = &resource->brotli;
+    }
+    else if (resource->gzip && simple_http_server::accepts_encoding(acceptEncoding, "gzip"))
+    {
+        variant = &resource->gzip;
+    }
+    if (isNotModified(**variant, request))
+    {
+        simple_http_server::HttpResponse response(simple_http_server::HttpStatusCode::NotModified);
+        response.SetSerializedHeader(simple_http_server::BodySegment(
+            *variant, (*variant)->notModifiedHeader.data(), (*variant)->notModifiedHeader.length()));
+        return response;
+    }
+    if (!range.empty() && isRangeCurrent(*resource, request))
+    {
+        simple_http_server::ByteRange ranges[simple_http_server::kMaxByteRanges];
+        size_t count;
+        simple_http_server::RangeStatus status =
+            simple_http_server::parse_byte_ranges(range, resource->size, ranges, &count);
+        if (status != simple_http_server::RangeStatus::Ignored)
+        {
+            return rangeResponse(resource, ranges, count, status);
+        }
+    }
+    simple_http_server::HttpResponse response(simple_http_server::HttpStatusCode::Ok);
+    response.SetSerializedHeader(simple_http_server::BodySegment(
+        *variant, (*variant)->header.data(), (*variant)->header.length()));
+    response.SetBody(resourceBody(*variant));
+    return response;
+}
+
+// Serializes the headers of the 200 and 304 responses that carry the
+// resource, with the given content coding if it is a compressed variant.
+// Responses vary with Accept-Encoding if the file has variants.
+static void buildHeader(const std::string &filePath, Resource *resource, const char *encoding, bool vary)
+{
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%zx-%llx-%llx%s%s\"", resource->size,
+             static_cast<unsigned long long>(resource->mtime), static_cast<unsigned long long>(resource->inode),
+             encoding ? "-" : "", encoding ? encoding : "");
+    resource->etag = etag;
+    std::string lastModified = simple_http_server::format_http_date(resource->mtime / 1000000000);
+
+    // a 304 carries the validators and Vary a 200 would, but no content
+    // metadata (RFC 9110 15.4.5)
+    simple_http_server::HttpResponse response(simple_http_server::HttpStatusCode::NotModified);
+    response.SetHeader("ETag", resource->etag);
+    response.SetHeader("Last-Modified", lastModified);
+    if (vary)
+    {
+        response.SetHeader("Vary", "Accept-Encoding");
+    }
+    resource->notModifiedHeader.clear();
+    simple_http_server::SerializeHeader(response, &resource->notModifiedHeader);
+
+    response.SetStatusCode(simple_http_server::HttpStatusCode::Ok);
+    resource->contentType = simple_http_server::mime_type(filePath);
+    response.SetHeader("Content-Type", resource->contentType);
+    if (encoding)
+    {
+        response.SetHeader("Content-Encoding", encoding);
+    }
+    // ranges are only served from the identity representation
+    if (!encoding)
+    {
+        response.SetHeader("Accept-Ranges", "bytes");
+    }
+    response.SetHeader("Content-Length", std::to_string(resource->size));
+    resource->header.clear();
+    simple_http_server::SerializeHeader(response, &resource->header);
+}
+
+// Readers announce the epoch they entered in, in a slot of their own, so
+// that writers know when the entries they unlinked can no longer be in use
+// (epoch-based reclamation). A slot only ever changes on its reader's core.
+constexpr size_t kMaxReaders = Storage::kMaxReaders;
+
+struct alignas(64) ReaderSlot
+{
+    std::atomic<uint64_t> epoch{0}; // 0 while the reader is outside the table
+    std::atomic<bool> used{false};
 };
 
+static ReaderSlot readerSlots[kMaxReaders];
+static std::atomic<uint64_t> globalEpoch{1};
+// Readers of the threads that did not get a slot, if there are more than
+// kMaxReaders of them
+static std::atomic<uint64_t> overflowReaders{0};
+
+struct ThreadReader
+{
+    ThreadReader() : slot(nullptr), index(kMaxReaders), depth(0)
+    {
+        for (size_t i = 0; i < kMaxReaders; i++)
+        {
+            if (!readerSlots[i].used.exchange(true, std::memory_order_acquire))
+            {
+                slot = &readerSlots[i];
+                index = i;
+                break;
+            }
+        }
+    }
+    ~ThreadReader()
+    {
+        if (slot)
+        {
+            slot->epoch.store(0, std::memory_order_release);
+            slot->used.store(false, std::memory_order_release);
+        }
+    }
+    ReaderSlot *slot;
+    size_t index;
+    int depth;
+};
+
+static thread_local ThreadReader threadReader;
+
+// Keeps the entries and tables that were reachable when it was created
+// alive until it is destroyed
+class ReadSection
+{
+public:
+    ReadSection() : reader(threadReader)
+    {
+        if (reader.depth++ != 0)
+            return;
+        // seq_cst so that this store is ordered before the loads of the
+        // table and of its buckets, the mirror of the writers' unlinking
+        if (reader.slot)
+            reader.slot->epoch.store(globalEpoch.load(std::memory_order_acquire));
+        else
+            overflowReaders.fetch_add(1);
+    }
+    ~ReadSection()
+    {
+        if (--reader.depth != 0)
+            return;
+        if (reader.slot)
+            reader.slot->epoch.store(0, std::memory_order_release);
+        else
+            overflowReaders.fetch_sub(1, std::memory_order_release);
+    }
+
+private:
+    ThreadReader &reader;
+};
+
+constexpr size_t kInitialBuckets = 64;
+
+static size_t hashPath(const std::string &filePath)
+{
+    return std::hash<std::string>()(filePath);
+}
+
+static void deleteChain(const StorageEntry *entry)
+{
+    while (entry)
+    {
+        const StorageEntry *next = entry->next;
+        delete entry;
+        entry = next;
+    }
+}
+
+// Only absolute paths below baseDir, without "." or ".." segments and
+// without hidden files, are served
+static bool isServablePath(const std::string &filePath)
+{
+    if (filePath.empty() || filePath[0] != '/' || filePath.find('\0') != std::string::npos)
+    {
+        return false;
+    }
+    for (size_t start = 1; start <= filePath.length();)
+    {
+        size_t end = filePath.find('/', start);
+        if (end == std::string::npos)
+        {
+            end = filePath.length();
+        }
+        if (end == start || filePath[start] == '.')
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+Storage::Storage(const std::string &root, const StorageLimits &limits)
+    : baseDir(root), limits(limits), table_(new StorageTable(kInitialBuckets)), entryCount(0),
+      bytes(0), protectedBytes(0), openFiles(0), inotifyFd(-1), stats_()
+{
+    // paths start with '/'
+    while (!baseDir.empty() && baseDir.back() == '/')
+    {
+        baseDir.pop_back();
+    }
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    this->indexDirectory("", nullptr);
+    // no reader has entered yet: free the tables the index outgrew
+    this->reclaim();
+};
+
+Storage::~Storage()
+{
+    if (inotifyFd >= 0)
+    {
+        close(inotifyFd);
+    }
+    const StorageTable *table = table_.load();
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+        deleteChain(table->buckets[i].load());
+    }
+    delete table;
+    for (const Retired &item : retired)
+    {
+        deleteChain(item.chain);
+        delete item.table;
+    }
+}
+
 std::string Storage::processFilePath(const std::string &filePath)
 {
     return this->baseDir + filePath;
 }
 
-void Storage::addFile(const std::string filePath)
+// Reads a file into memory, or keeps it open if it is large. The header is
+// left to the caller.
+static std::shared_ptr<Resource> readFile(const std::string &inFile)
 {
-    this->files.push_back(filePath);
-    std::string content = this->readFile(filePath);
+    int fd = open(inFile.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
     {
-        std::unique_lock<std::shared_mutex> lock(mutex_);
-        this->resources.emplace(filePath, content);
+        return nullptr;
     }
+    std::shared_ptr<Resource> resource = std::make_shared<Resource>();
+    resource->fd = fd; // closed by the resource from now on
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        return nullptr;
+    }
+    resource->size = st.st_size;
+    resource->mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    resource->inode = st.st_ino;
+    if (resource->size >= kSendfileThreshold)
+    {
+        return resource;
+    }
+
+    resource->content.resize(resource->size);
+    size_t done = 0;
+    while (done < resource->size)
+    {
+        ssize_t n = pread(fd, &resource->content[done], resource->size - done, done);
+        if (n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    resource->content.resize(done);
+    resource->size = done;
+    close(resource->fd);
+    resource->fd = -1;
+    return resource;
 }
 
-std::string Storage::readFile(const std::string &filePath)
+// The gzip variant of a file kept in memory, if it is worth it
+static std::shared_ptr<Resource> compressGzip(const std::string &filePath, const Resource &resource)
 {
-    std::string inFile = this->processFilePath(filePath);
-    // std::cout << "File path = " << inFile << std::endl;
-    std::ifstream in(inFile, std::ios::in | std::ios::binary);
-    if (in)
+#ifdef SIMPLE_HTTP_SERVER_ZLIB
+    if (resource.fd >= 0 || !simple_http_server::is_compressible(filePath))
+    {
+        return nullptr;
+    }
+    z_stream stream = {};
+    // 15 + 16: the largest window, with a gzip wrapper
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
     {
-        std::string contents;
-        in.seekg(0, std::ios::end);
-        contents.resize(in.tellg());
-        in.seekg(0, std::ios::beg);
-        in.read(&contents[0], contents.size());
-        in.close();
-        return contents;
+        return nullptr;
     }
-    return std::string();
+    std::shared_ptr<Resource> variant = std::make_shared<Resource>();
+    variant->content.resize(deflateBound(&stream, resource.size));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(resource.content.data()));
+    stream.avail_in = resource.size;
+    stream.next_out = reinterpret_cast<Bytef *>(&variant->content[0]);
+    stream.avail_out = variant->content.size();
+    int result = deflate(&stream, Z_FINISH);
+    variant->size = stream.total_out;
+    deflateEnd(&stream);
+    // not worth a Vary header and a second copy
+    if (result != Z_STREAM_END || variant->size > resource.size / 10 * 9)
+    {
+        return nullptr;
+    }
+    variant->content.resize(variant->size);
+    variant->content.shrink_to_fit();
+    variant->mtime = resource.mtime;
+    variant->inode = resource.inode;
+    return variant;
+#else
+    (void)filePath;
+    (void)resource;
+    return nullptr;
+#endif
 }
 
-void Storage::updateResource()
+ResourcePtr Storage::loadFile(const std::string &filePath)
 {
-    for (const auto filePath : files)
+    std::shared_ptr<Resource> resource = readFile(this->processFilePath(filePath));
+    if (!resource)
     {
-        std::string content = this->readFile(filePath);
-        if (content.length() != 0)
+        return nullptr;
+    }
+    if (resource->size >= kCompressionThreshold)
+    {
+        // precompressed siblings that are older than the file are stale
+        std::shared_ptr<Resource> brotli = readFile(this->processFilePath(filePath + ".br"));
+        if (brotli && brotli->mtime >= resource->mtime)
+        {
+            buildHeader(filePath, brotli.get(), "br", true);
+            resource->brotli = brotli;
+        }
+        std::shared_ptr<Resource> gzip = readFile(this->processFilePath(filePath + ".gz"));
+        if (!gzip || gzip->mtime < resource->mtime)
+        {
+            gzip = compressGzip(filePath, *resource);
+        }
+        if (gzip)
         {
-            std::unique_lock<std::shared_mutex> lock(mutex_);
-            this->resources.erase(filePath);
-            this->resources.emplace(filePath, content);
-            // std::cout << "Add new resource, filepath = " << filePath << std::endl;
-            // std::cout << "Add new resource, content = " << content << std::endl;
+            buildHeader(filePath, gzip.get(), "gzip", true);
+            resource->gzip = gzip;
         }
     }
+    buildHeader(filePath, resource.get(), nullptr, resource->brotli || resource->gzip);
+    return resource;
 }
 
-bool Storage::getResource(const std::string &filePath, std::string &outStr)
+// What a cached file costs, in memory and in open files, with its variants
+static size_t resourceCost(const Resource &resource)
 {
+    size_t cost = resource.content.size() + resource.header.size() + resource.notModifiedHeader.size();
+    for (const ResourcePtr &variant : {resource.brotli, resource.gzip})
     {
-        std::shared_lock<std::shared_mutex> lock(mutex_);
-        auto it = this->resources.find(filePath);
-        if (it != this->resources.end())
+        if (variant)
         {
-            outStr.assign(it->second);
-            return true;
+            cost += variant->content.size() + variant->header.size() + variant->notModifiedHeader.size();
         }
+    }
+    return cost;
+}
+
+static size_t openFileCount(const Resource &resource)
+{
+    return (resource.fd >= 0) + (resource.brotli && resource.brotli->fd >= 0) +
+           (resource.gzip && resource.gzip->fd >= 0);
+}
+
+void Storage::count(std::atomic<uint64_t> ReadCounters::*counter)
+{
+    ThreadReader &reader = threadReader;
+    std::atomic<uint64_t> &value = counters_[reader.index].*counter;
+    // a plain increment when only this thread writes the counter
+    if (reader.slot)
+        value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    else
+        value.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool Storage::getResource(const std::string &filePath, ResourcePtr &outRes)
+{
+    size_t hash = hashPath(filePath);
+    Lookup lookup = this->find(filePath, hash, outRes);
+    if (lookup == Lookup::Cached)
+    {
+        count(&ReadCounters::hits);
+        return true;
+    }
+    if (lookup == Lookup::Absent)
+    {
         return false;
     }
-    // // Cannot find anything on the cache, read from the file
-    // std::cout << "readFile, filepaht = " << filePath << std::endl;
-    // std::string content = this->readFile(filePath);
-    // {
-    //     std::unique_lock<std::shared_mutex> lock(mutex_);
-    //     std::shared_ptr<std::string> newContent = std::make_shared<std::string>(content);
-    //     this->resources.emplace(filePath, newContent);
-    //     std::cout << "Add new resource, filepaht = " << filePath << std::endl;
-    //     outStr = *newContent;
-    // }
+    count(&ReadCounters::misses);
+    return this->load(filePath, hash, outRes);
+}
+
+Storage::Lookup Storage::find(const std::string &filePath, size_t hash, ResourcePtr &outRes)
+{
+    ReadSection section;
+    const StorageTable *table = table_.load();
+    for (const StorageEntry *entry = table->buckets[hash & table->mask].load(); entry; entry = entry->next)
+    {
+        if (entry->hash != hash || entry->path != filePath)
+        {
+            continue;
+        }
+        if (!entry->resource)
+        {
+            return Lookup::Indexed;
+        }
+        // only written when it changes, so hot files stay in every core's cache
+        if (!entry->resource->referenced.load(std::memory_order_relaxed))
+        {
+            entry->resource->referenced.store(true, std::memory_order_relaxed);
+        }
+        outRes = entry->resource;
+        return Lookup::Cached;
+    }
+    return Lookup::Absent;
+}
+
+bool Storage::load(const std::string &filePath, size_t hash, ResourcePtr &outRes)
+{
+    std::shared_ptr<PendingLoad> pending;
+    {
+        std::unique_lock<std::mutex> lock(missMutex_);
+        auto it = pending_.find(filePath);
+        if (it != pending_.end())
+        {
+            // another thread is reading this file already
+            pending = it->second;
+            missDone_.wait(lock, [&pending]() { return pending->done; });
+            count(&ReadCounters::coalesced);
+            outRes = pending->resource;
+            return outRes != nullptr;
+        }
+        // it may have been loaded, or deleted, since find() missed it
+        Lookup lookup = this->find(filePath, hash, outRes);
+        if (lookup != Lookup::Indexed)
+        {
+            return lookup == Lookup::Cached;
+        }
+        pending = std::make_shared<PendingLoad>();
+        pending_.emplace(filePath, pending);
+    }
+
+    ResourcePtr resource = this->loadFile(filePath);
+    {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        std::lock_guard<std::mutex> missLock(missMutex_);
+        // a file that changed while it was read is served once, not cached
+        if (resource && !pending->stale)
+        {
+            this->insert(filePath, hash, resource);
+        }
+        pending->done = true;
+        pending->resource = resource;
+        pending_.erase(filePath);
+    }
+    missDone_.notify_all();
+    outRes = resource;
+    return resource != nullptr;
+}
+
+const StorageEntry *Storage::lookupEntry(const std::string &filePath, size_t hash)
+{
+    // writers never race with the reclamation, which they do themselves
+    const StorageTable *table = table_.load(std::memory_order_relaxed);
+    const StorageEntry *entry = table->buckets[hash & table->mask].load(std::memory_order_relaxed);
+    while (entry && (entry->hash != hash || entry->path != filePath))
+    {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+void Storage::addEntry(const std::string &filePath)
+{
+    size_t hash = hashPath(filePath);
+    if (!isServablePath(filePath) || this->lookupEntry(filePath, hash))
+    {
+        return;
+    }
+    this->rebuildBucket(hash, filePath, true, nullptr);
+    entryCount++;
+    if (entryCount > table_.load(std::memory_order_relaxed)->mask + 1)
+    {
+        this->grow();
+    }
+}
+
+void Storage::removeEntry(const std::string &filePath)
+{
+    size_t hash = hashPath(filePath);
+    if (!this->lookupEntry(filePath, hash))
+    {
+        return;
+    }
+    if (slots.count(filePath))
+    {
+        this->uncache(filePath, hash);
+        stats_.removals++;
+    }
+    this->rebuildBucket(hash, filePath, false, nullptr);
+    entryCount--;
+}
+
+void Storage::removeDirectory(const std::string &dir)
+{
+    std::string prefix = dir + "/";
+    std::vector<std::string> paths;
+    const StorageTable *table = table_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+        for (const StorageEntry *entry = table->buckets[i].load(std::memory_order_relaxed); entry; entry = entry->next)
+        {
+            if (entry->path.compare(0, prefix.length(), prefix) == 0)
+            {
+                paths.push_back(entry->path);
+            }
+        }
+    }
+    for (const auto &filePath : paths)
+    {
+        this->removeEntry(filePath);
+    }
+}
+
+void Storage::indexDirectory(const std::string &dir, std::unordered_set<std::string> *seen)
+{
+    // depth first, without recursion
+    std::vector<std::string> dirs = {dir};
+    while (!dirs.empty())
+    {
+        std::string current = dirs.back();
+        dirs.pop_back();
+        DIR *handle = opendir(this->processFilePath(current + "/").c_str());
+        if (handle == nullptr)
+        {
+            continue;
+        }
+        this->watchDirectory(current);
+        while (struct dirent *entry = readdir(handle))
+        {
+            // hidden files and directories, "." and ".." included
+            if (entry->d_name[0] == '.')
+            {
+                continue;
+            }
+            std::string filePath = current + "/" + entry->d_name;
+            unsigned char type = entry->d_type;
+            struct stat st;
+            if (type == DT_UNKNOWN && lstat(this->processFilePath(filePath).c_str(), &st) == 0)
+            {
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_DIR)
+            {
+                dirs.push_back(filePath);
+            }
+            else if (type == DT_REG)
+            {
+                this->addEntry(filePath);
+                if (seen)
+                {
+                    seen->insert(filePath);
+                }
+            }
+        }
+        closedir(handle);
+    }
+}
+
+void Storage::insert(const std::string &filePath, size_t hash, const ResourcePtr &resource)
+{
+    // deleted while it was being read
+    if (!this->lookupEntry(filePath, hash))
+    {
+        return;
+    }
+    size_t cost = resourceCost(*resource) + filePath.size();
+    size_t open = openFileCount(*resource);
+    auto it = slots.find(filePath);
+    if (it != slots.end())
+    {
+        CacheSlot &slot = it->second;
+        bytes = bytes - slot.cost + cost;
+        if (slot.protectedSegment)
+        {
+            protectedBytes = protectedBytes - slot.cost + cost;
+        }
+        openFiles = openFiles - openFileCount(*slot.resource) + open;
+        slot.resource = resource;
+        slot.cost = cost;
+    }
+    else
+    {
+        if (cost > limits.maxBytes || open > limits.maxOpenFiles)
+        {
+            return; // served, but too large to cache
+        }
+        probation.push_front(filePath);
+        slots.emplace(filePath, CacheSlot{resource, cost, false, probation.begin()});
+        bytes += cost;
+        openFiles += open;
+    }
+    this->rebuildBucket(hash, filePath, true, resource);
+    this->evict();
+    this->reclaim();
+}
+
+void Storage::uncache(const std::string &filePath, size_t hash)
+{
+    auto it = slots.find(filePath);
+    if (it == slots.end())
+    {
+        return;
+    }
+    CacheSlot &slot = it->second;
+    bytes -= slot.cost;
+    openFiles -= openFileCount(*slot.resource);
+    if (slot.protectedSegment)
+    {
+        protectedBytes -= slot.cost;
+        protectedList.erase(slot.position);
+    }
+    else
+    {
+        probation.erase(slot.position);
+    }
+    slots.erase(it);
+    this->rebuildBucket(hash, filePath, true, nullptr);
+}
+
+void Storage::rebuildBucket(size_t hash, const std::string &filePath, bool keep, const ResourcePtr &resource)
+{
+    // The chain is copied without filePath, with its new entry if it is
+    // kept, and the old chain is freed once no reader can be walking it
+    const StorageTable *table = table_.load(std::memory_order_relaxed);
+    std::atomic<const StorageEntry *> &bucket = table->buckets[hash & table->mask];
+    const StorageEntry *old = bucket.load(std::memory_order_relaxed);
+    const StorageEntry *chain = keep ? new StorageEntry{hash, filePath, resource, nullptr} : nullptr;
+    for (const StorageEntry *entry = old; entry; entry = entry->next)
+    {
+        if (entry->hash != hash || entry->path != filePath)
+        {
+            chain = new StorageEntry{entry->hash, entry->path, entry->resource, chain};
+        }
+    }
+    bucket.store(chain);
+    if (old)
+    {
+        retired.push_back(Retired{globalEpoch.fetch_add(1) + 1, old, nullptr});
+    }
+}
+
+void Storage::grow()
+{
+    const StorageTable *old = table_.load(std::memory_order_relaxed);
+    StorageTable *table = new StorageTable((old->mask + 1) * 2);
+    for (size_t i = 0; i <= old->mask; i++)
+    {
+        for (const StorageEntry *entry = old->buckets[i].load(std::memory_order_relaxed); entry; entry = entry->next)
+        {
+            std::atomic<const StorageEntry *> &bucket = table->buckets[entry->hash & table->mask];
+            bucket.store(new StorageEntry{entry->hash, entry->path, entry->resource,
+                                          bucket.load(std::memory_order_relaxed)},
+                         std::memory_order_relaxed);
+        }
+    }
+    table_.store(table);
+    uint64_t epoch = globalEpoch.fetch_add(1) + 1;
+    for (size_t i = 0; i <= old->mask; i++)
+    {
+        retired.push_back(Retired{epoch, old->buckets[i].load(std::memory_order_relaxed), nullptr});
+    }
+    retired.push_back(Retired{epoch, nullptr, old});
+}
+
+void Storage::evict()
+{
+    // The protected segment may hold up to 80% of the budget
+    const size_t maxProtectedBytes = limits.maxBytes / 5 * 4;
+    while (bytes > limits.maxBytes || openFiles > limits.maxOpenFiles)
+    {
+        // demote the least recently used protected files, giving a second
+        // chance to the ones that were hit since they were last looked at
+        while (!protectedList.empty() && (protectedBytes > maxProtectedBytes || probation.empty()))
+        {
+            CacheSlot &slot = slots.find(protectedList.back())->second;
+            if (slot.resource->referenced.exchange(false, std::memory_order_relaxed) && !probation.empty())
+            {
+                protectedList.splice(protectedList.begin(), protectedList, slot.position);
+                continue;
+            }
+            probation.splice(probation.begin(), protectedList, slot.position);
+            slot.protectedSegment = false;
+            protectedBytes -= slot.cost;
+        }
+        if (probation.empty())
+        {
+            break;
+        }
+
+        // promote the probation files that were hit again, evict the others
+        CacheSlot &slot = slots.find(probation.back())->second;
+        if (slot.resource->referenced.exchange(false, std::memory_order_relaxed))
+        {
+            protectedList.splice(protectedList.begin(), probation, slot.position);
+            slot.protectedSegment = true;
+            protectedBytes += slot.cost;
+            continue;
+        }
+        std::string victim = probation.back();
+        this->uncache(victim, hashPath(victim));
+        stats_.evictions++;
+    }
+}
+
+void Storage::reclaim()
+{
+    if (overflowReaders.load() != 0)
+    {
+        return;
+    }
+    uint64_t oldestReader = UINT64_MAX;
+    for (ReaderSlot &slot : readerSlots)
+    {
+        uint64_t epoch = slot.epoch.load();
+        if (epoch != 0)
+        {
+            oldestReader = std::min(oldestReader, epoch);
+        }
+    }
+    // what was unlinked in epoch e may still be used by readers that
+    // entered before e
+    size_t kept = 0;
+    for (const Retired &item : retired)
+    {
+        if (item.epoch <= oldestReader)
+        {
+            deleteChain(item.chain);
+            delete item.table;
+        }
+        else
+        {
+            retired[kept++] = item;
+        }
+    }
+    retired.resize(kept);
+}
+
+static constexpr uint32_t kWatchMask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                       IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+void Storage::watchDirectory(const std::string &dir)
+{
+    if (inotifyFd < 0)
+    {
+        return;
+    }
+    // inotify returns the same descriptor for a directory watched already
+    int wd = inotify_add_watch(inotifyFd, this->processFilePath(dir + "/").c_str(), kWatchMask | IN_ONLYDIR);
+    if (wd >= 0)
+    {
+        watchedDirs[wd] = dir;
+    }
+}
+
+static int64_t modificationTime(const struct stat &st)
+{
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// Whether the file on disk is still the one the resource was loaded from
+static bool isSameFile(const struct stat &st, const Resource &resource)
+{
+    return modificationTime(st) == resource.mtime && static_cast<size_t>(st.st_size) == resource.size &&
+           st.st_ino == resource.inode;
+}
+
+void Storage::refresh(const std::vector<std::string> &paths)
+{
+    // Only cached files that changed on disk are reloaded, so the serialized
+    // headers of the others stay as they are. The others are read on their
+    // next hit anyway.
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    int64_t oldestChange = INT64_MAX;
+    for (const auto &changedPath : paths)
+    {
+        // a precompressed sibling changes the variants of its cached file
+        std::string filePath = changedPath;
+        bool variantChanged = false;
+        for (const char *extension : {".gz", ".br"})
+        {
+            size_t length = filePath.length();
+            if (length > 3 && filePath.compare(length - 3, 3, extension) == 0 &&
+                slots.count(filePath.substr(0, length - 3)))
+            {
+                filePath.resize(length - 3);
+                variantChanged = true;
+                break;
+            }
+        }
+        auto it = slots.find(filePath);
+        if (it == slots.end())
+        {
+            // a file being read may be read before this change
+            std::lock_guard<std::mutex> missLock(missMutex_);
+            auto pending = pending_.find(filePath);
+            if (pending != pending_.end())
+            {
+                pending->second->stale = true;
+            }
+            continue;
+        }
+        struct stat st;
+        if (lstat(this->processFilePath(filePath).c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+        {
+            this->removeEntry(filePath);
+            continue;
+        }
+        if (!variantChanged && isSameFile(st, *it->second.resource))
+        {
+            continue;
+        }
+        // an empty file is reloaded too: the old bytes would no longer
+        // match the file, and sendfile would come short of them
+        ResourcePtr resource = this->loadFile(filePath);
+        if (!resource)
+        { // read again by the next load()
+            this->uncache(filePath, hashPath(filePath));
+            continue;
+        }
+        this->insert(filePath, hashPath(filePath), resource);
+        stats_.reloads++;
+        oldestChange = std::min(oldestChange, resource->mtime);
+    }
+    this->reclaim();
+
+    if (oldestChange != INT64_MAX)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t latency = static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec - oldestChange;
+        stats_.lastLatencyNs = latency > 0 ? latency : 0;
+        stats_.maxLatencyNs = std::max(stats_.maxLatencyNs, stats_.lastLatencyNs);
+    }
+}
+
+std::vector<std::string> Storage::cachedPaths()
+{
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    std::vector<std::string> paths;
+    paths.reserve(slots.size());
+    for (const auto &slot : slots)
+    {
+        paths.push_back(slot.first);
+    }
+    return paths;
+}
+
+void Storage::updateResource()
+{
+    {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        std::unordered_set<std::string> seen;
+        this->indexDirectory("", &seen);
+        std::vector<std::string> deleted;
+        const StorageTable *table = table_.load(std::memory_order_relaxed);
+        for (size_t i = 0; i <= table->mask; i++)
+        {
+            for (const StorageEntry *entry = table->buckets[i].load(std::memory_order_relaxed); entry;
+                 entry = entry->next)
+            {
+                if (!seen.count(entry->path))
+                {
+                    deleted.push_back(entry->path);
+                }
+            }
+        }
+        for (const auto &filePath : deleted)
+        {
+            this->removeEntry(filePath);
+        }
+        stats_.scans++;
+    }
+    this->refresh(this->cachedPaths());
+}
+
+bool Storage::watch()
+{
+    {
+        std::lock_guard<std::mutex> lock(writeMutex_);
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0)
+        {
+            return false;
+        }
+        this->watchDirectory("");
+        if (watchedDirs.empty())
+        {
+            close(inotifyFd);
+            inotifyFd = -1;
+            return false;
+        }
+    }
+    // watches every directory, and catches up with what changed before
+    this->updateResource();
+    return true;
+}
+
+void Storage::processEvents()
+{
+    alignas(struct inotify_event) char buffer[16 * 1024];
+    std::vector<std::string> changed;
+    bool rescan = false;
+    std::unique_lock<std::mutex> lock(writeMutex_);
+    for (;;)
+    {
+        ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0)
+        {
+            break;
+        }
+        for (char *p = buffer; p < buffer + length;)
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+            stats_.events++;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                rescan = true; // the kernel dropped events
+                continue;
+            }
+            auto dir = watchedDirs.find(event->wd);
+            if (dir == watchedDirs.end())
+            {
+                continue;
+            }
+            if (event->mask & IN_IGNORED)
+            {
+                // the root went away, the other directories are dropped with
+                // the event of their parent
+                rescan = rescan || dir->second.empty();
+                watchedDirs.erase(dir);
+                continue;
+            }
+            if (event->len == 0 || event->name[0] == '.')
+            {
+                continue;
+            }
+            std::string filePath = dir->second + "/" + event->name;
+            if (event->mask & IN_ISDIR)
+            {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    this->indexDirectory(filePath, nullptr);
+                else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                    this->removeDirectory(filePath);
+                continue;
+            }
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                this->removeEntry(filePath);
+                continue;
+            }
+            struct stat st;
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                lstat(this->processFilePath(filePath).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            {
+                this->addEntry(filePath);
+            }
+            if (std::find(changed.begin(), changed.end(), filePath) == changed.end())
+            {
+                changed.push_back(filePath);
+            }
+        }
+    }
+    this->reclaim();
+    lock.unlock();
+    if (rescan)
+    {
+        this->updateResource();
+    }
+    else if (!changed.empty())
+    {
+        this->refresh(changed);
+    }
+}
+
+StorageStats Storage::stats()
+{
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    StorageStats stats = stats_;
+    for (const ReadCounters &counters : counters_)
+    {
+        stats.hits += counters.hits.load(std::memory_order_relaxed);
+        stats.misses += counters.misses.load(std::memory_order_relaxed);
+        stats.coalesced += counters.coalesced.load(std::memory_order_relaxed);
+    }
+    stats.files = entryCount;
+    stats.entries = slots.size();
+    stats.bytes = bytes;
+    return stats;
 }
@@ -1,28 +1,251 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
 #include <string>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
+#include <condition_variable>
 #include <iostream>
-#include <shared_mutex>
+#include <list>
 #include <memory>
 #include <vector>
 
+#include "http_message.h"
+
+// Files at least this large are not copied into memory: the resource keeps
+// the file open and its content is sent with sendfile(2) from the page cache
+constexpr size_t kSendfileThreshold = 256 * 1024;
+// Files smaller than this are always sent as they are: compressing them
+// saves less than it costs
+constexpr size_t kCompressionThreshold = 1024;
+
+// An immutable cached file, shared by the storage and the responses that are
+// still sending it, so reloading a file never invalidates a response in flight
+struct Resource
+{
+    Resource() : fd(-1), size(0), mtime(0), inode(0) {}
+    ~Resource();
+    Resource(const Resource &) = delete;
+    Resource &operator=(const Resource &) = delete;
+
+    std::string content; // the bytes of small files
+    int fd;              // the open file when it is not kept in memory
+    size_t size;
+    // The status line and headers of a 200 response carrying this file, and
+    // of the 304 response to a request whose cached copy is still fresh,
+    // serialized once when the file is loaded
+    std::string header;
+    std::string notModifiedHeader;
+    // Strong validator of the bytes, from the size, mtime and inode of the
+    // file and the content coding
+    std::string etag;
+    std::string_view contentType; // from the static table of mime.h
+    // What the file looked like on disk, to detect changes
+    int64_t mtime;
+    uint64_t inode;
+    // The file with a content coding, each with its own header: a sibling
+    // file with the .br or .gz extension if there is an up to date one,
+    // otherwise for gzip the file compressed when it was loaded, if zlib is
+    // available. Null if the file is not worth compressing.
+    std::shared_ptr<const Resource> brotli;
+    std::shared_ptr<const Resource> gzip;
+    // Set by readers when they hit the resource, cleared by the eviction
+    mutable std::atomic<bool> referenced{false};
+};
+
+using ResourcePtr = std::shared_ptr<const Resource>;
+
+// Returns a body segment that references the whole resource, or length bytes
+// of it from offset, without copying it
+simple_http_server::BodySegment resourceBody(const ResourcePtr &resource);
+simple_http_server::BodySegment resourceBody(const ResourcePtr &resource, size_t offset, size_t length);
+// Returns the response to a GET request for the resource, whose header and
+// body are sent straight from the resource without serializing or copying
+// anything: the variant picked from the Accept-Encoding field of the
+// request, or a 304 without body if the request's If-None-Match or
+// If-Modified-Since field shows that the client has it already. A Range
+// field is answered with slices of the file that are not copied either.
+simple_http_server::HttpResponse resourceResponse(const ResourcePtr &resource,
+                                                  const simple_http_server::HttpRequest &request);
+
+// A file of the document root in the table of a Storage, with its content
+// if it is cached. Entries are immutable once they are published: writers
+// build a new chain for the bucket they change and swap its head (RCU), so
+// readers take no lock.
+struct StorageEntry
+{
+    size_t hash;
+    std::string path;
+    ResourcePtr resource; // null if the file is not cached
+    const StorageEntry *next;
+};
+
+struct StorageTable
+{
+    explicit StorageTable(size_t bucketCount)
+        : mask(bucketCount - 1), buckets(new std::atomic<const StorageEntry *>[bucketCount])
+    {
+        for (size_t i = 0; i < bucketCount; i++)
+            buckets[i].store(nullptr, std::memory_order_relaxed);
+    }
+    size_t mask;
+    std::unique_ptr<std::atomic<const StorageEntry *>[]> buckets;
+};
+
+// How much of the document root a Storage keeps
+struct StorageLimits
+{
+    size_t maxBytes = 64 * 1024 * 1024; // content and headers held in memory
+    size_t maxOpenFiles = 1024;         // large files kept open for sendfile(2)
+};
+
+// What the cache and the watcher did so far
+struct StorageStats
+{
+    uint64_t hits;
+    uint64_t misses;    // lookups that went to the disk
+    uint64_t coalesced; // misses that waited for another thread reading the same file
+    uint64_t evictions;
+    uint64_t files;     // in the document root
+    uint64_t entries;   // currently cached
+    uint64_t bytes;
+    uint64_t scans;    // full scans of the document root
+    uint64_t events;   // inotify events read
+    uint64_t reloads;  // cached files loaded again because they changed
+    uint64_t removals; // cached files dropped because they were deleted
+    // From the change on disk to the table that has it, for the last
+    // reload and the slowest one
+    uint64_t lastLatencyNs;
+    uint64_t maxLatencyNs;
+};
+
+// Serves the files below a directory from memory. The paths of the files
+// are indexed when the Storage is created, so a path that is not a file is
+// refused without touching the disk, and the index is kept up to date by
+// the watcher. Hidden files and directories, and symbolic links, are not
+// served. Files are loaded on their first hit, and concurrent misses on a
+// file share a single read. The cache is
+// kept under StorageLimits with a segmented LRU: files enter a probation
+// segment and are promoted to the protected one if they are hit again, so a
+// scan through many files only ever evicts other files seen once.
 class Storage
 {
 public:
-    Storage(const std::vector<std::string> &files);
-    bool getResource(const std::string &filePath, std::string &outStr);
+    explicit Storage(const std::string &root = ".", const StorageLimits &limits = StorageLimits());
+    ~Storage();
+    Storage(const Storage &) = delete;
+    Storage &operator=(const Storage &) = delete;
+    // Lock-free when the file is cached: hands out a reference to the
+    // cached resource, never a copy. Otherwise loads it. filePath is
+    // relative to the root and must be normalized, e.g. "/css/site.css".
+    bool getResource(const std::string &filePath, ResourcePtr &outRes);
+    // Full scan: walks the document root to find the files that were
+    // created or deleted, and reloads the cached files that changed
     void updateResource();
 
+    // Starts watching every directory of the document root with inotify.
+    // Returns false if inotify is not available: updateResource() must then
+    // be called periodically instead.
+    bool watch();
+    // The inotify descriptor to poll for events, or -1
+    int watchFd() const { return inotifyFd; }
+    // Applies the pending inotify events to the index and reloads the cached
+    // files they name, or does a full scan if the kernel dropped some
+    void processEvents();
+    StorageStats stats();
+
+    // Threads that can read without sharing their counters and epoch slot
+    static constexpr size_t kMaxReaders = 128;
+
 private:
-    std::string readFile(const std::string &filePath);
+    // Where a cached file is in the segmented LRU
+    struct CacheSlot
+    {
+        ResourcePtr resource;
+        size_t cost;
+        bool protectedSegment;
+        std::list<std::string>::iterator position;
+    };
+    enum class Lookup
+    {
+        Absent,  // not a file of the document root
+        Indexed, // a file that is not cached
+        Cached
+    };
+    // Lock-free lookup in the table
+    Lookup find(const std::string &filePath, size_t hash, ResourcePtr &outRes);
+    // Loads a file that is not cached, or waits for the thread loading it
+    bool load(const std::string &filePath, size_t hash, ResourcePtr &outRes);
+    ResourcePtr loadFile(const std::string &filePath);
     std::string processFilePath(const std::string &filePath);
-    void addFile(const std::string filePath);
+    // Index, table and LRU updates, with writeMutex_ held
+    const StorageEntry *lookupEntry(const std::string &filePath, size_t hash);
+    void addEntry(const std::string &filePath);
+    void removeEntry(const std::string &filePath);
+    void removeDirectory(const std::string &dir);
+    // Adds the files below dir to the index, and to seen if it is given
+    void indexDirectory(const std::string &dir, std::unordered_set<std::string> *seen);
+    void insert(const std::string &filePath, size_t hash, const ResourcePtr &resource);
+    void uncache(const std::string &filePath, size_t hash);
+    // Replaces the entry of filePath by one with resource, or removes it
+    void rebuildBucket(size_t hash, const std::string &filePath, bool keep, const ResourcePtr &resource);
+    void grow();
+    void evict();
+    void watchDirectory(const std::string &dir);
+    // Frees the entries and tables no reader can still be using
+    void reclaim();
+    // Reloads or removes each of the cached paths depending on what is on
+    // disk
+    void refresh(const std::vector<std::string> &paths);
+    // The paths of the cached files
+    std::vector<std::string> cachedPaths();
+
+    struct PendingLoad
+    {
+        bool done = false;
+        bool stale = false; // the file changed while it was being read
+        ResourcePtr resource;
+    };
+
+    struct Retired
+    {
+        uint64_t epoch;
+        const StorageEntry *chain;
+        const StorageTable *table;
+    };
+
+    // Hits and misses, counted by each reader thread in its own cache line,
+    // and by all the others in the last one
+    struct alignas(64) ReadCounters
+    {
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> coalesced{0};
+    };
+    void count(std::atomic<uint64_t> ReadCounters::*counter);
 
 private:
     std::string baseDir;
-    mutable std::shared_mutex mutex_;
-    std::unordered_map<std::string, std::string> resources;
-    std::vector<std::string> files;
-};
\ No newline at end of file
+    StorageLimits limits;
+    std::atomic<const StorageTable *> table_;
+    ReadCounters counters_[kMaxReaders + 1];
+
+    std::mutex writeMutex_; // serializes the writers, readers never take it
+    size_t entryCount;
+    std::unordered_map<std::string, CacheSlot> slots;
+    std::list<std::string> probation; // most recently inserted first
+    std::list<std::string> protectedList;
+    size_t bytes;
+    size_t protectedBytes;
+    size_t openFiles;
+    std::vector<Retired> retired;
+    int inotifyFd;
+    std::unordered_map<int, std::string> watchedDirs; // by watch descriptor
+    StorageStats stats_;
+
+    std::mutex missMutex_;
+    std::condition_variable missDone_;
+    std::unordered_map<std::string, std::shared_ptr<PendingLoad>> pending_;
+};
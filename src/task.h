@@ -0,0 +1,162 @@
+// Defines Task, the coroutine type of asynchronous handlers: a lazily
+// started computation of a T that other tasks can co_await
+
+#ifndef TASK_H_
+#define TASK_H_
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+
+namespace simple_http_server
+{
+
+    template <typename T = void>
+    class Task;
+
+    namespace detail
+    {
+
+        struct TaskPromiseBase
+        {
+            std::coroutine_handle<> continuation; // the task awaiting this one
+            std::function<void()> on_done;        // or who to tell, if started
+            std::exception_ptr error;
+            bool running_inline = false; // within Start(), which tells itself
+
+            // Hands over to whoever waits for the result, without growing
+            // the stack when tasks complete one after another
+            struct FinalAwaiter
+            {
+                bool await_ready() const noexcept { return false; }
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+                {
+                    TaskPromiseBase &promise = handle.promise();
+                    if (promise.continuation)
+                        return promise.continuation;
+                    if (promise.on_done && !promise.running_inline)
+                        promise.on_done(); // may destroy the task
+                    return std::noop_coroutine();
+                }
+                void await_resume() const noexcept {}
+            };
+
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            FinalAwaiter final_suspend() const noexcept { return {}; }
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        template <typename T>
+        struct TaskPromise : TaskPromiseBase
+        {
+            std::optional<T> value;
+
+            Task<T> get_return_object();
+            template <typename U>
+            void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+            T Result()
+            {
+                if (error)
+                    std::rethrow_exception(error);
+                return std::move(*value);
+            }
+        };
+
+        template <>
+        struct TaskPromise<void> : TaskPromiseBase
+        {
+            Task<void> get_return_object();
+            void return_void() {}
+            void Result()
+            {
+                if (error)
+                    std::rethrow_exception(error);
+            }
+        };
+
+    } // namespace detail
+
+    // A coroutine that returns a T. Nothing runs until it is co_awaited,
+    // or started by the server, and it resumes whoever awaits it when it
+    // completes. Exceptions reach the awaiting coroutine. A Task owns its
+    // coroutine and is moved, not copied.
+    template <typename T>
+    class [[nodiscard]] Task
+    {
+    public:
+        using promise_type = detail::TaskPromise<T>;
+
+        Task() = default;
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+        Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+        Task &operator=(Task &&other) noexcept
+        {
+            if (this != &other)
+            {
+                if (handle_)
+                    handle_.destroy();
+                handle_ = std::exchange(other.handle_, nullptr);
+            }
+            return *this;
+        }
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+        ~Task()
+        {
+            if (handle_)
+                handle_.destroy();
+        }
+
+        bool done() const { return !handle_ || handle_.done(); }
+
+        // Runs the task until it completes or first suspends, and returns
+        // whether it completed. Otherwise on_done is called, on the thread
+        // that resumed it, once it completes.
+        bool Start(std::function<void()> on_done)
+        {
+            promise_type &promise = handle_.promise();
+            promise.on_done = std::move(on_done);
+            promise.running_inline = true;
+            handle_.resume();
+            promise.running_inline = false;
+            return handle_.done();
+        }
+
+        // The value the task returned, or the exception it threw. Only
+        // once it is done.
+        T Result() { return handle_.promise().Result(); }
+
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            handle_.promise().continuation = awaiting;
+            return handle_;
+        }
+        T await_resume() { return handle_.promise().Result(); }
+
+    private:
+        std::coroutine_handle<promise_type> handle_;
+    };
+
+    namespace detail
+    {
+
+        template <typename T>
+        Task<T> TaskPromise<T>::get_return_object()
+        {
+            return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+        }
+
+        inline Task<void> TaskPromise<void>::get_return_object()
+        {
+            return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+        }
+
+    } // namespace detail
+
+} // namespace simple_http_server
+
+#endif // TASK_H_
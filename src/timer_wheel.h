@@ -0,0 +1,128 @@
+// Defines a hashed timing wheel that keeps the deadlines of many objects,
+// such as the connections of a worker, with O(1) arm, re-arm and cancel
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace simple_http_server
+{
+
+    // Links an object into a TimerWheel. It is embedded in the object, so
+    // arming a timer allocates nothing.
+    template <typename T>
+    struct TimerLink
+    {
+        T *prev = nullptr;
+        T *next = nullptr;
+        uint64_t deadline = 0; // in ms, 0 while the timer is not armed
+        size_t slot = 0;
+    };
+
+    // Time is split in ticks of kTickMs and every tick hashes to one of
+    // kSlots lists. A deadline further than a revolution away waits in its
+    // slot until the wheel has come round enough times, so deadlines of any
+    // length cost the same. Timers fire less than one tick late. Link is the
+    // TimerLink member of T. Not thread-safe: a wheel belongs to one worker.
+    template <typename T, TimerLink<T> T::*Link>
+    class TimerWheel
+    {
+    public:
+        static constexpr uint64_t kTickMs = 100;
+        static constexpr size_t kSlots = 1024; // a revolution lasts 102.4s
+
+        explicit TimerWheel(uint64_t now_ms) : next_tick_(now_ms / kTickMs), heads_() {}
+        TimerWheel(const TimerWheel &) = delete;
+        TimerWheel &operator=(const TimerWheel &) = delete;
+
+        static bool Armed(const T *item) { return (item->*Link).deadline != 0; }
+
+        // Fires item once deadline_ms (> 0) has passed, or on the next tick if
+        // it already has. Re-arming a timer within its slot only updates its
+        // deadline.
+        void Arm(T *item, uint64_t deadline_ms)
+        {
+            TimerLink<T> &link = item->*Link;
+            uint64_t tick = deadline_ms / kTickMs;
+            size_t slot = std::max(tick, next_tick_) & (kSlots - 1);
+            if (link.deadline != 0 && link.slot == slot)
+            {
+                link.deadline = deadline_ms;
+                return;
+            }
+            Cancel(item);
+            link.deadline = deadline_ms;
+            link.slot = slot;
+            link.prev = nullptr;
+            link.next = heads_[slot];
+            if (link.next != nullptr)
+                (link.next->*Link).prev = item;
+            heads_[slot] = item;
+        }
+
+        void Cancel(T *item)
+        {
+            TimerLink<T> &link = item->*Link;
+            if (link.deadline == 0)
+                return;
+            if (link.prev != nullptr)
+                (link.prev->*Link).next = link.next;
+            else
+                heads_[link.slot] = link.next;
+            if (link.next != nullptr)
+                (link.next->*Link).prev = link.prev;
+            link.prev = link.next = nullptr;
+            link.deadline = 0;
+        }
+
+        // Moves the wheel to now_ms and calls expire(item) for every timer
+        // whose deadline has passed, once it is disarmed. A tick is processed
+        // once it is over, so every timer of its slot that is due in this
+        // revolution has expired. expire may arm or cancel the timer it is
+        // given, but no other.
+        template <typename Expire>
+        void Advance(uint64_t now_ms, Expire expire)
+        {
+            uint64_t end = now_ms / kTickMs;
+            if (end <= next_tick_)
+                return;
+            // past a whole revolution every slot is visited once
+            uint64_t first = end - next_tick_ > kSlots ? end - kSlots : next_tick_;
+            next_tick_ = end;
+            for (uint64_t tick = first; tick < end; tick++)
+            {
+                // unlink what expired first, so that expire cannot disturb
+                // the walk through the slot
+                T *expired = nullptr;
+                for (T *item = heads_[tick & (kSlots - 1)]; item != nullptr;)
+                {
+                    T *next = (item->*Link).next;
+                    if ((item->*Link).deadline <= now_ms)
+                    {
+                        Cancel(item);
+                        (item->*Link).next = expired;
+                        expired = item;
+                    }
+                    item = next;
+                }
+                while (expired != nullptr)
+                {
+                    T *item = expired;
+                    expired = (item->*Link).next;
+                    (item->*Link).next = nullptr;
+                    expire(item);
+                }
+            }
+        }
+
+    private:
+        uint64_t next_tick_; // the first tick that has not been processed
+        T *heads_[kSlots];
+    };
+
+} // namespace simple_http_server
+
+#endif // TIMER_WHEEL_H_
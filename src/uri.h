@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <cctype>
 #include <string>
+#include <string_view>
 #include <utility>
 
 namespace simple_http_server
@@ -21,6 +22,15 @@ namespace simple_http_server
     explicit Uri(const std::string &path) : path_(path) { SetPathToLowercase(); }
     ~Uri() = default;
 
+    // Keeps the case of the path, as request targets are case-sensitive and
+    // so are the names of the files they are served from
+    static Uri CaseSensitive(const std::string &path)
+    {
+      Uri uri;
+      uri.path_ = path;
+      return uri;
+    }
+
     inline bool operator<(const Uri &other) const { return path_ < other.path_; }
     inline bool operator==(const Uri &other) const
     {
@@ -33,10 +43,10 @@ namespace simple_http_server
       SetPathToLowercase();
     }
 
-    std::string scheme() const { return scheme_; }
-    std::string host() const { return host_; }
+    const std::string &scheme() const { return scheme_; }
+    const std::string &host() const { return host_; }
     std::uint16_t port() const { return port_; }
-    std::string path() const { return path_; }
+    const std::string &path() const { return path_; }
 
   private:
     // Only the path is supported for now
@@ -53,6 +63,64 @@ namespace simple_http_server
     }
   };
 
+  // Decodes the percent-encoded octets of an absolute path and removes its
+  // empty, "." and ".." segments (RFC 3986 5.2.4), e.g. "/a/./b/../c%20d"
+  // gives "/a/c d". A trailing '/' is kept. Returns false if the path would
+  // escape its root, or hides a '/' or a NUL in a percent-encoded octet.
+  inline bool NormalizePath(std::string_view path, std::string *normalized)
+  {
+    normalized->clear();
+    if (path.empty() || path[0] != '/')
+      return false;
+
+    auto hex = [](char c) -> int
+    {
+      if (c >= '0' && c <= '9')
+        return c - '0';
+      c = static_cast<char>(tolower(c));
+      return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    };
+    std::string segment;
+    size_t start = 1;
+    while (start <= path.length())
+    {
+      size_t end = path.find('/', start);
+      if (end == std::string_view::npos)
+        end = path.length();
+      segment.clear();
+      for (size_t i = start; i < end; i++)
+      {
+        if (path[i] != '%')
+        {
+          segment += path[i];
+          continue;
+        }
+        int high = i + 2 < end ? hex(path[i + 1]) : -1;
+        int low = high >= 0 ? hex(path[i + 2]) : -1;
+        if (low < 0 || (high == 0 && low == 0) || (high == 2 && low == 15))
+          return false;
+        segment += static_cast<char>(high * 16 + low);
+        i += 2;
+      }
+
+      if (segment == "..")
+      {
+        if (normalized->empty())
+          return false;
+        normalized->resize(normalized->rfind('/'));
+      }
+      else if (!segment.empty() && segment != ".")
+      {
+        *normalized += '/';
+        *normalized += segment;
+      }
+      start = end + 1;
+    }
+    if (normalized->empty() || path.back() == '/')
+      *normalized += '/';
+    return true;
+  }
+
 } // namespace simple_http_server
 
 #endif // URI_H_
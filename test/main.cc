@@ -1,13 +1,39 @@
 // Simple unit tests without using any framework
 
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <iterator>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "async.h"
+#include "executor.h"
 #include "http_message.h"
+#include "http_server.h"
+#include "io_uring.h"
+#include "mime.h"
+#include "mpsc_queue.h"
+#include "multipart.h"
+#include "router.h"
+#include "scan.h"
+#include "storage.h"
+#include "task.h"
+#include "timer_wheel.h"
 #include "uri.h"
 
 using namespace simple_http_server;
@@ -21,6 +47,31 @@ using namespace simple_http_server;
 
 int err = 0;
 
+// Sends requests to a server on localhost, waits for delay without reading
+// anything, then reads until the server closes the connection
+std::string exchange(int port, const std::string &requests,
+                     std::chrono::milliseconds delay = std::chrono::milliseconds(0)) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int window = 65536; // so that large responses wait for the reader
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  std::string received;
+  if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0 &&
+      send(fd, requests.data(), requests.length(), MSG_NOSIGNAL) ==
+          static_cast<ssize_t>(requests.length())) {
+    std::this_thread::sleep_for(delay);
+    char buffer[65536];
+    ssize_t count;
+    while ((count = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+      received.append(buffer, count);
+  }
+  close(fd);
+  return received;
+}
+
 void test_uri_path_to_lowercase() {
   std::string path = "/SayHello.HTML?name=abc&message=welcome";
   std::string lowercase_path;
@@ -41,7 +92,9 @@ void test_version_to_string() {
 
 void test_status_code_to_string() {
   EXPECT_TRUE(to_string(HttpStatusCode::ImATeapot) == "I'm a Teapot");
-  EXPECT_TRUE(to_string(HttpStatusCode::NoContent) == "");
+  EXPECT_TRUE(to_string(HttpStatusCode::NoContent) == "No Content");
+  EXPECT_TRUE(to_string(HttpStatusCode::ServiceUnvailable) ==
+              "Service Unavailable");
 }
 
 void test_string_to_method() {
@@ -79,6 +132,1020 @@ void test_response_to_string() {
   EXPECT_TRUE(to_string(response) == expected_str);
 }
 
+void test_string_to_request() {
+  std::string request_string;
+  request_string += "GET /index.html HTTP/1.1\r\n";
+  request_string += "Host: localhost:8080\r\n";
+  request_string += "User-Agent: Mozilla/5.0 (X11; Linux x86_64) \r\n\r\n";
+
+  HttpRequest request = stringToRequest(request_string);
+  EXPECT_TRUE(request.method() == HttpMethod::GET);
+  EXPECT_TRUE(request.uri().path() == "/index.html");
+  EXPECT_TRUE(request.header("Host") == "localhost:8080");
+  EXPECT_TRUE(request.header("User-Agent") == "Mozilla/5.0 (X11; Linux x86_64)");
+}
+
+void test_parse_request() {
+  std::string pipelined;
+  pipelined += "GET / HTTP/1.1\r\nHost: a\r\n\r\n";
+  pipelined += "POST /b HTTP/1.1\r\ncontent-length: 5\r\n\r\nhello";
+  RequestView view;
+  size_t scan_offset = 0;
+  EXPECT_TRUE(ParseRequest(pipelined, &scan_offset, &view) ==
+              ParseStatus::Complete);
+  EXPECT_TRUE(view.length == 27);
+  EXPECT_TRUE(view.header("host") == "a");
+  scan_offset = 0;
+  EXPECT_TRUE(ParseRequest(std::string_view(pipelined).substr(27),
+                           &scan_offset, &view) == ParseStatus::Complete);
+  EXPECT_TRUE(view.length == 44);
+  EXPECT_TRUE(view.method == "POST" && view.body == "hello");
+
+  // a request split across reads is only complete with its whole body
+  std::string partial = "POST /b HTTP/1.1\r\nContent-Length: 5\r\n\r";
+  scan_offset = 0;
+  EXPECT_TRUE(ParseRequest(partial, &scan_offset, &view) ==
+              ParseStatus::Incomplete);
+  partial += "\nhel";
+  EXPECT_TRUE(ParseRequest(partial, &scan_offset, &view) ==
+              ParseStatus::Incomplete);
+  partial += "lo";
+  EXPECT_TRUE(ParseRequest(partial, &scan_offset, &view) ==
+              ParseStatus::Complete);
+  EXPECT_TRUE(view.length == partial.length());
+
+  const char *malformed[] = {
+      "GET  / HTTP/1.1\r\n\r\n",
+      "GET / HTTP/1.1\r\nHost : a\r\n\r\n",
+      "GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n",
+      "GET / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+      "GET / HTTP/1.1\r\nContent-Length: -1\r\n\r\n",
+      "GET / HTTP/1\r\n\r\n",
+      "POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n",
+      "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n",
+  };
+  for (const char *request : malformed) {
+    scan_offset = 0;
+    EXPECT_TRUE(ParseRequest(request, &scan_offset, &view) ==
+                ParseStatus::Malformed);
+  }
+
+  // the body is left to the caller once the header block is complete
+  std::string upload = "PUT /f HTTP/1.1\r\nContent-Length: 1000000000\r\n\r\nabc";
+  scan_offset = 0;
+  EXPECT_TRUE(ParseRequest(upload, &scan_offset, &view) == ParseStatus::Incomplete &&
+              view.header_length == upload.length() - 3 && view.content_length == 1000000000);
+  std::string chunked = "POST /c HTTP/1.1\r\nTransfer-Encoding: Chunked\r\n\r\n0\r\n\r\n";
+  scan_offset = 0;
+  EXPECT_TRUE(ParseRequest(chunked, &scan_offset, &view) == ParseStatus::Incomplete &&
+              view.chunked && view.header_length == chunked.length() - 5);
+
+  std::string oversized = "GET / HTTP/1.1\r\nCookie: ";
+  oversized += std::string(kMaxHeaderSize, 'a');
+  scan_offset = 0;
+  EXPECT_TRUE(ParseRequest(oversized, &scan_offset, &view) ==
+              ParseStatus::Malformed);
+}
+
+void test_request_body() {
+  // every split of a chunked body decodes to the same data
+  std::string body = "5;ext=1\r\nhello\r\nA \r\n, chunked!\r\n0\r\nTrailer: x\r\n\r\nNEXT";
+  for (size_t split = 0; split <= body.length(); split++) {
+    ChunkedDecoder decoder;
+    std::string buffer, data;
+    ParseStatus status = ParseStatus::Incomplete;
+    size_t offset = 0; // of buffer in body
+    for (size_t arrived : {split, body.length()}) {
+      buffer = body.substr(offset, arrived - offset);
+      while (status == ParseStatus::Incomplete) {
+        size_t consumed;
+        std::string_view piece;
+        status = decoder.Decode(buffer, &consumed, &piece);
+        data.append(piece);
+        buffer.erase(0, consumed);
+        offset += consumed;
+        if (consumed == 0)
+          break;
+      }
+    }
+    EXPECT_TRUE(status == ParseStatus::Complete && data == "hello, chunked!" &&
+                body.substr(offset) == "NEXT");
+  }
+  const char *malformed[] = {"x\r\n", "5\r\nhelloXX", "1234567890abcdef0\r\n", "5x\r\n"};
+  for (const char *chunks : malformed) {
+    ChunkedDecoder decoder;
+    std::string_view buffer(chunks), piece;
+    size_t consumed;
+    ParseStatus status;
+    while ((status = decoder.Decode(buffer, &consumed, &piece)) == ParseStatus::Incomplete &&
+           consumed > 0)
+      buffer.remove_prefix(consumed);
+    EXPECT_TRUE(status == ParseStatus::Malformed);
+  }
+
+  // a body written to an unnamed file reads back from its fd
+  FileBodySink sink;
+  sink.Write("hello, ");
+  sink.Write("file");
+  char read_back[16] = {};
+  EXPECT_TRUE(sink.size() == 11 && pread(sink.fd(), read_back, sizeof(read_back), 0) == 11 &&
+              std::string(read_back) == "hello, file");
+}
+
+void test_multipart() {
+  EXPECT_TRUE(multipart_boundary("multipart/form-data; boundary=xYz-1") == "xYz-1");
+  EXPECT_TRUE(multipart_boundary("Multipart/Form-Data;charset=utf-8; boundary=\"a b\"") == "a b");
+  EXPECT_TRUE(multipart_boundary("multipart/mixed; boundary=x").empty());
+  EXPECT_TRUE(multipart_boundary("multipart/form-data; boundary=\"x\r\"").empty());
+  EXPECT_TRUE(multipart_boundary("multipart/form-data").empty());
+
+  // every split of a form gives the same parts
+  std::string body =
+      "preamble\r\n--AaB03x\r\n"
+      "Content-Disposition: form-data; name=\"field\"\r\n\r\n"
+      "value\r\n--AaB0 not a boundary\r\n--AaB03x  \r\n"
+      "content-disposition: form-data; name=\"file\"; filename=\"a \\\"b\\\".txt\"\r\n"
+      "Content-Type: text/plain\r\n\r\n"
+      "\r\r\n-\r\n--AaB03x--\r\nepilogue";
+  std::string expected = "[field||]value\r\n--AaB0 not a boundary;"
+                         "[file|a \"b\".txt|text/plain]\r\r\n-;";
+  for (size_t split = 0; split <= body.length(); split++) {
+    std::string log;
+    MultipartParser parser(
+        "AaB03x",
+        [&](const MultipartPart &part) {
+          log += "[" + part.name + "|" + part.filename + "|" + part.content_type + "]";
+        },
+        [&](std::string_view data) { log.append(data); },
+        [&]() { log += ";"; });
+    ParseStatus first = parser.Feed(body.substr(0, split));
+    ParseStatus second = parser.Feed(body.substr(split));
+    EXPECT_TRUE(first == (split >= body.length() - 10 ? ParseStatus::Complete
+                                                       : ParseStatus::Incomplete));
+    EXPECT_TRUE(second == ParseStatus::Complete && parser.done() && log == expected);
+  }
+  const char *malformed[] = {
+      "--b\r\nContent-Type: text/plain\r\n\r\nx\r\n--b--",
+      "--b\r\nContent-Disposition: attachment; name=\"x\"\r\n\r\nx\r\n--b--",
+      "--b\r\nContent-Disposition: form-data\r\n\r\nx\r\n--b--",
+      "--bX\r\n",
+      "--b\r\nNo colon\r\n\r\n",
+  };
+  for (const char *form : malformed) {
+    MultipartParser parser("b", [](const MultipartPart &) {}, [](std::string_view) {}, []() {});
+    EXPECT_TRUE(parser.Feed(form) == ParseStatus::Malformed);
+  }
+
+  // files go to disk, fields stay in memory, within the limits
+  MultipartBodySink sink("b");
+  sink.Write("--b\r\nContent-Disposition: form-data; name=\"up\"; filename=\"x.bin\"\r\n\r\n");
+  for (int i = 0; i < 1000; i++)
+    sink.Write(std::string(1000, 'z'));
+  sink.Write("\r\n--b\r\nContent-Disposition: form-data; name=\"note\"\r\n\r\nhi\r\n--b--");
+  sink.Finish();
+  const FormPart *file = sink.part("up");
+  const FormPart *note = sink.part("note");
+  char read_back[4] = {};
+  EXPECT_TRUE(sink.parts().size() == 2 && file != nullptr && file->file != nullptr &&
+              file->file->size() == 1000000 && file->value.empty() &&
+              pread(file->file->fd(), read_back, 3, 999997) == 3 &&
+              std::string(read_back) == "zzz");
+  EXPECT_TRUE(note != nullptr && note->file == nullptr && note->value == "hi");
+
+  FormLimits limits;
+  limits.fields = 100;
+  limits.files = 0;
+  const char *over_limits[] = {
+      "--b\r\nContent-Disposition: form-data; name=\"f\"; filename=\"f\"\r\n\r\n",
+      "--b\r\nContent-Disposition: form-data; name=\"f\"\r\n\r\n",
+  };
+  for (const char *form : over_limits) {
+    MultipartBodySink limited("b", "/tmp", limits);
+    bool rejected = false;
+    try {
+      limited.Write(form);
+      limited.Write(std::string(200, 'v'));
+    } catch (const std::invalid_argument &) {
+      rejected = true;
+    }
+    EXPECT_TRUE(rejected);
+  }
+  MultipartBodySink truncated("b");
+  truncated.Write("--b\r\nContent-Disposition: form-data; name=\"f\"\r\n\r\nv");
+  bool rejected = false;
+  try {
+    truncated.Finish();
+  } catch (const std::invalid_argument &) {
+    rejected = true;
+  }
+  EXPECT_TRUE(rejected);
+}
+
+void test_scan_kernels() {
+  // every kernel set the CPU supports must agree with the scalar one
+  std::string samples[] = {
+      "GET /index.html HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n",
+      std::string(100, 'a') + "\r\n\r" + std::string(50, 'b') + "\r\n\r\n",
+      "User-Agent" + std::string(40, '-') + ":" + std::string(70, '\t') + "\x7f",
+      std::string(33, 'x') + std::string("\x80\0", 2) + "\r\n",
+  };
+  const char *kernels[] = {"sse4.2", "avx2"};
+  for (const char *kernel : kernels) {
+    for (const std::string &sample : samples) {
+      for (size_t from = 0; from < sample.length(); from++) {
+        const char *data = sample.data() + from;
+        size_t length = sample.length() - from;
+        set_scan_kernel("scalar");
+        size_t header_end = find_header_end(sample.data(), sample.length(), from);
+        size_t token = scan_token(data, length);
+        size_t value = scan_field_value(data, length);
+        if (!set_scan_kernel(kernel))
+          break;
+        EXPECT_TRUE(find_header_end(sample.data(), sample.length(), from) ==
+                    header_end);
+        EXPECT_TRUE(scan_token(data, length) == token);
+        EXPECT_TRUE(scan_field_value(data, length) == value);
+      }
+    }
+  }
+  set_scan_kernel("scalar");
+}
+
+void test_header_list() {
+  HttpResponse response;
+  for (int i = 0; i < 20; i++)
+    response.SetHeader("X-Field-" + std::to_string(i), std::to_string(i));
+  response.SetHeader("content-type", "text/plain");
+  response.SetHeader("Content-Type", "text/html; charset=utf-8");
+  EXPECT_TRUE(response.headers().size() == 21);
+  EXPECT_TRUE(response.header(KnownHeader::ContentType) ==
+              "text/html; charset=utf-8");
+  EXPECT_TRUE(response.header("x-field-19") == "19");
+
+  response.RemoveHeader("X-FIELD-0");
+  EXPECT_TRUE(response.header("X-Field-0").empty());
+  EXPECT_TRUE(response.header("Content-Type") == "text/html; charset=utf-8");
+  EXPECT_TRUE((*response.headers().begin()).name == "X-Field-1");
+}
+
+void test_router() {
+  Router<int> router;
+  router.Add("/", HttpMethod::GET, 1);
+  router.Add("/users/:id", HttpMethod::GET, 2);
+  router.Add("/users/me", HttpMethod::GET, 3);
+  router.Add("/users/:id/posts/:post", HttpMethod::POST, 4);
+  router.Add("/*path", HttpMethod::GET, 5);
+
+  RouteParams params;
+  bool path_found;
+  const int *handler = router.Find("/", HttpMethod::GET, &params, &path_found);
+  EXPECT_TRUE(handler != nullptr && *handler == 1);
+  handler = router.Find("/users/me", HttpMethod::GET, &params, &path_found);
+  EXPECT_TRUE(handler != nullptr && *handler == 3 && params.count == 0);
+  handler = router.Find("/users/42", HttpMethod::HEAD, &params, &path_found);
+  EXPECT_TRUE(handler != nullptr && *handler == 2);
+  EXPECT_TRUE(params.count == 1 && params.params[0].value == "42");
+  handler = router.Find("/users/42/posts/7", HttpMethod::POST, &params, &path_found);
+  EXPECT_TRUE(handler != nullptr && *handler == 4 && params.count == 2);
+  EXPECT_TRUE(params.params[1].name == "post" && params.params[1].value == "7");
+
+  // a parameter route without a handler for the method is still a path
+  handler = router.Find("/users/42/posts/7", HttpMethod::GET, &params, &path_found);
+  EXPECT_TRUE(handler == nullptr && path_found);
+  handler = router.Find("/users/42", HttpMethod::DELETE, &params, &path_found);
+  EXPECT_TRUE(handler == nullptr && path_found);
+
+  handler = router.Find("/css/style.css", HttpMethod::GET, &params, &path_found);
+  EXPECT_TRUE(handler != nullptr && *handler == 5);
+  EXPECT_TRUE(params.count == 1 && params.params[0].value == "/css/style.css");
+
+  Router<int> api;
+  api.Add("/api/:version", HttpMethod::GET, 1);
+  handler = api.Find("/api", HttpMethod::GET, &params, &path_found);
+  EXPECT_TRUE(handler == nullptr && !path_found);
+  handler = api.Find("/api/v1/extra", HttpMethod::GET, &params, &path_found);
+  EXPECT_TRUE(handler == nullptr && !path_found);
+
+  bool threw = false;
+  try {
+    api.Add("/api/:name", HttpMethod::POST, 2);
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  EXPECT_TRUE(threw);
+
+  HttpRequest request;
+  request.SetUri(Uri("/users/42?tab=posts#top"));
+  EXPECT_TRUE(request.path() == "/users/42");
+}
+
+void test_route_case() {
+  // routes keep their case, and so do the names of their parameters
+  HttpServer server("127.0.0.1", 18643);
+  char dir[] = "/tmp/test_route.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    EXPECT_TRUE(false);
+    return;
+  }
+  server.ServeDirectory("/files", dir);
+  server.RegisterHttpRequestHandler("/Assets/*File", HttpMethod::GET,
+                                    [](const HttpRequest &request, Storage *) {
+                                      HttpResponse response(HttpStatusCode::Ok);
+                                      response.SetContent(std::string(request.param("File")));
+                                      return response;
+                                    });
+  server.Start();
+  std::string received =
+      exchange(18643, "GET /Assets/img/Logo.PNG HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n");
+  EXPECT_TRUE(received.rfind("HTTP/1.1 200 OK\r\n", 0) == 0 &&
+              received.substr(received.length() - 12) == "img/Logo.PNG");
+  received = exchange(18643, "GET /assets/img/Logo.PNG HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n");
+  EXPECT_TRUE(received.rfind("HTTP/1.1 404 Not Found\r\n", 0) == 0);
+  server.Stop();
+  rmdir(dir);
+}
+
+void test_normalize_path() {
+  std::string path;
+  EXPECT_TRUE(NormalizePath("/a/./b/../c%20d", &path) && path == "/a/c d");
+  EXPECT_TRUE(NormalizePath("//a//b/", &path) && path == "/a/b/");
+  EXPECT_TRUE(NormalizePath("/a/..", &path) && path == "/");
+  EXPECT_TRUE(!NormalizePath("/../etc/passwd", &path));
+  EXPECT_TRUE(!NormalizePath("/a/%2e%2e/%2E%2e/b", &path));
+  EXPECT_TRUE(!NormalizePath("/a%2fb", &path));
+  EXPECT_TRUE(!NormalizePath("/a%00", &path));
+  EXPECT_TRUE(!NormalizePath("/a%2", &path));
+  EXPECT_TRUE(!NormalizePath("a", &path));
+
+  EXPECT_TRUE(mime_type("/index.html") == "text/html; charset=utf-8");
+  EXPECT_TRUE(mime_type("/img/logo.PNG") == "image/png");
+  EXPECT_TRUE(mime_type("/fonts/a.woff2") == "font/woff2");
+  EXPECT_TRUE(mime_type("/v1.2/README") == "application/octet-stream");
+}
+
+void test_storage_cache() {
+  char dir[] = "/tmp/test_storage.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    EXPECT_TRUE(false);
+    return;
+  }
+  std::string root = dir;
+  const std::string names = "abcdefghij";
+  for (char name : names) {
+    std::string content(1000, name);
+    int fd = open((root + "/" + name + ".html").c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    EXPECT_TRUE(write(fd, content.data(), content.size()) == 1000);
+    close(fd);
+  }
+
+  mkdir((root + "/css").c_str(), 0755);
+  int css = open((root + "/css/site.css").c_str(), O_WRONLY | O_CREAT, 0644);
+  EXPECT_TRUE(write(css, "p{}", 3) == 3);
+  close(css);
+
+  {
+    Storage storage(root);
+    ResourcePtr resource;
+    EXPECT_TRUE(storage.getResource("/css/site.css", resource));
+    EXPECT_TRUE(resource->header.find("Content-Type: text/css") != std::string::npos);
+    EXPECT_TRUE(!storage.getResource("/css", resource));
+  }
+
+  {
+    // room for about 4 of the files
+    StorageLimits limits;
+    limits.maxBytes = 5000;
+    Storage storage(root, limits);
+    EXPECT_TRUE(storage.stats().files == names.size() + 1);
+    ResourcePtr resource;
+    EXPECT_TRUE(storage.getResource("/a.html", resource));
+    EXPECT_TRUE(resource->size == 1000 && resource->content[0] == 'a');
+    EXPECT_TRUE(storage.getResource("/a.html", resource));
+    EXPECT_TRUE(storage.stats().misses == 1 && storage.stats().hits == 1);
+    EXPECT_TRUE(!storage.getResource("/missing.html", resource));
+    EXPECT_TRUE(!storage.getResource("/../a.html", resource));
+    EXPECT_TRUE(!storage.getResource("/.a.html", resource));
+    EXPECT_TRUE(!storage.getResource("a.html", resource));
+
+    // files hit twice survive a scan through files hit once
+    storage.getResource("/b.html", resource);
+    storage.getResource("/b.html", resource);
+    for (char name : names.substr(2))
+      storage.getResource("/" + std::string(1, name) + ".html", resource);
+    StorageStats stats = storage.stats();
+    EXPECT_TRUE(stats.evictions > 0 && stats.bytes <= limits.maxBytes);
+    storage.getResource("/a.html", resource);
+    storage.getResource("/b.html", resource);
+    EXPECT_TRUE(storage.stats().misses == stats.misses);
+    storage.getResource("/c.html", resource);
+    EXPECT_TRUE(storage.stats().misses == stats.misses + 1);
+  }
+
+  {
+    // a file truncated to empty is served empty, whether it was kept in
+    // memory or sent from its fd
+    std::string large(kSendfileThreshold + 1, 'x');
+    int fd = open((root + "/large.bin").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    EXPECT_TRUE(write(fd, large.data(), large.size()) == static_cast<ssize_t>(large.size()));
+    close(fd);
+    Storage storage(root);
+    for (const char *path : {"/a.html", "/large.bin"}) {
+      ResourcePtr before, after;
+      EXPECT_TRUE(storage.getResource(path, before) && before->size > 0);
+      EXPECT_TRUE(truncate((root + path).c_str(), 0) == 0);
+      storage.updateResource();
+      EXPECT_TRUE(storage.getResource(path, after) && after->size == 0 && after->fd < 0 &&
+                  after->etag != before->etag &&
+                  after->header.find("Content-Length: 0\r\n") != std::string::npos);
+    }
+    unlink((root + "/large.bin").c_str());
+  }
+
+  for (char name : names)
+    unlink((root + "/" + name + ".html").c_str());
+  unlink((root + "/css/site.css").c_str());
+  rmdir((root + "/css").c_str());
+  rmdir(dir);
+}
+
+void test_serve_mixed_case() {
+  // files are served under the case of their names
+  char dir[] = "/tmp/test_case.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    EXPECT_TRUE(false);
+    return;
+  }
+  std::string root = dir;
+  mkdir((root + "/Sub").c_str(), 0755);
+  const char *names[] = {"/Upper.TXT", "/Sub/a.txt", "/lower.txt"};
+  for (const char *name : names) {
+    int fd = open((root + name).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    EXPECT_TRUE(write(fd, name, strlen(name)) == static_cast<ssize_t>(strlen(name)));
+    close(fd);
+  }
+
+  HttpServer server("127.0.0.1", 18642);
+  server.ServeDirectory("/", root);
+  server.Start();
+  for (const char *name : names) {
+    std::string received =
+        exchange(18642, "GET " + std::string(name) + " HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n");
+    EXPECT_TRUE(received.rfind("HTTP/1.1 200 OK\r\n", 0) == 0 &&
+                received.substr(received.length() - strlen(name)) == name);
+  }
+  std::string received =
+      exchange(18642, "GET /upper.txt HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n");
+  EXPECT_TRUE(received.rfind("HTTP/1.1 404 Not Found\r\n", 0) == 0);
+  server.Stop();
+
+  for (const char *name : names)
+    unlink((root + name).c_str());
+  rmdir((root + "/Sub").c_str());
+  rmdir(dir);
+}
+
+void test_content_coding() {
+  EXPECT_TRUE(accepts_encoding("gzip, deflate, br", "br"));
+  EXPECT_TRUE(accepts_encoding("GZIP ;q=0.5", "gzip"));
+  EXPECT_TRUE(!accepts_encoding("gzip;q=0, br", "gzip"));
+  EXPECT_TRUE(!accepts_encoding("gzip;q=0.000", "gzip"));
+  EXPECT_TRUE(accepts_encoding("*", "br"));
+  EXPECT_TRUE(!accepts_encoding("*, br;q=0", "br"));
+  EXPECT_TRUE(!accepts_encoding("identity", "gzip"));
+  EXPECT_TRUE(!accepts_encoding("", "gzip"));
+
+  char dir[] = "/tmp/test_coding.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    EXPECT_TRUE(false);
+    return;
+  }
+  std::string root = dir;
+  auto write_file = [&](const std::string &name, const std::string &content) {
+    int fd = open((root + name).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    EXPECT_TRUE(write(fd, content.data(), content.size()) ==
+                static_cast<ssize_t>(content.size()));
+    close(fd);
+  };
+  std::string text;
+  while (text.size() < 4000)
+    text += "<p>Hello, world!</p>\n";
+  write_file("/app.js", text);
+  write_file("/app.js.gz", "precompressed");
+  write_file("/page.html", text);
+  write_file("/small.html", "<p></p>");
+
+  {
+    Storage storage(root);
+    ResourcePtr resource;
+    EXPECT_TRUE(storage.getResource("/app.js", resource));
+    EXPECT_TRUE(resource->gzip && resource->gzip->content == "precompressed");
+    EXPECT_TRUE(resource->header.find("Vary: Accept-Encoding") != std::string::npos);
+    HttpRequest request;
+    request.SetHeader("Accept-Encoding", "br;q=1, gzip;q=0.8");
+    HttpResponse response = resourceResponse(resource, request);
+    std::string_view header(response.serialized_header().data,
+                            response.serialized_header().length);
+    EXPECT_TRUE(header.find("Content-Encoding: gzip") != std::string_view::npos);
+    request.SetHeader("Accept-Encoding", "gzip;q=0");
+    response = resourceResponse(resource, request);
+    header = std::string_view(response.serialized_header().data,
+                              response.serialized_header().length);
+    EXPECT_TRUE(header.find("Content-Encoding") == std::string_view::npos);
+
+    EXPECT_TRUE(storage.getResource("/small.html", resource));
+    EXPECT_TRUE(!resource->gzip && !resource->brotli);
+    EXPECT_TRUE(resource->header.find("Vary") == std::string::npos);
+
+    EXPECT_TRUE(storage.getResource("/page.html", resource));
+#ifdef SIMPLE_HTTP_SERVER_ZLIB
+    EXPECT_TRUE(resource->gzip && resource->gzip->size < resource->size / 10);
+    EXPECT_TRUE(resource->gzip->header.find("Content-Encoding: gzip") != std::string::npos);
+#else
+    EXPECT_TRUE(!resource->gzip);
+#endif
+  }
+
+  for (const char *name : {"/app.js", "/app.js.gz", "/page.html", "/small.html"})
+    unlink((root + name).c_str());
+  rmdir(dir);
+}
+
+void test_conditional_get() {
+  int64_t seconds = 0;
+  EXPECT_TRUE(format_http_date(784111777) == "Sun, 06 Nov 1994 08:49:37 GMT");
+  EXPECT_TRUE(parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT", &seconds) &&
+              seconds == 784111777);
+  EXPECT_TRUE(!parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT", &seconds));
+  EXPECT_TRUE(!parse_http_date("Sun, 06 Foo 1994 08:49:37 GMT", &seconds));
+  EXPECT_TRUE(matches_etag("\"a\", W/\"b\"", "\"b\""));
+  EXPECT_TRUE(matches_etag("*", "\"b\""));
+  EXPECT_TRUE(!matches_etag("\"a\"", "\"b\""));
+
+  char dir[] = "/tmp/test_conditional.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    EXPECT_TRUE(false);
+    return;
+  }
+  std::string root = dir;
+  int fd = open((root + "/logo.png").c_str(), O_WRONLY | O_CREAT, 0644);
+  EXPECT_TRUE(write(fd, "PNG", 3) == 3);
+  close(fd);
+
+  {
+    Storage storage(root);
+    ResourcePtr resource;
+    EXPECT_TRUE(storage.getResource("/logo.png", resource));
+    EXPECT_TRUE(resource->etag.size() > 2 && resource->etag[0] == '"');
+    EXPECT_TRUE(resource->header.find("ETag: " + resource->etag) != std::string::npos);
+    EXPECT_TRUE(resource->header.find("Last-Modified: ") != std::string::npos);
+
+    HttpRequest request;
+    EXPECT_TRUE(resourceResponse(resource, request).status_code() == HttpStatusCode::Ok);
+    request.SetHeader("If-None-Match", "\"stale\", " + resource->etag);
+    HttpResponse response = resourceResponse(resource, request);
+    EXPECT_TRUE(response.status_code() == HttpStatusCode::NotModified);
+    EXPECT_TRUE(response.body().length == 0);
+    std::string_view header(response.serialized_header().data,
+                            response.serialized_header().length);
+    EXPECT_TRUE(header.find("304 Not Modified") != std::string_view::npos);
+    EXPECT_TRUE(header.find("Content-Length") == std::string_view::npos);
+
+    // If-None-Match wins over If-Modified-Since
+    request.SetHeader("If-None-Match", "\"stale\"");
+    request.SetHeader("If-Modified-Since", format_http_date(resource->mtime / 1000000000));
+    EXPECT_TRUE(resourceResponse(resource, request).status_code() == HttpStatusCode::Ok);
+    request.RemoveHeader("If-None-Match");
+    EXPECT_TRUE(resourceResponse(resource, request).status_code() ==
+                HttpStatusCode::NotModified);
+    request.SetHeader("If-Modified-Since", "Sun, 06 Nov 1994 08:49:37 GMT");
+    EXPECT_TRUE(resourceResponse(resource, request).status_code() == HttpStatusCode::Ok);
+  }
+
+  unlink((root + "/logo.png").c_str());
+  rmdir(dir);
+}
+
+// The body of a response whose pieces are all in memory
+static std::string body_of(const HttpResponse &response) {
+  std::string body(response.body().data, response.body().length);
+  for (const BodySegment &segment : response.more_body())
+    body.append(segment.data, segment.length);
+  return body;
+}
+
+void test_byte_ranges() {
+  ByteRange ranges[kMaxByteRanges];
+  size_t count = 0;
+  EXPECT_TRUE(parse_byte_ranges("bytes=0-499", 1000, ranges, &count) ==
+                  RangeStatus::Satisfiable &&
+              count == 1 && ranges[0].first == 0 && ranges[0].last == 499);
+  EXPECT_TRUE(parse_byte_ranges("bytes=-100, 900-, 990-2000", 1000, ranges, &count) ==
+                  RangeStatus::Satisfiable &&
+              count == 3 && ranges[0].first == 900 && ranges[1].last == 999 &&
+              ranges[2].last == 999);
+  EXPECT_TRUE(parse_byte_ranges("bytes=1000-, -0", 1000, ranges, &count) ==
+              RangeStatus::Unsatisfiable);
+  EXPECT_TRUE(parse_byte_ranges("bytes=5-1", 1000, ranges, &count) == RangeStatus::Ignored);
+  EXPECT_TRUE(parse_byte_ranges("items=0-1", 1000, ranges, &count) == RangeStatus::Ignored);
+  EXPECT_TRUE(parse_byte_ranges("bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8", 1000, ranges,
+                                &count) == RangeStatus::Ignored);
+
+  char dir[] = "/tmp/test_ranges.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    EXPECT_TRUE(false);
+    return;
+  }
+  std::string root = dir;
+  int fd = open((root + "/digits.txt").c_str(), O_WRONLY | O_CREAT, 0644);
+  EXPECT_TRUE(write(fd, "0123456789", 10) == 10);
+  close(fd);
+
+  {
+    Storage storage(root);
+    ResourcePtr resource;
+    EXPECT_TRUE(storage.getResource("/digits.txt", resource));
+    EXPECT_TRUE(resource->header.find("Accept-Ranges: bytes") != std::string::npos);
+
+    HttpRequest request;
+    request.SetHeader("Range", "bytes=2-4");
+    HttpResponse response = resourceResponse(resource, request);
+    EXPECT_TRUE(response.status_code() == HttpStatusCode::PartialContent);
+    EXPECT_TRUE(response.header("Content-Range") == "bytes 2-4/10");
+    EXPECT_TRUE(body_of(response) == "234");
+    // a slice of the cached bytes, not a copy
+    EXPECT_TRUE(response.body().data == resource->content.data() + 2);
+
+    request.SetHeader("Range", "bytes=0-1,-2");
+    response = resourceResponse(resource, request);
+    std::string type(response.header("Content-Type"));
+    std::string boundary = type.substr(type.find("boundary=") + 9);
+    EXPECT_TRUE(type.rfind("multipart/byteranges; boundary=", 0) == 0);
+    std::string body = body_of(response);
+    EXPECT_TRUE(body == "--" + boundary +
+                            "\r\nContent-Type: text/plain; charset=utf-8\r\n"
+                            "Content-Range: bytes 0-1/10\r\n\r\n01\r\n--" +
+                            boundary +
+                            "\r\nContent-Type: text/plain; charset=utf-8\r\n"
+                            "Content-Range: bytes 8-9/10\r\n\r\n89\r\n--" +
+                            boundary + "--\r\n");
+    EXPECT_TRUE(response.header("Content-Length") == std::to_string(body.size()));
+
+    request.SetHeader("Range", "bytes=10-");
+    response = resourceResponse(resource, request);
+    EXPECT_TRUE(response.status_code() == HttpStatusCode::RangeNotSatisfiable);
+    EXPECT_TRUE(response.header("Content-Range") == "bytes */10");
+
+    request.SetHeader("Range", "bytes=2-4");
+    request.SetHeader("If-Range", "\"stale\"");
+    EXPECT_TRUE(resourceResponse(resource, request).status_code() == HttpStatusCode::Ok);
+    request.SetHeader("If-Range", resource->etag);
+    EXPECT_TRUE(resourceResponse(resource, request).status_code() ==
+                HttpStatusCode::PartialContent);
+  }
+
+  unlink((root + "/digits.txt").c_str());
+  rmdir(dir);
+}
+
+struct TimedItem {
+  int id = 0;
+  TimerLink<TimedItem> timer;
+};
+
+void test_streamed_body() {
+  // chunked unless the length is known, replacing any other body
+  HttpResponse response(HttpStatusCode::Ok);
+  response.SetContent("built");
+  response.StreamBody([](char *, size_t) -> size_t { return 0; });
+  EXPECT_TRUE(response.producer() && !response.stream_length() && response.content().empty() &&
+              response.header("Content-Length").empty() &&
+              response.header("Transfer-Encoding") == "chunked");
+  response.StreamBody([](char *, size_t) -> size_t { return 0; }, 1234);
+  EXPECT_TRUE(response.stream_length() == 1234 && response.header("Content-Length") == "1234" &&
+              response.header("Transfer-Encoding").empty());
+
+  // a body set afterwards is not streamed
+  response.SetBody(BodySegment(nullptr, "abc", 3));
+  EXPECT_TRUE(!response.producer() && response.header("Content-Length") == "3");
+  BodyProducer producer = [](char *buffer, size_t) -> size_t {
+    buffer[0] = 'x';
+    return 1;
+  };
+  response.StreamBody(producer);
+  char byte = 0;
+  BodyProducer released = response.ReleaseProducer();
+  EXPECT_TRUE(released(&byte, 1) == 1 && byte == 'x' && !response.producer());
+}
+
+void test_timer_wheel() {
+  using Wheel = TimerWheel<TimedItem, &TimedItem::timer>;
+  Wheel wheel(1000);
+  TimedItem items[4];
+  for (int i = 0; i < 4; i++)
+    items[i].id = i;
+  std::vector<int> fired;
+  auto expire = [&](TimedItem *item) { fired.push_back(item->id); };
+
+  wheel.Arm(&items[0], 1500);
+  wheel.Arm(&items[1], 1500);
+  wheel.Arm(&items[2], 1000 + 200000); // more than a revolution away
+  wheel.Arm(&items[3], 500);           // already passed: fires on the next tick
+  EXPECT_TRUE(Wheel::Armed(&items[0]));
+  wheel.Cancel(&items[1]);
+  EXPECT_TRUE(!Wheel::Armed(&items[1]));
+
+  wheel.Advance(1100, expire);
+  EXPECT_TRUE(fired.size() == 1 && fired[0] == 3);
+  wheel.Arm(&items[0], 1700); // re-armed before it fires
+  wheel.Advance(1600, expire);
+  EXPECT_TRUE(fired.size() == 1);
+  wheel.Advance(1799, expire); // its tick is not over yet
+  EXPECT_TRUE(fired.size() == 1);
+  wheel.Advance(1800, expire);
+  EXPECT_TRUE(fired.size() == 2 && fired[1] == 0 && !Wheel::Armed(&items[0]));
+
+  // the long timer survives the revolutions before its deadline
+  wheel.Advance(1000 + 199900, expire);
+  EXPECT_TRUE(fired.size() == 2 && Wheel::Armed(&items[2]));
+  wheel.Advance(1000 + 200100, expire);
+  EXPECT_TRUE(fired.size() == 3 && fired[2] == 2);
+
+  // a timer can re-arm itself when it fires
+  wheel.Arm(&items[1], 300000);
+  wheel.Advance(300100, [&](TimedItem *item) { wheel.Arm(item, 300500); });
+  EXPECT_TRUE(Wheel::Armed(&items[1]));
+  wheel.Advance(400000, expire);
+  EXPECT_TRUE(fired.size() == 4 && fired[3] == 1);
+}
+
+void test_io_uring() {
+  IoUring ring;
+  if (!ring.Init(8, 4, 16)) {
+    std::cerr << "test_io_uring skipped: io_uring is not available" << std::endl;
+    return;
+  }
+  int fds[2];
+  EXPECT_TRUE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  // a multishot receive lands every write in a provided buffer
+  std::string received;
+  int receives = 0;
+  EXPECT_TRUE(ring.PrepareMultishotRecv(fds[0], 7));
+  auto drain = [&]() {
+    ring.ForEachCompletion([&](const io_uring_cqe &cqe) {
+      EXPECT_TRUE(cqe.user_data == 7 && (cqe.flags & IORING_CQE_F_BUFFER));
+      uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      received.append(ring.Buffer(id), cqe.res);
+      ring.RecycleBuffer(id);
+      receives++;
+    });
+  };
+  for (const char *chunk : {"GET / HTTP/1.1\r\n", "\r\n"}) {
+    EXPECT_TRUE(write(fds[1], chunk, strlen(chunk)) > 0);
+    ring.SubmitAndWait(1000);
+    drain();
+  }
+  EXPECT_TRUE(receives == 2 && received == "GET / HTTP/1.1\r\n\r\n");
+
+  // and a sendmsg gathers its buffers
+  char head[] = "HTTP/1.1 200 OK\r\n\r\n", body[] = "hello";
+  iovec iov[2] = {{head, strlen(head)}, {body, strlen(body)}};
+  msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  EXPECT_TRUE(ring.PrepareSendmsg(fds[0], &msg, MSG_NOSIGNAL, 8));
+  ring.SubmitAndWait(1000);
+  int sent = -1;
+  ring.ForEachCompletion([&](const io_uring_cqe &cqe) {
+    if (cqe.user_data == 8)
+      sent = cqe.res;
+  });
+  char buffer[64] = {};
+  EXPECT_TRUE(sent == 24 && read(fds[1], buffer, sizeof(buffer)) == 24 &&
+              std::string(buffer) == "HTTP/1.1 200 OK\r\n\r\nhello");
+  close(fds[0]);
+  close(fds[1]);
+}
+
+struct QueuedItem {
+  int producer = 0;
+  int sequence = 0;
+  QueuedItem *next = nullptr;
+};
+
+void test_offload_executor() {
+  // every item comes out once, in the order its producer pushed it
+  MpscQueue<QueuedItem, &QueuedItem::next> queue;
+  const int producers = 4, items = 10000;
+  std::vector<QueuedItem> pushed(producers * items);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&, p]() {
+      for (int i = 0; i < items; i++) {
+        QueuedItem &item = pushed[p * items + i];
+        item.producer = p;
+        item.sequence = i;
+        queue.Push(&item);
+      }
+    });
+  }
+  std::vector<int> last(producers, -1);
+  int popped = 0;
+  bool ordered = true;
+  while (popped < producers * items) {
+    for (QueuedItem *item = queue.PopAll(); item != nullptr; item = item->next) {
+      ordered = ordered && item->sequence == last[item->producer] + 1;
+      last[item->producer] = item->sequence;
+      popped++;
+    }
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+  EXPECT_TRUE(ordered && popped == producers * items && queue.PopAll() == nullptr);
+  QueuedItem item;
+  EXPECT_TRUE(queue.Push(&item) && !queue.Push(&pushed[0]));
+
+  // a job queued behind a slow one is stolen by the idle thread
+  Executor executor;
+  executor.Start(2);
+  std::atomic<bool> stolen(false), slow_done(false);
+  std::atomic<int> count(0);
+  executor.Submit([&]() { // queue 0
+    for (int i = 0; i < 5000 && !stolen; i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    slow_done = true;
+  });
+  executor.Submit([&]() { count++; }); // queue 1
+  executor.Submit([&]() { stolen = !slow_done; }); // queue 0, behind the slow job
+  for (int i = 0; i < 1000; i++)
+    executor.Submit([&]() { count++; });
+  executor.Stop(); // runs everything that was queued
+  EXPECT_TRUE(stolen && slow_done && count == 1001);
+
+  // jobs submitted while the threads fall asleep are not left waiting
+  executor.Start(4);
+  std::atomic<int> ran(0);
+  std::vector<std::thread> submitters;
+  for (int p = 0; p < 4; p++) {
+    submitters.emplace_back([&]() {
+      for (int i = 0; i < 2000; i++) {
+        executor.Submit([&]() { ran++; });
+        if (i % 100 == 0)
+          std::this_thread::sleep_for(std::chrono::microseconds(200));
+      }
+    });
+  }
+  for (std::thread &thread : submitters)
+    thread.join();
+  for (int i = 0; i < 5000 && ran < 8000; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_TRUE(ran == 8000);
+  executor.Stop();
+}
+
+void test_offload_during_send() {
+  // a blocking or coroutine handler completes while the response in front
+  // of it is still being sent to a client that does not read yet
+  char dir[] = "/tmp/test_offload.XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    EXPECT_TRUE(false);
+    return;
+  }
+  std::string large(8 << 20, 'L');
+  for (size_t i = 0; i < large.length(); i += 4096)
+    large[i] = static_cast<char>('a' + i / 4096 % 26);
+  for (IoBackend backend : {IoBackend::Epoll, IoBackend::IoUring}) {
+    HttpServer server("127.0.0.1", 18641);
+    server.SetIoBackend(backend);
+    server.ServeDirectory("/", dir);
+    server.RegisterHttpRequestHandler("/large", HttpMethod::GET,
+                                      [&](const HttpRequest &, Storage *) {
+                                        HttpResponse response(HttpStatusCode::Ok);
+                                        response.SetContent(large);
+                                        return response;
+                                      });
+    server.RegisterHttpRequestHandler("/small", HttpMethod::GET,
+                                      [](const HttpRequest &, Storage *) {
+                                        HttpResponse response(HttpStatusCode::Ok);
+                                        response.SetContent(std::string(3000, 's'));
+                                        return response;
+                                      });
+    server.RegisterHttpRequestHandler(
+        "/blocking", HttpMethod::GET,
+        [](const HttpRequest &, Storage *) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(20));
+          HttpResponse response(HttpStatusCode::Ok);
+          response.SetContent(std::string(5000, 'b'));
+          return response;
+        },
+        HandlerMode::Blocking);
+    server.RegisterHttpRequestHandler(
+        "/sleeping", HttpMethod::GET, [](const HttpRequest &, Storage *) -> Task<HttpResponse> {
+          co_await SleepFor(std::chrono::milliseconds(20));
+          HttpResponse response(HttpStatusCode::Ok);
+          response.SetContent(std::string(5000, 'b'));
+          co_return response;
+        });
+    server.Start();
+    for (std::string last : {"/blocking", "/sleeping"}) {
+      std::string received = exchange(18641,
+                                      "GET /large HTTP/1.1\r\nHost: a\r\n\r\n"
+                                      "GET /small HTTP/1.1\r\nHost: a\r\n\r\n"
+                                      "GET " + last + " HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n",
+                                      std::chrono::milliseconds(300));
+      size_t first = received.find("\r\n\r\n");
+      size_t second = received.find("\r\n\r\n", first + 4 + large.length());
+      size_t third = received.find("\r\n\r\n", second + 4 + 3000);
+      EXPECT_TRUE(third != std::string::npos &&
+                  received.compare(first + 4, large.length(), large) == 0 &&
+                  received.compare(second + 4, 3000, std::string(3000, 's')) == 0 &&
+                  received.substr(third + 4) == std::string(5000, 'b'));
+    }
+    server.Stop();
+  }
+  rmdir(dir);
+}
+
+// Parks what coroutines wait for, so that the test resumes them
+struct ManualWorker : AsyncWorker {
+  std::vector<Waiter *> sleeping, working;
+  void ResumeAt(std::uint64_t, Waiter *waiter) override { sleeping.push_back(waiter); }
+  bool ResumeWhenReady(Waiter *waiter) override {
+    waiter->result = -EBADF;
+    return false;
+  }
+  void ResumeAfterWork(Waiter *waiter) override { working.push_back(waiter); }
+};
+
+Task<int> Twice(int value) { co_return value * 2; }
+
+Task<int> SleepThenAdd(int value) {
+  co_await SleepFor(std::chrono::milliseconds(50));
+  int doubled = co_await Twice(value);
+  int tripled = co_await RunBlocking([value]() { return value * 3; });
+  co_return doubled + tripled;
+}
+
+Task<std::string> Throwing() {
+  co_await Twice(1);
+  throw std::invalid_argument("bad");
+}
+
+Task<int> Catching() {
+  bool caught = false;
+  try {
+    co_await Throwing();
+  } catch (const std::invalid_argument &) {
+    caught = true;
+  }
+  co_return caught ? co_await WaitReadable(-1) : 0;
+}
+
+void test_coroutine_tasks() {
+  // a task that never suspends completes within Start()
+  Task<int> inline_task = Twice(21);
+  bool told = false;
+  EXPECT_TRUE(inline_task.Start([&]() { told = true; }) && !told &&
+              inline_task.Result() == 42);
+
+  // the worker resumes it after the timer and after the executor
+  ManualWorker worker;
+  AsyncWorker::SetCurrent(&worker);
+  Task<int> task = SleepThenAdd(5);
+  EXPECT_TRUE(!task.Start([&]() { told = true; }) && worker.sleeping.size() == 1);
+  worker.sleeping[0]->handle.resume();
+  EXPECT_TRUE(!task.done() && worker.working.size() == 1);
+  worker.working[0]->work();
+  worker.working[0]->handle.resume();
+  EXPECT_TRUE(told && task.done() && task.Result() == 25);
+
+  // exceptions reach the awaiting task, and a failed wait gives -errno
+  Task<int> catching = Catching();
+  EXPECT_TRUE(catching.Start(nullptr) && catching.Result() == -EBADF);
+  Task<std::string> throwing = Throwing();
+  bool thrown = false;
+  throwing.Start(nullptr);
+  try {
+    throwing.Result();
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  EXPECT_TRUE(thrown);
+  AsyncWorker::SetCurrent(nullptr);
+
+  // awaiting outside of a worker throws instead of hanging
+  Task<int> orphan = SleepThenAdd(1);
+  thrown = false;
+  orphan.Start(nullptr);
+  try {
+    orphan.Result();
+  } catch (const std::logic_error &) {
+    thrown = true;
+  }
+  EXPECT_TRUE(thrown);
+}
+
 int main(void) {
   std::cout << "Running tests..." << std::endl;
 
@@ -90,6 +1157,26 @@ int main(void) {
   test_string_to_version();
   test_request_to_string();
   test_response_to_string();
+  test_string_to_request();
+  test_parse_request();
+  test_request_body();
+  test_multipart();
+  test_scan_kernels();
+  test_header_list();
+  test_router();
+  test_route_case();
+  test_normalize_path();
+  test_storage_cache();
+  test_serve_mixed_case();
+  test_content_coding();
+  test_conditional_get();
+  test_byte_ranges();
+  test_streamed_body();
+  test_timer_wheel();
+  test_io_uring();
+  test_offload_executor();
+  test_offload_during_send();
+  test_coroutine_tasks();
 
   std::cout << "All tests have finished. There were " << err
             << " errors in total" << std::endl;